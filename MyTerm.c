@@ -1,8 +1,11 @@
 #define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE // posix_spawn_file_actions_addchdir_np
 
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/keysym.h>
+#include <X11/Xft/Xft.h>
+#include <X11/extensions/XShm.h>
 #include <locale.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,1054 +19,6135 @@
 #include <time.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <limits.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <termios.h>
 #include <dirent.h>
 #include <pwd.h>
 #include <strings.h>
+#include <spawn.h>
 
 #define WIDTH 800
 #define HEIGHT 600
 #define LINE_H 20
-#define MAX_LINES 1000
+#define MAX_LINES 1000 // Newest lines kept uncompressed per tab
 #define BUFSIZE 8192
+#define LINE_SPLIT (BUFSIZE - 1) // Output lines longer than this are split
 #define PROMPT "user@myterm> "
-#define MAX_TABS 10
 #define HISTORY_FILE ".myterm_history.txt"
+#define HISTORY_JOURNAL ".myterm_history"
 #define MAX_HISTORY_LINES 10000
+#define HISTORY_SYNC_MS 1000	 // Default delay before queued history is written, MYTERM_HISTORY_SYNC_MS
+#define HISTORY_COMPACT_MIN 1000 // Entries a history file needs before it is compacted
+#define FONT_NAME "monospace:pixelsize=18"
+
+#define SB_CHUNK_SIZE 65536 // Bytes of line text per scrollback chunk
+#define SB_SPARE_CHUNKS 2	 // Emptied chunks kept for reuse instead of freed
+#define SB_WRAP_BUDGET 262144 // Bytes of cached row breaks before the cache starts over
+#define LINE_BREAKS_LOCAL 512 // Row breaks gathered on the stack before a line is stored
+#define SB_SEGMENT_LINES 256  // Lines compressed together once they leave the ring
+#define SB_COLD_VIEWS 4		  // Cold segments kept unpacked for scrolling
+
+// Bump allocator. Nothing is freed on its own: an arena is reset or freed
+// as a whole, which costs one free() per block however much was allocated.
+typedef struct ArenaBlock ArenaBlock;
+
+struct ArenaBlock
+{
+	ArenaBlock *next;
+	size_t size;
+	size_t used;
+	char data[];
+};
+
+typedef struct
+{
+	ArenaBlock *blocks; // Newest first
+	size_t block_size;
+	size_t used; // Bytes handed out since the last reset
+} Arena;
+
+typedef struct TextChunk TextChunk;
+
+struct TextChunk
+{
+	TextChunk *next;
+	int used;	   // Bytes handed out so far
+	int live;	   // Lines in the ring still pointing into this chunk
+	char data[SB_CHUNK_SIZE];
+};
 
 typedef struct
 {
 	char *text;
+	int len;
+	TextChunk *chunk;
+	// Soft-wrap layout, valid while wrap_epoch matches the scrollback's
+	unsigned wrap_epoch;
+	int nrows;
+	unsigned short *breaks; // Start offset of each wrapped row after the first, in `wraps`
 } Line;
 
+// A wrapped row: row `row` of the line with sequence number `seq`
+typedef struct
+{
+	long long seq;
+	int row;
+} RowPos;
+
+// SB_SEGMENT_LINES lines that have left the ring, compressed. Over the
+// memory budget a segment moves to the spill file, if there is one.
+typedef struct
+{
+	long long first_seq;
+	int nlines;
+	int raw_size;
+	int packed_size;
+	unsigned char *packed; // NULL once spilled
+	off_t offset;		   // Position in the spill file
+} ColdSegment;
+
+// An unpacked segment, so scrolling through one costs one decompression
+typedef struct
+{
+	long long first_seq; // -1 when unused
+	char *raw;
+	int raw_cap;
+	Line *lines;
+	int lines_cap;
+	unsigned last_use;
+} ColdView;
+
+typedef struct
+{
+	ColdSegment *segs;
+	int first;	 // Oldest segment still held
+	int spilled; // Segments before this one are on disk
+	int nsegs;
+	int seg_cap;
+	size_t raw_bytes;	 // Unpacked size of the segments held
+	size_t mem_bytes;	 // Compressed bytes held in memory
+	size_t spill_bytes;	 // Compressed bytes in the spill file
+	size_t spill_dead;	 // Spill file bytes of dropped segments
+	off_t spill_end;
+	int spill_fd;		 // -1 until the first spill
+	int spill_failed;
+	unsigned char *raw;	 // Segment being packed
+	int raw_cap;
+	unsigned char *pack; // Compressor output and spill reads
+	int pack_cap;
+	ColdView views[SB_COLD_VIEWS];
+	unsigned clock;
+} ColdStore;
+
+// All output of a tab. The newest MAX_LINES lines live in a ring with their
+// text packed back to back into chunks, so chunks fill and empty in the
+// same order as the ring and an emptied chunk can be recycled whole. The
+// ring starts small and doubles as lines arrive, so a quiet tab costs
+// almost nothing. Older lines are compressed into the cold store.
+typedef struct
+{
+	Line *ring;
+	int cap;			 // Ring slots allocated, at most MAX_LINES
+	int head;			 // Ring slot of the oldest hot line
+	int hot;			 // Lines in the ring, the newest `hot` of `count`
+	int count;			 // Lines currently held, cold and hot
+	long long first_seq; // Sequence number of the oldest line; never reused
+	TextChunk *first_chunk;
+	TextChunk *last_chunk;
+	TextChunk *spare_chunks;
+	int spare_count;
+	Arena wraps;		 // Row breaks of wrapped lines
+	unsigned wrap_epoch; // Bumped whenever `wraps` is reset
+	int wrap_width;		 // Row width the current epoch was laid out for
+	ColdStore cold;
+} Scrollback;
+
+// Splits a stream of child output into lines. A line that straddles two
+// reads is carried in `partial` until its newline arrives.
+typedef struct
+{
+	char *partial; // LINE_SPLIT bytes, allocated on the first carry
+	int partial_len;
+} LineFramer;
+
 typedef struct Tab Tab;
 
+#define MAX_MW_CMDS 64
+
+// A running multiWatch: each command writes to its own temp file, which
+// the main loop reads on a timer.
 typedef struct
 {
-	pid_t pid;
-	char command[BUFSIZE];
+	int ncmd;
+	char args[BUFSIZE]; // `commands` point into this copy of the argument line
+	char *commands[MAX_MW_CMDS];
+	pid_t pids[MAX_MW_CMDS];
+	int fds[MAX_MW_CMDS];
+	char tempfiles[MAX_MW_CMDS][256];
+	LineFramer framers[MAX_MW_CMDS];
+} MultiWatch;
+
+// Life cycle of a foreground command. The main loop moves a job along as
+// its output fd and SIGCHLD notifications become ready.
+typedef enum
+{
+	JOB_IDLE,
+	JOB_SPAWNED,   // Processes forked, no output read yet
+	JOB_STREAMING, // Output arriving while processes run
+	JOB_DRAINING,  // Every process exited; reading what is left in the pipe
+	JOB_REAPED     // Output closed and processes collected; ready to report
+} JobState;
+
+typedef struct
+{
+	JobState state;
+	pid_t pgid;		// Process group holding every process of the job
+	pid_t last_pid; // Pipeline stage whose exit status is reported
+	int last_status;
+	int out_fd; // Read end of the output pipe, -1 once closed
+	LineFramer framer;
+	char *command;
+	MultiWatch *mw; // Set for multiWatch jobs, which read temp files instead
+	int coproc;		// Run in the tab's persistent shell; ends at its marker line
+} Job;
+
+typedef struct
+{
+	pid_t pid; // Process group of the stopped job
+	pid_t last_pid;
+	int out_fd;
+	char *command;
 } SuspendedProcess;
 
+// Ctrl+F search through a tab's scrollback. `hits` lists, in order, lines
+// before `scanned_end` that contain `scanned`, the query they were
+// collected for. After the query grows, the old hits are checked again
+// where they lie: the first `ncands` entries become candidates, and those
+// that still match are moved down to the front as hits. Entries left
+// behind are -1. Every other line before `scanned_end` is known not to match.
+typedef struct
+{
+	char *term;
+	int cap;
+	int len;
+	char *scanned;
+	int scanned_cap;
+	int scanned_len;
+	long long scanned_end;
+	long long *hits;
+	int nhits;
+	int hits_cap;
+	int ncands;
+	int cand_next;	  // First candidate not checked yet
+	int select_pending; // Pick the current match once the scan is done
+	long long origin;  // Line the search started from
+	long long cur_seq; // Line of the current match, -1 if none
+	int cur_off;	   // Its byte offset in that line
+	unsigned generation; // Bumped whenever highlights or the status change
+} Finder;
+
+// One command run in a tab and the scrollback lines it produced
+typedef struct
+{
+	long long prompt_seq; // The prompt line; the command line follows it
+	long long out_seq;	  // First line of output
+	long long end_seq;	  // One past the last line of output, -1 while running
+	time_t start_time;
+	double started; // now_seconds() when it started
+	double duration;
+	int status; // Exit status, 128 + signal if killed or stopped, -1 while running
+	int collapsed;
+	char *command; // Command line and working directory, until journaled
+	char *cwd;
+} CommandRecord;
+
+// The commands of a tab in the order they ran. recs[first..count) are
+// still in the scrollback.
+typedef struct
+{
+	CommandRecord *recs;
+	int first;
+	int count;
+	int cap;
+	int collapsed;	   // Records currently collapsed
+	int cursor;		   // Record last jumped to, -1 if none
+	RowPos cursor_top; // View top right after that jump
+} CommandIndex;
+
+// Ctrl+R candidates for the tab's query: history entries, best first
+typedef struct
+{
+	int *results;
+	int count;
+	int selected; // The one shown
+} HistorySearch;
+
+// Tabs live on the heap and their buffers grow as they are used, so an
+// idle tab costs a few hundred bytes.
 struct Tab
 {
-	char input_buf[BUFSIZE];
+	char *input_buf;
+	int input_cap;
 	int in_pos;
-	Line lines[MAX_LINES];
-	int line_count;
-	pid_t shell_pid;
+	Scrollback lines;
+	pid_t shell_pid; // The persistent shell, 0 if none
 	int shell_stdin[2];
 	int shell_stdout[2];
+	char shell_mark[32]; // Starts the line the shell prints after each command
+	char *shell_carry;	 // Output held back while it may be the start of that line
+	int shell_carry_len;
+	int shell_carry_cap;
 	char tab_name[32];
-	int scroll_offset;
-	char search_term[BUFSIZE];
+	int number; // As first named, for the history journal
+	int scrolled; // Viewing older output instead of following the bottom
+	RowPos view;  // Top row of the view while scrolled
+	char *search_term;
+	int search_cap;
 	int search_pos;
 	int in_search_mode;
+	HistorySearch hsearch;
+	int in_find_mode;
+	Finder find;
+	CommandIndex commands;
 
-	char *auto_complete_list[100];
+	char *auto_complete_list[100]; // In `scratch`
 	int auto_complete_count;
+	Arena scratch; // Transient strings, reset before each command
 
-	volatile sig_atomic_t child_pid;
+	Job job;
+	int builtin_status; // Status of a command that ended without a job, for its history record
+	struct Frame *frame; // What is painted for this tab, created on first paint
 
 	volatile sig_atomic_t background_pids[10];
 	int bg_pid_count;
 
-	char current_directory[BUFSIZE];
+	char *current_directory;
 
 	SuspendedProcess suspended_processes[10];
 	int suspended_count;
 };
 
-static Tab tabs[MAX_TABS];
+static Tab **tabs; // In tab bar order
+static int tab_capacity = 0;
 static int current_tab = 0;
-static int tab_count = 1;
+static int tab_count = 0;
+static unsigned tab_generation = 0; // Bumped when tabs are added or removed
 
 static Display *dpy;
 static Window win;
+static int win_width = WIDTH, win_height = HEIGHT; // Current window size
 static GC gc;
-static XFontStruct *font;
+static XftFont *font;
 static Colormap colormap;
-static XColor green_color, white_color;
+static XftColor green_color, white_color, black_color;
+static XftColor match_color, current_match_color; // Scrollback search highlights
+static XIC input_context;
 
 /* -------------------- Function Declarations -------------------- */
 static void add_line_to_tab(Tab *tab, const char *s);
 static void add_line_to_current_tab(const char *s);
 static void add_line(const char *s);
-
-/* -------------------- History File Management -------------------- */
-static void load_history()
+static void job_start(Tab *tab, pid_t pgid, pid_t last_pid, int out_fd, const char *command);
+static void job_discard(Tab *tab);
+static void shell_stop(Tab *tab);
+static void free_tab_frame(Tab *tab);
+static void tab_switched();
+static double now_seconds();
+static int find_text(const char *hay, int n, const char *needle, int m);
+
+/* -------------------- Buffers -------------------- */
+// Grows a text buffer to hold `len` bytes plus the terminator. Returns 0
+// if there is no memory for it.
+static int reserve_text(char **buf, int *cap, int len)
 {
-	char hist_path[BUFSIZE];
-	snprintf(hist_path, sizeof(hist_path), "./%s", HISTORY_FILE);
-	FILE *f = fopen(hist_path, "a");
-	if (f)
-		fclose(f);
+	if (len < *cap)
+		return 1;
+	int new_cap = *cap ? *cap : 64;
+	while (new_cap <= len)
+		new_cap *= 2;
+	char *grown = realloc(*buf, new_cap);
+	if (!grown)
+		return 0;
+	*buf = grown;
+	*cap = new_cap;
+	return 1;
 }
 
-static void save_to_history(const char *cmd)
+static void *arena_alloc(Arena *a, size_t n)
 {
-	if (!cmd || strlen(cmd) == 0)
-		return;
+	n = (n + 7) & ~(size_t)7;
+	ArenaBlock *b = a->blocks;
+	if (!b || b->size - b->used < n)
+	{
+		size_t size = n > a->block_size ? n : a->block_size;
+		b = malloc(sizeof(ArenaBlock) + size);
+		if (!b)
+			return NULL;
+		b->next = a->blocks;
+		b->size = size;
+		b->used = 0;
+		a->blocks = b;
+	}
+	void *p = b->data + b->used;
+	b->used += n;
+	a->used += n;
+	return p;
+}
 
-	char hist_path[BUFSIZE];
-	snprintf(hist_path, sizeof(hist_path), "./%s", HISTORY_FILE);
+static char *arena_strdup(Arena *a, const char *s)
+{
+	size_t len = strlen(s);
+	char *copy = arena_alloc(a, len + 1);
+	if (copy)
+		memcpy(copy, s, len + 1);
+	return copy;
+}
 
-	FILE *file = fopen(hist_path, "a");
-	if (!file)
+// Drops everything allocated so far. The newest block is kept for reuse.
+static void arena_reset(Arena *a)
+{
+	ArenaBlock *keep = a->blocks;
+	if (!keep)
 		return;
+	ArenaBlock *b = keep->next;
+	while (b)
+	{
+		ArenaBlock *next = b->next;
+		free(b);
+		b = next;
+	}
+	keep->next = NULL;
+	keep->used = 0;
+	a->used = 0;
+}
 
-	fprintf(file, "%s\n", cmd);
-	fclose(file);
+static void arena_free(Arena *a)
+{
+	arena_reset(a);
+	free(a->blocks);
+	a->blocks = NULL;
 }
 
-static void show_history_from_file(Tab *tab)
+/* -------------------- History File Management -------------------- */
+// History is an append-only binary journal plus an index of it:
+//
+//   ~/.myterm_history      "MYTHIST1", then one record per command run
+//   ~/.myterm_history.idx  the journal offset of each record, 8 bytes each
+//
+// The n-th most recent record is at idx[count - 1 - n], so a reader that
+// maps both files reaches any record in O(1). A record is written when
+// its command ends and holds the command, start time, duration, exit
+// status, tab and working directory. Records are in host byte order and
+// padded to 8 bytes so they can be read in place from the mapping.
+//
+// At startup the journal is mapped and its commands indexed in memory;
+// Ctrl+R and the plain `history` listing never touch the files again.
+#define HISTORY_MAGIC "MYTHIST1"
+#define HREC_MAGIC 0x43524d48u // "HMRC"
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t size;	  // Whole record, padded to 8 bytes
+	int64_t start_ms; // Unix time, 0 if unknown
+	uint32_t duration_ms;
+	int32_t status; // Exit status, 128 + signal if killed or stopped, -1 if unknown
+	uint32_t tab;
+	uint32_t cmd_len;
+	uint32_t cwd_len;
+	uint32_t reserved;
+} HistoryRecord; // Followed by the command and the directory, unterminated
+
+typedef struct
+{
+	const char *text;  // Not terminated; in the mapped journal or in `added`
+	const char *lower; // ASCII-lowercased copy for searching, once indexed
+	int len;
+} HistoryEntry;
+
+// A read-only mapping of the journal and its index
+typedef struct
 {
-	char hist_path[BUFSIZE];
-	snprintf(hist_path, sizeof(hist_path), "./%s", HISTORY_FILE);
+	char *data;
+	size_t data_len;
+	uint64_t *idx;
+	size_t idx_len;
+	int count;
+} HistoryReader;
 
-	FILE *file = fopen(hist_path, "r");
-	if (!file)
+typedef struct
+{
+	HistoryReader file; // As it was at startup
+	HistoryEntry *entries; // Oldest first
+	int count;
+	int cap;
+	Arena added; // Text of commands run or imported since startup
+} HistoryStore;
+
+static HistoryStore history = {.added = {NULL, 16384, 0}};
+
+// Records of finished commands are queued and appended in batches: one
+// write() and one fdatasync() per file per batch, at most sync_ms after
+// the first was queued
+typedef struct
+{
+	char *path;		// The journal
+	char *idx_path; // Its index
+	int fd;			// O_APPEND, -1 when closed
+	int idx_fd;
+	char *pending;
+	int pending_len;
+	int pending_cap;
+	double pending_since; // When the oldest queued record was queued, 0 if none
+	int sync_ms;
+} HistoryWriter;
+
+static HistoryWriter writer = {.fd = -1, .idx_fd = -1, .sync_ms = HISTORY_SYNC_MS};
+
+static void history_flush();
+
+static int history_push(const char *text, int len)
+{
+	if (history.count == history.cap)
 	{
-		add_line_to_tab(tab, "No history found");
-		return;
+		int new_cap = history.cap ? history.cap * 2 : 1024;
+		HistoryEntry *grown = realloc(history.entries, new_cap * sizeof(HistoryEntry));
+		if (!grown)
+			return 0;
+		history.entries = grown;
+		history.cap = new_cap;
 	}
+	history.entries[history.count++] = (HistoryEntry){text, NULL, len};
+	return 1;
+}
 
-	// Count total lines
-	int total_lines = 0;
-	char line[BUFSIZE];
-	while (fgets(line, sizeof(line), file))
-		total_lines++;
-	fclose(file);
+static const char *record_command(const HistoryRecord *r)
+{
+	return (const char *)(r + 1);
+}
 
-	// Reopen and show last 1000 lines
-	file = fopen(hist_path, "r");
-	if (!file)
-		return;
+static const char *record_cwd(const HistoryRecord *r)
+{
+	return (const char *)(r + 1) + r->cmd_len;
+}
 
-	int start_line = (total_lines > 1000) ? total_lines - 1000 : 0;
-	int current_line = 0;
+// The record at offset `off` of a journal, or NULL if it is cut short or damaged
+static const HistoryRecord *record_at(const char *data, size_t len, uint64_t off)
+{
+	if (off % 8 || off < 8 || off + sizeof(HistoryRecord) > len)
+		return NULL;
+	const HistoryRecord *r = (const HistoryRecord *)(data + off);
+	if (r->magic != HREC_MAGIC || r->size % 8 || r->size > len - off ||
+		sizeof(HistoryRecord) + (uint64_t)r->cmd_len + r->cwd_len > r->size)
+		return NULL;
+	return r;
+}
 
-	while (fgets(line, sizeof(line), file))
-	{
-		if (current_line >= start_line)
-		{
-			line[strcspn(line, "\n")] = 0;
-			char display_line[BUFSIZE];
-			int max_line_len = sizeof(display_line) - 20; // Reserve space for line number
-			if (max_line_len < 0)
-				max_line_len = 0;
-			snprintf(display_line, sizeof(display_line), "%5d  %.*s", current_line + 1, max_line_len, line);
-			add_line_to_tab(tab, display_line);
-		}
-		current_line++;
-	}
-	fclose(file);
+// The n-th most recent record, counting from 0
+static const HistoryRecord *reader_record(const HistoryReader *rd, int n)
+{
+	if (n < 0 || n >= rd->count)
+		return NULL;
+	return record_at(rd->data, rd->data_len, rd->idx[rd->count - 1 - n]);
+}
+
+static void *map_file(int fd, size_t *len)
+{
+	struct stat st;
+	*len = 0;
+	if (fstat(fd, &st) < 0 || st.st_size == 0)
+		return NULL;
+	void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	*len = st.st_size;
+	return p;
 }
 
-static void search_in_history(const char *term, Tab *tab)
+static void reader_close(HistoryReader *rd)
 {
-	char hist_path[BUFSIZE];
-	snprintf(hist_path, sizeof(hist_path), "./%s", HISTORY_FILE);
+	if (rd->data)
+		munmap(rd->data, rd->data_len);
+	if (rd->idx)
+		munmap(rd->idx, rd->idx_len);
+	memset(rd, 0, sizeof(*rd));
+}
 
-	FILE *file = fopen(hist_path, "r");
-	if (!file)
+// Opens and flocks the journal. A compaction may replace it between the
+// open and the lock, so the lock only counts if the path still names the
+// file that was opened.
+static int journal_lock(int flags, int lock)
+{
+	for (int tries = 0; tries < 5; tries++)
 	{
-		add_line_to_tab(tab, "No history found - history file doesn't exist yet");
-		return;
+		int fd = open(writer.path, flags | O_CLOEXEC, 0600);
+		if (fd < 0)
+			return -1;
+		struct stat open_st, path_st;
+		if (flock(fd, lock) == 0 && fstat(fd, &open_st) == 0 && stat(writer.path, &path_st) == 0 &&
+			open_st.st_ino == path_st.st_ino && open_st.st_dev == path_st.st_dev)
+			return fd;
+		close(fd);
 	}
+	return -1;
+}
 
-	// Read all lines into an array for reverse search
-	char lines[1000][BUFSIZE];
-	int line_count = 0;
-
-	while (fgets(lines[line_count], sizeof(lines[line_count]), file) && line_count < 1000)
+// Maps the journal and its index as they are now
+static int reader_open(HistoryReader *rd)
+{
+	memset(rd, 0, sizeof(*rd));
+	int fd = journal_lock(O_RDONLY, LOCK_SH);
+	if (fd < 0)
+		return 0;
+	rd->data = map_file(fd, &rd->data_len);
+	int idx_fd = open(writer.idx_path, O_RDONLY | O_CLOEXEC);
+	if (idx_fd >= 0)
 	{
-		lines[line_count][strcspn(lines[line_count], "\n")] = 0; // Remove newline
-		line_count++;
+		rd->idx = map_file(idx_fd, &rd->idx_len);
+		close(idx_fd);
 	}
-	fclose(file);
+	rd->count = rd->idx_len / sizeof(uint64_t);
+	// The mapping keeps the open file, and so the lock, alive past close()
+	flock(fd, LOCK_UN);
+	close(fd);
+	return 1;
+}
 
-	if (line_count == 0)
+// Opens the writer's descriptors, locked exclusively. A new journal gets its header.
+static int writer_lock()
+{
+	if (writer.fd < 0)
 	{
-		add_line_to_tab(tab, "No commands in history yet");
-		return;
+		writer.fd = journal_lock(O_RDWR | O_APPEND | O_CREAT, LOCK_EX);
+		if (writer.fd < 0)
+			return 0;
+		writer.idx_fd = open(writer.idx_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
 	}
-
-	// Search from most recent to oldest (reverse order)
-	char *matches[100];
-	int match_count = 0;
-
-	for (int i = line_count - 1; i >= 0 && match_count < 100; i--)
+	else
 	{
-		if (strstr(lines[i], term) != NULL)
+		struct stat open_st, path_st;
+		if (flock(writer.fd, LOCK_EX) < 0 || fstat(writer.fd, &open_st) < 0 || stat(writer.path, &path_st) < 0 ||
+			open_st.st_ino != path_st.st_ino || open_st.st_dev != path_st.st_dev)
 		{
-			matches[match_count++] = strdup(lines[i]);
+			// Replaced by a compaction: start over on the new files
+			close(writer.fd);
+			if (writer.idx_fd >= 0)
+				close(writer.idx_fd);
+			writer.fd = writer.idx_fd = -1;
+			return writer_lock();
 		}
 	}
-
-	if (match_count == 0)
+	if (writer.idx_fd < 0)
 	{
-		add_line_to_tab(tab, "No match found in history");
+		flock(writer.fd, LOCK_UN);
+		return 0;
 	}
-	else if (match_count == 1)
+	struct stat st;
+	if (fstat(writer.fd, &st) == 0 && st.st_size == 0 && write(writer.fd, HISTORY_MAGIC, 8) != 8)
 	{
-		strcpy(tab->input_buf, matches[0]);
-		tab->in_pos = strlen(tab->input_buf);
-		free(matches[0]);
-		add_line_to_tab(tab, "Command found");
+		// No half header for the next writer to append after
+		ftruncate(writer.fd, 0);
+		flock(writer.fd, LOCK_UN);
+		return 0;
 	}
-	else
+	return 1;
+}
+
+// Appends the queued records and their offsets. The exclusive lock keeps
+// other instances from appending in between, so the offsets are known.
+static void history_flush()
+{
+	if (writer.pending_len == 0 || !writer.path || !writer_lock())
+		return;
+
+	struct stat st, idx_st;
+	int n = 0;
+	for (int off = 0; off < writer.pending_len; off += ((HistoryRecord *)(writer.pending + off))->size)
+		n++;
+	uint64_t *offsets = malloc(n * sizeof(uint64_t));
+	if (offsets && fstat(writer.fd, &st) == 0 && fstat(writer.idx_fd, &idx_st) == 0)
 	{
-		add_line_to_tab(tab, "Multiple matches found (using most recent):");
-		for (int i = 0; i < match_count && i < 10; i++)
+		int k = 0;
+		for (int off = 0; off < writer.pending_len; off += ((HistoryRecord *)(writer.pending + off))->size)
+			offsets[k++] = st.st_size + off;
+		ssize_t idx_len = n * sizeof(uint64_t);
+		if (write(writer.fd, writer.pending, writer.pending_len) == writer.pending_len &&
+			write(writer.idx_fd, offsets, idx_len) == idx_len &&
+			fdatasync(writer.fd) == 0 && fdatasync(writer.idx_fd) == 0)
+		{
+			writer.pending_len = 0;
+			writer.pending_since = 0;
+		}
+		else
 		{
-			char display_line[BUFSIZE];
-			// FIXED: Clean each displayed line
-			char clean_match[BUFSIZE];
-			strncpy(clean_match, matches[i], sizeof(clean_match) - 1);
-			clean_match[sizeof(clean_match) - 1] = '\0';
-			snprintf(display_line, sizeof(display_line), "  %d. %.*s", i + 1, (int)sizeof(display_line) - 20, clean_match);
-			add_line_to_tab(tab, display_line);
+			// Take back whatever part of the batch got written, so the
+			// index stays in step and the retry does not append a second
+			// copy after a fragment
+			ftruncate(writer.fd, st.st_size);
+			ftruncate(writer.idx_fd, idx_st.st_size);
 		}
-		strcpy(tab->input_buf, matches[0]);
-		tab->in_pos = strlen(tab->input_buf);
-		free(matches[0]);
 	}
+	free(offsets);
+	flock(writer.fd, LOCK_UN);
+}
 
-	// Free remaining matches
-	for (int i = 1; i < match_count; i++)
-	{
-		free(matches[i]);
-	}
+// Milliseconds until queued history is due to be written, or -1
+static int history_timeout()
+{
+	if (writer.pending_len == 0)
+		return -1;
+	double left = writer.pending_since + writer.sync_ms / 1000.0 - now_seconds();
+	return left > 0 ? (int)(left * 1000) + 1 : 0;
 }
 
-/* -------------------- GUI Drawing -------------------- */
-static void add_line_to_tab(Tab *tab, const char *s)
+static void history_tick()
+{
+	if (history_timeout() == 0)
+		history_flush();
+}
+
+static int history_queue(const char *cmd, const char *cwd, int tab, int64_t start_ms, double duration, int status)
+{
+	int cmd_len = strlen(cmd), cwd_len = strlen(cwd);
+	int size = (sizeof(HistoryRecord) + cmd_len + cwd_len + 7) & ~7;
+	if (!reserve_text(&writer.pending, &writer.pending_cap, writer.pending_len + size))
+		return 0;
+	char *p = writer.pending + writer.pending_len;
+	HistoryRecord *r = (HistoryRecord *)p;
+	*r = (HistoryRecord){HREC_MAGIC, size, start_ms, duration * 1000, status, tab, cmd_len, cwd_len, 0};
+	memcpy(p + sizeof(HistoryRecord), cmd, cmd_len);
+	memcpy(p + sizeof(HistoryRecord) + cmd_len, cwd, cwd_len);
+	memset(p + sizeof(HistoryRecord) + cmd_len + cwd_len, 0, size - sizeof(HistoryRecord) - cmd_len - cwd_len);
+	writer.pending_len += size;
+	if (writer.pending_since == 0)
+		writer.pending_since = now_seconds();
+	return 1;
+}
+
+// Records a finished command in the journal
+static void history_log(const char *cmd, const char *cwd, int tab, time_t start, double duration, int status)
+{
+	if (history_queue(cmd, cwd, tab, (int64_t)start * 1000, duration, status) && writer.sync_ms == 0)
+		history_flush();
+}
+
+// Marks the most recent occurrence of each distinct key in keep[] and
+// returns how many there are. A key is e[i], followed by e2[i] and tag[i]
+// if given. first[], if given, gets the index of each entry's most recent
+// occurrence.
+static int history_unique(const HistoryEntry *e, const HistoryEntry *e2, const int *tag, int n, unsigned char *keep,
+						  int *first)
 {
-	if (tab->line_count < MAX_LINES)
+	int size = 1024;
+	while (size < n * 2)
+		size *= 2;
+	int *slots = malloc(size * sizeof(int));
+	if (!slots)
 	{
-		tab->lines[tab->line_count].text = strdup(s);
-		tab->line_count++;
+		memset(keep, 1, n);
+		for (int i = 0; first && i < n; i++)
+			first[i] = i;
+		return n;
 	}
-	else
+	memset(slots, -1, size * sizeof(int));
+	int unique = 0;
+	for (int i = n - 1; i >= 0; i--)
 	{
-		free(tab->lines[0].text);
-		memmove(tab->lines, tab->lines + 1, (MAX_LINES - 1) * sizeof(Line));
-		tab->lines[MAX_LINES - 1].text = strdup(s);
+		unsigned h = 2166136261u;
+		for (int k = 0; k < e[i].len; k++)
+			h = (h ^ (unsigned char)e[i].text[k]) * 16777619u;
+		for (int k = 0; e2 && k < e2[i].len; k++)
+			h = (h ^ (unsigned char)e2[i].text[k]) * 16777619u;
+		if (tag)
+			h = (h ^ (unsigned)tag[i]) * 16777619u;
+		unsigned s = h & (size - 1);
+		keep[i] = 1;
+		if (first)
+			first[i] = i;
+		for (; slots[s] >= 0; s = (s + 1) & (size - 1))
+		{
+			int j = slots[s];
+			if (e[j].len == e[i].len && memcmp(e[j].text, e[i].text, e[i].len) == 0 &&
+				(!e2 || (e2[j].len == e2[i].len && memcmp(e2[j].text, e2[i].text, e2[i].len) == 0)) &&
+				(!tag || tag[j] == tag[i]))
+			{
+				keep[i] = 0;
+				if (first)
+					first[i] = j;
+				break;
+			}
+		}
+		if (keep[i])
+		{
+			slots[s] = i;
+			unique++;
+		}
 	}
+	free(slots);
+	return unique;
 }
 
-static void add_line_to_current_tab(const char *s)
+// Commands and directories of a journal's records, oldest first. Returns
+// the number of records, -1 if out of memory.
+static int journal_keys(const HistoryReader *rd, HistoryEntry **cmds, HistoryEntry **cwds, const HistoryRecord ***recs)
 {
-	add_line_to_tab(&tabs[current_tab], s);
+	*cmds = malloc((rd->count + 1) * sizeof(HistoryEntry));
+	*cwds = malloc((rd->count + 1) * sizeof(HistoryEntry));
+	*recs = malloc((rd->count + 1) * sizeof(HistoryRecord *));
+	if (!*cmds || !*cwds || !*recs)
+		return -1;
+	int n = 0;
+	for (int i = rd->count - 1; i >= 0; i--)
+	{
+		const HistoryRecord *r = reader_record(rd, i);
+		if (!r)
+			continue;
+		(*cmds)[n] = (HistoryEntry){record_command(r), NULL, r->cmd_len};
+		(*cwds)[n] = (HistoryEntry){record_cwd(r), NULL, r->cwd_len};
+		(*recs)[n++] = r;
+	}
+	return n;
 }
 
-static void add_line(const char *s)
+// Marks the records a compaction keeps in keep[] and returns how many
+// there are: every failed run, the slowest run of each command, and the
+// latest run of each command in each directory with each status. Those are
+// what `history --failed` and `history --slowest` read.
+static int journal_keep(const HistoryRecord **recs, const HistoryEntry *cmds, const HistoryEntry *cwds, int n,
+						unsigned char *keep)
 {
-	add_line_to_current_tab(s);
+	int *status = calloc(n + 1, sizeof(int));
+	int *first = malloc((n + 1) * sizeof(int));
+	int *slowest = malloc((n + 1) * sizeof(int));
+	unsigned char *latest = malloc(n + 1);
+	int kept = n;
+	if (status && first && slowest && latest)
+	{
+		for (int i = 0; i < n; i++)
+		{
+			status[i] = recs[i]->status;
+			slowest[i] = -1;
+		}
+		history_unique(cmds, cwds, status, n, keep, NULL);
+		history_unique(cmds, NULL, NULL, n, latest, first);
+		// Of equally slow runs, the latest
+		for (int i = 0; i < n; i++)
+		{
+			int j = first[i];
+			if (slowest[j] < 0 || recs[i]->duration_ms >= recs[slowest[j]]->duration_ms)
+				slowest[j] = i;
+		}
+		kept = 0;
+		for (int i = 0; i < n; i++)
+		{
+			if (recs[i]->status > 0)
+				keep[i] = 1;
+			if (slowest[i] >= 0)
+				keep[slowest[i]] = 1;
+		}
+		for (int i = 0; i < n; i++)
+			kept += keep[i];
+	}
+	else
+		memset(keep, 1, n);
+	free(status);
+	free(first);
+	free(slowest);
+	free(latest);
+	return kept;
 }
 
-/* -------------------- Tab Management -------------------- */
-static void create_new_tab()
+// Writes the kept records of rd to new files and renames them over the
+// journal and its index. Returns 0 if anything fails, leaving the old ones.
+static int journal_rewrite(const HistoryReader *rd)
 {
-	if (tab_count >= MAX_TABS)
-		return;
-
-	int new_tab = tab_count++;
-	Tab *tab = &tabs[new_tab];
+	HistoryEntry *cmds, *cwds;
+	const HistoryRecord **recs;
+	int n = journal_keys(rd, &cmds, &cwds, &recs);
+	unsigned char *keep = malloc(n + 1);
+	char *out = malloc(rd->data_len + 8);
+	uint64_t *offsets = malloc((n + 1) * sizeof(uint64_t));
+	int done = 0;
+	if (n >= 0 && keep && out && offsets)
+	{
+		journal_keep(recs, cmds, cwds, n, keep);
+		size_t len = 8;
+		int kept = 0;
+		memcpy(out, HISTORY_MAGIC, 8);
+		for (int i = 0; i < n; i++)
+		{
+			if (!keep[i])
+				continue;
+			offsets[kept++] = len;
+			memcpy(out + len, recs[i], recs[i]->size);
+			len += recs[i]->size;
+		}
 
-	tab->in_pos = 0;
-	tab->input_buf[0] = '\0';
-	tab->line_count = 0;
-	tab->shell_pid = 0;
-	tab->scroll_offset = 0;
-	tab->search_term[0] = '\0';
-	tab->search_pos = 0;
-	tab->in_search_mode = 0;
-	tab->child_pid = -1;
-	tab->auto_complete_count = 0;
-	tab->bg_pid_count = 0;
-	tab->suspended_count = 0;
+		char tmp[PATH_MAX + 16], idx_tmp[PATH_MAX + 16];
+		snprintf(tmp, sizeof(tmp), "%s.XXXXXX", writer.path);
+		snprintf(idx_tmp, sizeof(idx_tmp), "%s.XXXXXX", writer.idx_path);
+		int out_fd = mkstemp(tmp), out_idx = mkstemp(idx_tmp);
+		done = out_fd >= 0 && out_idx >= 0 && write(out_fd, out, len) == (ssize_t)len &&
+			   write(out_idx, offsets, kept * sizeof(uint64_t)) == (ssize_t)(kept * sizeof(uint64_t)) &&
+			   fsync(out_fd) == 0 && fsync(out_idx) == 0 && rename(idx_tmp, writer.idx_path) == 0 &&
+			   rename(tmp, writer.path) == 0;
+		if (!done)
+		{
+			unlink(tmp);
+			unlink(idx_tmp);
+		}
+		if (out_fd >= 0)
+			close(out_fd);
+		if (out_idx >= 0)
+			close(out_idx);
+	}
+	free(cmds);
+	free(cwds);
+	free(recs);
+	free(keep);
+	free(out);
+	free(offsets);
+	return done;
+}
 
-	for (int i = 0; i < 10; i++)
+// Drops runs that add nothing from the journal; see journal_keep(). Runs
+// in a detached process and holds the journal's exclusive lock throughout,
+// so no instance appends to the old files meanwhile; they notice the files
+// were replaced and reopen them. The index is renamed into place first so
+// a reader never pairs the new journal with the old index.
+static void history_compact()
+{
+	int fd = journal_lock(O_RDONLY, LOCK_EX);
+	if (fd < 0)
+		return;
+	HistoryReader rd = {0};
+	rd.data = map_file(fd, &rd.data_len);
+	int idx_fd = open(writer.idx_path, O_RDONLY | O_CLOEXEC);
+	if (idx_fd >= 0)
 	{
-		tab->background_pids[i] = 0;
-		tab->suspended_processes[i].pid = -1;
-		tab->suspended_processes[i].command[0] = '\0';
+		rd.idx = map_file(idx_fd, &rd.idx_len);
+		rd.count = rd.idx_len / sizeof(uint64_t);
+		close(idx_fd);
+		journal_rewrite(&rd);
 	}
+	reader_close(&rd);
+	flock(fd, LOCK_UN);
+	close(fd);
+}
 
-	// Initialize current directory
-	if (getcwd(tab->current_directory, sizeof(tab->current_directory)) == NULL)
+// Adds the commands of a plain-text history, one per line, as records
+// with no time, status or directory. Returns how many were read, -1 if
+// the file can't be opened.
+static int history_import(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (!f)
+		return -1;
+	char line[BUFSIZE];
+	int n = 0;
+	while (fgets(line, sizeof(line), f))
 	{
-		strcpy(tab->current_directory, "/");
+		line[strcspn(line, "\n")] = '\0';
+		if (!line[0])
+			continue;
+		char *copy = arena_strdup(&history.added, line);
+		if (!copy || !history_push(copy, strlen(copy)) || !history_queue(line, "", 0, 0, 0, -1))
+			break;
+		n++;
 	}
+	fclose(f);
+	history_flush();
+	return n;
+}
 
-	snprintf(tab->tab_name, sizeof(tab->tab_name), "Tab %d", new_tab + 1);
-
-	// Add welcome message to the new tab
-	char welcome[BUFSIZE];
-	snprintf(welcome, sizeof(welcome), "New tab %d created - Use Ctrl+W to close tab", new_tab + 1);
-
-	if (tab->line_count < MAX_LINES)
+// Indexes records that made it into the journal without their offsets,
+// as when an instance died between the two writes. Called with the
+// exclusive lock held.
+static void journal_repair()
+{
+	HistoryReader rd = {0};
+	rd.data = map_file(writer.fd, &rd.data_len);
+	// idx_fd is write-only, so the index is mapped through a descriptor of its own
+	int idx_fd = open(writer.idx_path, O_RDONLY | O_CLOEXEC);
+	if (idx_fd >= 0)
 	{
-		tab->lines[tab->line_count].text = strdup(welcome);
-		tab->line_count++;
+		rd.idx = map_file(idx_fd, &rd.idx_len);
+		close(idx_fd);
 	}
+	rd.count = rd.idx_len / sizeof(uint64_t);
+	uint64_t end = 8;
+	const HistoryRecord *last = reader_record(&rd, 0);
+	if (last)
+		end = (const char *)last - rd.data + last->size;
+	const HistoryRecord *r;
+	while ((r = record_at(rd.data, rd.data_len, end)) != NULL &&
+		   write(writer.idx_fd, &end, sizeof(end)) == sizeof(end))
+		end += r->size;
+	reader_close(&rd);
 }
 
-static void close_current_tab()
+// History lives at one path for the life of the process, whatever the
+// working directory: $MYTERM_HISTFILE, else ~/.myterm_history. A new
+// journal starts with the commands of the old text history, if there is
+// one. Duplicates are dropped from memory at once, and from the journal by
+// a detached process once a quarter of a large one is repeats.
+static void load_history()
 {
-	if (tab_count <= 1)
+	const char *env = getenv("MYTERM_HISTFILE");
+	const char *home = getenv("HOME");
+	char path[PATH_MAX], text_path[PATH_MAX];
+	if (env && env[0])
+		snprintf(path, sizeof(path), "%s", env);
+	else if (home && home[0])
+		snprintf(path, sizeof(path), "%s/%s", home, HISTORY_JOURNAL);
+	else
+		snprintf(path, sizeof(path), "./%s", HISTORY_JOURNAL);
+	writer.path = strdup(path);
+	snprintf(path + strlen(path), sizeof(path) - strlen(path), ".idx");
+	writer.idx_path = strdup(path);
+	if (!writer.path || !writer.idx_path)
 		return;
+	const char *sync = getenv("MYTERM_HISTORY_SYNC_MS");
+	if (sync && atoi(sync) >= 0)
+		writer.sync_ms = atoi(sync);
+	atexit(history_flush);
 
-	Tab *tab = &tabs[current_tab];
+	if (!writer_lock())
+		return;
+	journal_repair();
+	flock(writer.fd, LOCK_UN);
 
-	// Kill shell process if exists
-	if (tab->shell_pid > 0)
+	reader_open(&history.file);
+	for (int i = history.file.count - 1; i >= 0; i--)
 	{
-		kill(tab->shell_pid, SIGTERM);
-		waitpid(tab->shell_pid, NULL, 0);
+		const HistoryRecord *r = reader_record(&history.file, i);
+		if (r && !history_push(record_command(r), r->cmd_len))
+			break;
 	}
 
-	// Kill child process if exists
-	if (tab->child_pid > 0)
+	if (history.file.count == 0)
 	{
-		kill(tab->child_pid, SIGTERM);
-		waitpid(tab->child_pid, NULL, 0);
+		snprintf(text_path, sizeof(text_path), "%s/%s", home ? home : ".", HISTORY_FILE);
+		if (access(text_path, R_OK) != 0)
+			snprintf(text_path, sizeof(text_path), "./%s", HISTORY_FILE);
+		history_import(text_path);
 	}
 
-	// Kill background processes for this tab
-	for (int i = 0; i < tab->bg_pid_count; i++)
+	unsigned char *keep = malloc(history.count + 1);
+	if (!keep)
+		return;
+	int loaded = history.count;
+	history_unique(history.entries, NULL, NULL, loaded, keep, NULL);
+	history.count = 0;
+	for (int i = 0; i < loaded; i++)
 	{
-		if (tab->background_pids[i] > 0)
-		{
-			kill(tab->background_pids[i], SIGTERM);
-			waitpid(tab->background_pids[i], NULL, 0);
-		}
+		if (keep[i])
+			history.entries[history.count++] = history.entries[i];
 	}
-
-	// Kill suspended processes for this tab
-	for (int i = 0; i < tab->suspended_count; i++)
+	free(keep);
+
+	// Count what a compaction would keep
+	HistoryEntry *cmds, *cwds;
+	const HistoryRecord **recs;
+	int n = journal_keys(&history.file, &cmds, &cwds, &recs);
+	keep = malloc(n + 1);
+	if (n >= HISTORY_COMPACT_MIN && keep && (n - journal_keep(recs, cmds, cwds, n, keep)) * 4 >= n)
 	{
-		if (tab->suspended_processes[i].pid > 0)
+		pid_t pid = fork();
+		if (pid == 0)
 		{
-			kill(tab->suspended_processes[i].pid, SIGTERM);
-			waitpid(tab->suspended_processes[i].pid, NULL, 0);
+			// The grandchild is adopted by init, so nobody has to reap it
+			if (fork() == 0)
+				history_compact();
+			_exit(0);
 		}
+		if (pid > 0)
+			waitpid(pid, NULL, 0);
 	}
+	free(keep);
+	free(cmds);
+	free(cwds);
+	free(recs);
+}
 
-	// Free all line texts in the tab being closed
-	for (int i = 0; i < tab->line_count; i++)
-	{
-		free(tab->lines[i].text);
-	}
+// Adds a command to the in-memory history as it starts. Its journal
+// record is written when it ends, by command_end().
+static void save_to_history(const char *cmd)
+{
+	if (!cmd || strlen(cmd) == 0)
+		return;
 
-	// Free auto-complete list if any
-	for (int i = 0; i < tab->auto_complete_count; i++)
+	// A command repeated straight away is listed once
+	int len = strlen(cmd);
+	if (history.count > 0)
 	{
-		free(tab->auto_complete_list[i]);
+		HistoryEntry *last = &history.entries[history.count - 1];
+		if (last->len == len && memcmp(last->text, cmd, len) == 0)
+			return;
 	}
 
-	// Shift tabs left
-	for (int i = current_tab; i < tab_count - 1; i++)
+	char *copy = arena_strdup(&history.added, cmd);
+	if (copy)
+		history_push(copy, len);
+}
+
+// Lists the last 1000 commands, numbered from the oldest
+static void show_history(Tab *tab)
+{
+	if (history.count == 0)
 	{
-		tabs[i] = tabs[i + 1];
+		add_line_to_tab(tab, "No history found");
+		return;
 	}
 
-	tab_count--;
-
-	// Adjust current_tab if needed
-	if (current_tab >= tab_count)
+	int start = history.count > 1000 ? history.count - 1000 : 0;
+	for (int i = start; i < history.count; i++)
 	{
-		current_tab = tab_count - 1;
+		HistoryEntry *e = &history.entries[i];
+		char display_line[BUFSIZE];
+		int max_line_len = sizeof(display_line) - 20; // Reserve space for line number
+		snprintf(display_line, sizeof(display_line), "%5d  %.*s", i + 1,
+				 e->len < max_line_len ? e->len : max_line_len, e->text);
+		add_line_to_tab(tab, display_line);
 	}
+}
 
-	// Add close message to current tab
-	char msg[64];
-	snprintf(msg, sizeof(msg), "Tab closed. Now in %s", tabs[current_tab].tab_name);
-	add_line_to_tab(&tabs[current_tab], msg);
+// One journal record as a `history` line
+static void show_record(Tab *tab, int number, const HistoryRecord *r)
+{
+	char when[32] = "-", took[16], status[12] = "-", line[BUFSIZE];
+	time_t start = r->start_ms / 1000;
+	struct tm tm;
+	if (r->start_ms > 0 && localtime_r(&start, &tm))
+		strftime(when, sizeof(when), "%Y-%m-%d %H:%M", &tm);
+	snprintf(took, sizeof(took), "%.1fs", r->duration_ms / 1000.0);
+	if (r->status >= 0)
+		snprintf(status, sizeof(status), "%d", r->status);
+	int len = snprintf(line, sizeof(line), "%5d  %-16s %8s %4s  %.*s", number, when, took, status,
+					   (int)(r->cmd_len < 4096 ? r->cmd_len : 4096), record_command(r));
+	if (r->cwd_len > 0 && len < (int)sizeof(line))
+		snprintf(line + len, sizeof(line) - len, "  (%.*s)", (int)r->cwd_len, record_cwd(r));
+	add_line_to_tab(tab, line);
 }
 
-static void switch_tab(int direction)
+typedef struct
 {
-	if (tab_count <= 1)
-		return;
+	const HistoryRecord *rec;
+	int number;
+} NumberedRecord;
 
-	current_tab = (current_tab + direction + tab_count) % tab_count;
-
-	char msg[64];
-	snprintf(msg, sizeof(msg), "Switched to %s", tabs[current_tab].tab_name);
+static int compare_slowest(const void *a, const void *b)
+{
+	uint32_t da = ((const NumberedRecord *)a)->rec->duration_ms, db = ((const NumberedRecord *)b)->rec->duration_ms;
+	return da < db ? 1 : da > db ? -1 : 0;
+}
 
-	Tab *tab = &tabs[current_tab];
-	if (tab->line_count < MAX_LINES)
+// The `history` builtin. With no arguments it lists recent commands from
+// memory; the filters read the journal through its index, newest first:
+//
+//   history --cwd [DIR]   commands run in DIR, by default the tab's directory
+//   history --failed      commands that exited with a non-zero status
+//   history --slowest     the 20 longest-running commands
+//   history --import FILE adds the commands of a plain-text history
+static void history_command(Tab *tab, const char *args)
+{
+	char *argv[8];
+	int argc = 0;
+	char *copy = arena_strdup(&tab->scratch, args);
+	for (char *tok = copy ? strtok(copy, " \t") : NULL; tok && argc < 8; tok = strtok(NULL, " \t"))
+		argv[argc++] = tok;
+	if (argc == 0)
 	{
-		tab->lines[tab->line_count].text = strdup(msg);
-		tab->line_count++;
+		show_history(tab);
+		return;
 	}
-}
 
-static void redraw()
-{
-	XClearWindow(dpy, win);
-	int tab_width = WIDTH / tab_count;
-	for (int i = 0; i < tab_count; i++)
+	if (strcmp(argv[0], "--import") == 0)
 	{
-		int x = i * tab_width;
-		if (i == current_tab)
+		char msg[BUFSIZE];
+		int n = argc > 1 ? history_import(argv[1]) : -1;
+		if (n < 0)
 		{
-			// Highlight current tab
-			XSetForeground(dpy, gc, BlackPixel(dpy, DefaultScreen(dpy)));
-			XFillRectangle(dpy, win, gc, x, 0, tab_width, LINE_H);
-			XSetForeground(dpy, gc, WhitePixel(dpy, DefaultScreen(dpy)));
+			snprintf(msg, sizeof(msg), "history: cannot read '%s'", argc > 1 ? argv[1] : "");
+			tab->builtin_status = 1;
 		}
 		else
-		{
-			XSetForeground(dpy, gc, WhitePixel(dpy, DefaultScreen(dpy)));
-			XSetBackground(dpy, gc, BlackPixel(dpy, DefaultScreen(dpy)));
-		}
-		XDrawString(dpy, win, gc, x + 4, LINE_H - 4, tabs[i].tab_name, strlen(tabs[i].tab_name));
-		XDrawRectangle(dpy, win, gc, x, 0, tab_width, LINE_H);
-	}
-
-	// Reset background for content area
-	XSetBackground(dpy, gc, BlackPixel(dpy, DefaultScreen(dpy)));
-	XSetForeground(dpy, gc, WhitePixel(dpy, DefaultScreen(dpy)));
-
-	// Draw content of current tab with scroll support
-	Tab *tab = &tabs[current_tab];
-	int y = LINE_H * 2;
-
-	// Calculate visible lines based on scroll offset
-	int visible_lines = (HEIGHT - (LINE_H * 3)) / LINE_H;
-	int start_line = 0;
-
-	if (tab->line_count > visible_lines)
-	{
-		start_line = tab->line_count - visible_lines - tab->scroll_offset;
-		if (start_line < 0)
-			start_line = 0;
-		if (start_line > tab->line_count - visible_lines)
-			start_line = tab->line_count - visible_lines;
+			snprintf(msg, sizeof(msg), "history: imported %d commands", n);
+		add_line_to_tab(tab, msg);
+		return;
 	}
 
-	// Draw scroll indicator if needed
-	if (tab->line_count > visible_lines)
+	const char *cwd = NULL;
+	int failed = 0, slowest = 0;
+	if (strcmp(argv[0], "--cwd") == 0)
+		cwd = argc > 1 ? argv[1] : tab->current_directory;
+	else if (strcmp(argv[0], "--failed") == 0)
+		failed = 1;
+	else if (strcmp(argv[0], "--slowest") == 0)
+		slowest = 1;
+	else
 	{
-		char scroll_info[64];
-		snprintf(scroll_info, sizeof(scroll_info), "Lines: %d-%d/%d (Use Up/Down to scroll)",
-				 start_line + 1, start_line + visible_lines, tab->line_count);
-		XDrawString(dpy, win, gc, 4, LINE_H * 1.5, scroll_info, strlen(scroll_info));
+		add_line_to_tab(tab, "Usage: history [--cwd [DIR] | --failed | --slowest | --import FILE]");
+		tab->builtin_status = 2;
+		return;
 	}
 
-	// Draw visible lines
-	for (int i = start_line; i < tab->line_count && (i - start_line) < visible_lines; i++)
+	history_flush();
+	HistoryReader rd;
+	if (!reader_open(&rd))
 	{
-		XDrawString(dpy, win, gc, 4, y, tab->lines[i].text, strlen(tab->lines[i].text));
-		y += LINE_H;
+		add_line_to_tab(tab, "history: cannot open the history journal");
+		tab->builtin_status = 1;
+		return;
 	}
 
-	// If in search mode, show search prompt
-	if (tab->in_search_mode)
+	if (slowest)
 	{
-		char search_prompt[BUFSIZE + 50];
-		snprintf(search_prompt, sizeof(search_prompt), "Search: %s", tab->search_term);
-		XDrawString(dpy, win, gc, 4, HEIGHT - LINE_H, search_prompt, strlen(search_prompt));
-
-		int search_text_width = XTextWidth(font, "Search: ", strlen("Search: "));
-		int search_term_width = XTextWidth(font, tab->search_term, strlen(tab->search_term));
-		int cursor_x = 4 + search_text_width + search_term_width;
-		XFillRectangle(dpy, win, gc, cursor_x, HEIGHT - LINE_H + 2, 8, 2);
+		NumberedRecord *recs = malloc((rd.count + 1) * sizeof(NumberedRecord));
+		int n = 0;
+		for (int i = 0; recs && i < rd.count; i++)
+		{
+			const HistoryRecord *r = reader_record(&rd, i);
+			if (r && r->status >= 0)
+				recs[n++] = (NumberedRecord){r, rd.count - i};
+		}
+		if (recs)
+			qsort(recs, n, sizeof(*recs), compare_slowest);
+		for (int i = 0; i < n && i < 20; i++)
+			show_record(tab, recs[i].number, recs[i].rec);
+		free(recs);
 	}
 	else
 	{
-		char promptline[BUFSIZE * 2];
-		snprintf(promptline, sizeof(promptline), "%s", PROMPT);
-
-		// Draw prompt in green color
-		XSetForeground(dpy, gc, green_color.pixel);
-		XDrawString(dpy, win, gc, 4, HEIGHT - LINE_H, promptline, strlen(promptline));
-		XSetForeground(dpy, gc, white_color.pixel);
-
-		// Draw multiline input with proper line breaks
-		int prompt_width = XTextWidth(font, PROMPT, strlen(PROMPT));
-		int current_y = HEIGHT - LINE_H;
-		char *input_ptr = tab->input_buf;
-		int current_pos = 0;
-		int cursor_drawn = 0;
-
-		while (*input_ptr)
+		int cwd_len = cwd ? strlen(cwd) : 0, shown = 0;
+		for (int i = 0; i < rd.count && shown < 1000; i++)
 		{
-			char line_buf[BUFSIZE];
-			int line_len = 0;
-
-			while (*input_ptr && *input_ptr != '\n' && line_len < BUFSIZE - 1)
-			{
-				line_buf[line_len++] = *input_ptr++;
-			}
-			line_buf[line_len] = '\0';
-
-			XDrawString(dpy, win, gc, 4 + prompt_width, current_y, line_buf, line_len);
+			const HistoryRecord *r = reader_record(&rd, i);
+			if (!r || (failed && r->status <= 0) ||
+				(cwd && ((int)r->cwd_len != cwd_len || memcmp(record_cwd(r), cwd, cwd_len) != 0)))
+				continue;
+			show_record(tab, rd.count - i, r);
+			shown++;
+		}
+		if (shown == 0)
+			add_line_to_tab(tab, "No matching history");
+	}
+	reader_close(&rd);
+}
 
-			if (!cursor_drawn && current_pos + line_len >= tab->in_pos)
-			{
-				int cursor_pos_in_line = tab->in_pos - current_pos;
-				if (cursor_pos_in_line < 0)
-					cursor_pos_in_line = 0;
-				if (cursor_pos_in_line > line_len)
-					cursor_pos_in_line = line_len;
+// Copies a history entry into the input line
+static void history_recall(Tab *tab, const HistoryEntry *e)
+{
+	if (!reserve_text(&tab->input_buf, &tab->input_cap, e->len))
+		return;
+	memcpy(tab->input_buf, e->text, e->len);
+	tab->input_buf[e->len] = '\0';
+	tab->in_pos = e->len;
+}
 
-				int cursor_x = 4 + prompt_width + XTextWidth(font, line_buf, cursor_pos_in_line);
-				XFillRectangle(dpy, win, gc, cursor_x, current_y + 2, 8, 2);
-				cursor_drawn = 1;
-			}
+/* -------------------- History Search -------------------- */
+// Ctrl+R searches as the query is typed. Entries are ranked by how well
+// they match (whole command, prefix, start of a word, anywhere, then
+// letters in order), most recent first within each rank, and repeats of
+// a command are listed once. Queries of three or more characters only
+// look at the entries a trigram index lists for the query's rarest
+// trigram. A query in lower case matches any case.
+#define HS_BUCKETS 65536	  // Trigram hash buckets
+#define HS_TIER_RESULTS 256	  // Candidates kept per rank
+#define HS_FUZZY_BELOW 8	  // Fewer substring matches than this adds subsequence matches
+#define HS_SEEN_SIZE 4096	  // Dedup table, over twice the candidates kept
+
+enum
+{
+	HS_EXACT,
+	HS_PREFIX,
+	HS_WORD,
+	HS_SUBSTRING,
+	HS_FUZZY,
+	HS_TIERS
+};
 
-			current_pos += line_len;
+typedef struct
+{
+	int *ids; // Entries containing the trigram, oldest first
+	int len;
+	int cap;
+} Posting;
 
-			if (*input_ptr == '\n')
-			{
-				input_ptr++;
-				current_pos++;
-				current_y += LINE_H;
-				prompt_width = 0;
-			}
-		}
+static Posting *trigrams; // HS_BUCKETS lists, allocated on the first search
+static int trigrams_indexed; // History entries added to the index so far
+static Arena lowered = {NULL, 65536, 0}; // Lowercased copies of indexed entries
 
-		if (!cursor_drawn)
-		{
-			int cursor_x = 4 + prompt_width + XTextWidth(font, input_ptr, strlen(input_ptr));
-			XFillRectangle(dpy, win, gc, cursor_x, current_y + 2, 8, 2);
-		}
-	}
+static unsigned char fold_ascii(unsigned char c)
+{
+	return c >= 'A' && c <= 'Z' ? c + 32 : c;
 }
 
-// ---------- multiWatch implementation ----------
-static volatile sig_atomic_t mw_stop_flag = 0;
-
-static void mw_sigint(int s)
+static unsigned trigram_hash(const char *s)
 {
-	(void)s;
-	mw_stop_flag = 1;
+	unsigned t = fold_ascii(s[0]) | fold_ascii(s[1]) << 8 | fold_ascii(s[2]) << 16;
+	return (t * 2654435761u) >> 16;
 }
 
-static char *trim_spaces(char *s)
+// Indexes history entries added since the last search
+static void trigrams_update()
 {
-	if (!s)
-		return s;
-	while (*s == ' ' || *s == '\t')
-		s++;
-	char *end = s + strlen(s) - 1;
-	while (end >= s && (*end == ' ' || *end == '\t' || *end == '\n' || *end == '\r'))
+	if (!trigrams)
 	{
-		*end = '\0';
-		end--;
+		trigrams = calloc(HS_BUCKETS, sizeof(Posting));
+		if (!trigrams)
+			return;
 	}
-	return s;
-}
-
-static int parse_multiwatch_list(char *arg, char **commands, int maxcmds)
-{
-	char *l = strchr(arg, '[');
-	if (!l)
-		return 0;
-	char *r = strchr(l, ']');
-	if (!r)
-		return 0;
-	*r = '\0';
-	l++;
-
-	int n = 0;
-	char *p = l;
-
-	while (*p && n < maxcmds)
+	for (; trigrams_indexed < history.count; trigrams_indexed++)
 	{
-		while (*p == ' ' || *p == '\t' || *p == ',')
-			p++;
-		if (!*p)
-			break;
-
-		if (*p == '"')
+		HistoryEntry *e = &history.entries[trigrams_indexed];
+		char *lower = arena_alloc(&lowered, e->len);
+		if (lower)
 		{
-			p++;
-			char *start = p;
-			while (*p && *p != '"')
-			{
-				if (*p == '\\' && *(p + 1))
-					p++;
-				p++;
-			}
-			if (*p == '"')
-			{
-				*p = '\0';
-				commands[n++] = start;
-				p++;
-			}
-			else
-			{
-				commands[n++] = start;
-				break;
-			}
+			for (int i = 0; i < e->len; i++)
+				lower[i] = fold_ascii(e->text[i]);
+			e->lower = lower;
 		}
-		else
+		for (int i = 0; i + 3 <= e->len; i++)
 		{
-			char *start = p;
-			while (*p && *p != ',')
-				p++;
-			if (*p == ',')
-			{
-				*p = '\0';
-				commands[n++] = trim_spaces(start);
-				p++;
-			}
-			else
+			Posting *p = &trigrams[trigram_hash(e->text + i)];
+			if (p->len > 0 && p->ids[p->len - 1] == trigrams_indexed)
+				continue;
+			if (p->len == p->cap)
 			{
-				commands[n++] = trim_spaces(start);
-				break;
+				int new_cap = p->cap ? p->cap * 2 : 4;
+				int *grown = realloc(p->ids, new_cap * sizeof(int));
+				if (!grown)
+					return;
+				p->ids = grown;
+				p->cap = new_cap;
 			}
+			p->ids[p->len++] = trigrams_indexed;
 		}
 	}
-	return n;
 }
 
-static void multiWatch_runner(Tab *tab, const char *argline)
+static int word_start(const char *s, int at)
 {
-	char local[BUFSIZE];
-	strncpy(local, argline, sizeof(local) - 1);
-	local[sizeof(local) - 1] = 0;
+	return at == 0 || strchr(" \t/-_.=:;|&(\"'", s[at - 1]) != NULL;
+}
 
-	char *listpart = strchr(local, '[');
-	if (!listpart)
+// Rank of an entry for the query, -1 if it does not match. `fold` is set
+// when case is ignored; subsequence matches count only if `fuzzy`.
+static int hs_rank(const HistoryEntry *e, const char *q, int m, int fold, int fuzzy)
+{
+	char low[BUFSIZE];
+	const char *s = e->text;
+	int n = e->len;
+	if (fold && e->lower)
 	{
-		add_line_to_tab(tab, "multiWatch: malformed arguments (expected [ ... ])");
-		return;
+		s = e->lower;
 	}
-
-#define MAX_MW_CMDS 64
-	char *commands[MAX_MW_CMDS];
-	int ncmd = parse_multiwatch_list(listpart, commands, MAX_MW_CMDS);
-
-	if (ncmd <= 0)
+	else if (fold)
 	{
-		add_line_to_tab(tab, "multiWatch: no commands found");
-		return;
+		if (n > (int)sizeof(low))
+			n = sizeof(low);
+		for (int i = 0; i < n; i++)
+			low[i] = fold_ascii(s[i]);
+		s = low;
 	}
+	if (m == 0)
+		return HS_SUBSTRING;
 
-	add_line_to_tab(tab, "multiWatch: starting parallel execution");
-
-	pid_t pids[MAX_MW_CMDS];
-	char tempfiles[MAX_MW_CMDS][256];
-	int fds[MAX_MW_CMDS];
-
-	struct sigaction old_act, new_act;
-	mw_stop_flag = 0;
-	memset(&new_act, 0, sizeof(new_act));
-	new_act.sa_handler = mw_sigint;
-	sigemptyset(&new_act.sa_mask);
-	sigaction(SIGINT, &new_act, &old_act);
-
-	for (int i = 0; i < ncmd; i++)
+	int at = find_text(s, n, q, m);
+	if (at == 0)
+		return n == m ? HS_EXACT : HS_PREFIX;
+	if (at > 0)
 	{
-		pid_t pid = fork();
-		if (pid == 0)
-		{
-			if (chdir(tab->current_directory) == -1)
-			{
-				chdir(getenv("HOME") ? getenv("HOME") : "/");
-			}
-
-			pid_t mypid = getpid();
-			snprintf(tempfiles[i], sizeof(tempfiles[i]), "/tmp/.temp_mw_%d_%d.txt", (int)getppid(), (int)mypid);
-			int fd = open(tempfiles[i], O_WRONLY | O_CREAT | O_TRUNC, 0644);
-			if (fd < 0)
-			{
-				perror("open");
-				_exit(1);
-			}
-			dup2(fd, STDOUT_FILENO);
-			dup2(fd, STDERR_FILENO);
-			close(fd);
-			execl("/bin/bash", "bash", "-c", commands[i], (char *)NULL);
-			perror("execl");
-			_exit(127);
-		}
-		else if (pid > 0)
-		{
-			pids[i] = pid;
-			tab->child_pid = pid;
-			snprintf(tempfiles[i], sizeof(tempfiles[i]), "/tmp/.temp_mw_%d_%d.txt", (int)getpid(), (int)pid);
-		}
-		else
+		for (int from = at; from >= 0 && from < n;)
 		{
-			perror("fork");
-			return;
+			if (word_start(s, from))
+				return HS_WORD;
+			int next = find_text(s + from + 1, n - from - 1, q, m);
+			from = next < 0 ? -1 : from + 1 + next;
 		}
+		return HS_SUBSTRING;
 	}
-
-	sleep(1);
-
-	for (int i = 0; i < ncmd; i++)
+	if (!fuzzy)
+		return -1;
+	const char *p = s, *end = s + n;
+	for (int j = 0; j < m; j++)
 	{
-		fds[i] = open(tempfiles[i], O_RDONLY | O_NONBLOCK);
-		if (fds[i] < 0)
-		{
-			char err[256];
-			snprintf(err, sizeof(err), "Warning: Could not open temp file for PID %d", (int)pids[i]);
-			add_line_to_tab(tab, err);
-		}
+		p = memchr(p, q[j], end - p);
+		if (!p)
+			return -1;
+		p++;
 	}
+	return HS_FUZZY;
+}
 
-	struct pollfd pfds[MAX_MW_CMDS];
-	for (int i = 0; i < ncmd; i++)
+// Offset of the tab's query in a candidate, for highlighting, or -1
+static int hs_locate(Tab *tab, const HistoryEntry *e)
+{
+	int m = tab->search_pos;
+	if (m == 0 || m > e->len || e->len > BUFSIZE)
+		return -1;
+	int fold = 1;
+	for (int i = 0; i < m; i++)
 	{
-		pfds[i].fd = fds[i];
-		pfds[i].events = (fds[i] >= 0) ? POLLIN : 0;
+		if (tab->search_term[i] >= 'A' && tab->search_term[i] <= 'Z')
+			fold = 0;
 	}
+	if (!fold)
+		return find_text(e->text, e->len, tab->search_term, m);
+	if (e->lower)
+		return find_text(e->lower, e->len, tab->search_term, m);
+	char low[BUFSIZE];
+	for (int i = 0; i < e->len; i++)
+		low[i] = fold_ascii(e->text[i]);
+	return find_text(low, e->len, tab->search_term, m);
+}
 
-	char buf[BUFSIZE];
-	off_t file_pos[MAX_MW_CMDS] = {0};
-
-	while (!mw_stop_flag)
+static int tier_ids[HS_TIERS][HS_TIER_RESULTS];
+static int tier_len[HS_TIERS];
+static struct
+{
+	unsigned gen;
+	int id;
+} seen[HS_SEEN_SIZE];
+static unsigned seen_gen;
+
+// Adds entry `id` to its rank unless the rank is full or the same command
+// is already listed
+static void hs_offer(int id, int rank)
+{
+	if (rank < 0 || tier_len[rank] == HS_TIER_RESULTS)
+		return;
+	HistoryEntry *e = &history.entries[id];
+	unsigned h = 2166136261u;
+	for (int i = 0; i < e->len; i++)
+		h = (h ^ (unsigned char)e->text[i]) * 16777619u;
+	for (unsigned k = h & (HS_SEEN_SIZE - 1);; k = (k + 1) & (HS_SEEN_SIZE - 1))
 	{
-		int rc = poll(pfds, ncmd, 100);
-		if (rc < 0)
+		if (seen[k].gen != seen_gen)
 		{
-			if (errno == EINTR)
-				continue;
-			perror("poll");
+			seen[k].gen = seen_gen;
+			seen[k].id = id;
 			break;
 		}
+		HistoryEntry *o = &history.entries[seen[k].id];
+		if (o->len == e->len && memcmp(o->text, e->text, e->len) == 0)
+			return;
+	}
+	tier_ids[rank][tier_len[rank]++] = id;
+}
 
-		int alive_children = 0;
-		for (int i = 0; i < ncmd; i++)
-		{
-			if (pids[i] > 0)
-			{
-				if (waitpid(pids[i], NULL, WNOHANG) == 0)
-				{
-					alive_children++;
-				}
-				else
-				{
-					pids[i] = 0;
-				}
-			}
-		}
+// Recomputes the tab's candidates for its query, best first
+static void hs_refresh(Tab *tab)
+{
+	HistorySearch *hs = &tab->hsearch;
+	const char *query = tab->search_term;
+	int m = tab->search_pos;
+	int fold = 1;
+	char q[BUFSIZE];
+	if (m > (int)sizeof(q))
+		m = sizeof(q);
+	for (int i = 0; i < m; i++)
+	{
+		if (query[i] >= 'A' && query[i] <= 'Z')
+			fold = 0;
+	}
+	for (int i = 0; i < m; i++)
+		q[i] = fold ? fold_ascii(query[i]) : query[i];
+
+	trigrams_update();
+	memset(tier_len, 0, sizeof(tier_len));
+	if (++seen_gen == 0)
+	{
+		memset(seen, 0, sizeof(seen));
+		seen_gen = 1;
+	}
 
-		int data_processed = 0;
-		for (int i = 0; i < ncmd; i++)
+	// Candidates: the entries holding the query's rarest trigram, or all.
+	// A trigram no entry holds rules out every entry.
+	const int *ids = NULL;
+	int nids = history.count;
+	int indexed = 0;
+	if (m >= 3 && trigrams && trigrams_indexed == history.count)
+	{
+		for (int i = 0; i + 3 <= m && nids > 0; i++)
 		{
-			if (pfds[i].fd >= 0 && (pfds[i].revents & POLLIN))
-			{
-				lseek(fds[i], file_pos[i], SEEK_SET);
-				ssize_t r = read(fds[i], buf, sizeof(buf) - 1);
-				if (r > 0)
-				{
-					buf[r] = '\0';
-					file_pos[i] += r;
-					data_processed = 1;
-					time_t now = time(NULL);
-					char ts[64];
-					strftime(ts, sizeof(ts), "%F %T", localtime(&now));
-					char header[256];
-					snprintf(header, sizeof(header), "\"%s\", %s:", commands[i], ts);
-					add_line_to_tab(tab, header);
-					add_line_to_tab(tab, "----------------------------------------------------");
-					char *line_start = buf;
-					char *line_end;
-					while ((line_end = strchr(line_start, '\n')) != NULL)
-					{
-						int line_len = line_end - line_start;
-						if (line_len > 0)
-						{
-							char line[BUFSIZE];
-							strncpy(line, line_start, line_len);
-							line[line_len] = '\0';
-							add_line_to_tab(tab, line);
-						}
-						line_start = line_end + 1;
-					}
-					add_line_to_tab(tab, "----------------------------------------------------");
-					redraw();
-				}
-				else if (r == 0)
-				{
-					close(fds[i]);
-					pfds[i].fd = -1;
-				}
-			}
-			if (pfds[i].fd >= 0 && (pfds[i].revents & POLLHUP))
+			Posting *p = &trigrams[trigram_hash(q + i)];
+			if (!indexed || p->len < nids)
 			{
-				close(fds[i]);
-				pfds[i].fd = -1;
+				ids = p->ids;
+				nids = p->len;
+				indexed = 1;
 			}
 		}
-
-		if (alive_children == 0 && !data_processed)
-		{
+	}
+	for (int k = nids - 1; k >= 0; k--)
+	{
+		hs_offer(indexed ? ids[k] : k, hs_rank(&history.entries[indexed ? ids[k] : k], q, m, fold, 0));
+		if (m == 0 && tier_len[HS_SUBSTRING] == HS_TIER_RESULTS)
 			break;
-		}
 	}
 
-	for (int i = 0; i < ncmd; i++)
+	int found = 0;
+	for (int t = 0; t < HS_FUZZY; t++)
+		found += tier_len[t];
+	if (found < HS_FUZZY_BELOW && m >= 2)
 	{
-		if (pids[i] > 0)
+		for (int k = history.count - 1; k >= 0 && tier_len[HS_FUZZY] < HS_TIER_RESULTS; k--)
 		{
-			kill(pids[i], SIGKILL);
-			waitpid(pids[i], NULL, 0);
+			int rank = hs_rank(&history.entries[k], q, m, fold, 1);
+			if (rank == HS_FUZZY)
+				hs_offer(k, rank);
 		}
-		if (fds[i] >= 0)
-			close(fds[i]);
-		unlink(tempfiles[i]);
 	}
 
-	sigaction(SIGINT, &old_act, NULL);
-	tab->child_pid = -1;
-	add_line_to_tab(tab, "multiWatch: execution completed");
+	hs->count = 0;
+	hs->selected = 0;
+	if (!hs->results)
+	{
+		hs->results = malloc(HS_TIERS * HS_TIER_RESULTS * sizeof(int));
+		if (!hs->results)
+			return;
+	}
+	for (int t = 0; t < HS_TIERS; t++)
+	{
+		memcpy(hs->results + hs->count, tier_ids[t], tier_len[t] * sizeof(int));
+		hs->count += tier_len[t];
+	}
 }
 
-// Line Navigation
-static void move_cursor_start(Tab *tab)
+static void hs_start(Tab *tab)
 {
-	tab->in_pos = 0;
+	tab->in_search_mode = 1;
+	tab->in_find_mode = 0;
+	tab->search_term[0] = '\0';
+	tab->search_pos = 0;
+	hs_refresh(tab);
 }
 
-static void move_cursor_end(Tab *tab)
+static void hs_end(Tab *tab)
 {
-	tab->in_pos = strlen(tab->input_buf);
+	tab->in_search_mode = 0;
+	tab->search_term[0] = '\0';
+	tab->search_pos = 0;
 }
 
-// Signal Handling
-static void sigint_handler(int sig)
+// Ctrl+R/Up steps to the next candidate down the ranking, Down back up,
+// wrapping around at either end
+static void hs_step(Tab *tab, int dir)
 {
-	Tab *tab = &tabs[current_tab];
-	if (tab->child_pid > 0)
-	{
-		kill(tab->child_pid, SIGINT);
-		add_line_to_tab(tab, "^C");
-		redraw();
-		tab->child_pid = -1;
+	HistorySearch *hs = &tab->hsearch;
+	if (hs->count > 0)
+		hs->selected = (hs->selected + dir + hs->count) % hs->count;
+}
+
+// The candidate shown, or NULL
+static HistoryEntry *hs_current(Tab *tab)
+{
+	HistorySearch *hs = &tab->hsearch;
+	return hs->count > 0 ? &history.entries[hs->results[hs->selected]] : NULL;
+}
+
+// Return: the candidate goes to the input line for editing or running
+static void hs_accept(Tab *tab)
+{
+	HistoryEntry *e = hs_current(tab);
+	if (e)
+		history_recall(tab, e);
+	hs_end(tab);
+}
+
+/* -------------------- LZ Codec -------------------- */
+// A small LZ77 byte codec for cold scrollback. Terminal output repeats a
+// lot (paths, prefixes, indentation), so even this simple greedy matcher
+// packs typical logs several times over at hundreds of MB/s.
+//
+// A block is a run of sequences. Each starts with a token holding the
+// literal count in its high nibble and the match length minus LZ_MIN_MATCH
+// in its low nibble, 15 meaning extra length bytes follow (255 means keep
+// adding). Then come the literals and, except in the last sequence, a
+// little-endian 16-bit match offset.
+#define LZ_HASH_BITS 13
+#define LZ_MIN_MATCH 4
+
+static int lz_bound(int n)
+{
+	return n + n / 255 + 16;
+}
+
+static unsigned char *lz_put_length(unsigned char *op, int len)
+{
+	while (len >= 255)
+	{
+		*op++ = 255;
+		len -= 255;
 	}
+	*op++ = len;
+	return op;
 }
 
-static void sigtstp_handler(int sig)
+// A match_len of 0 ends the block
+static unsigned char *lz_emit(unsigned char *op, const unsigned char *lit, int nlit, int match_len, int offset)
+{
+	int ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+	*op++ = (nlit < 15 ? nlit : 15) << 4 | (ml < 15 ? ml : 15);
+	if (nlit >= 15)
+		op = lz_put_length(op, nlit - 15);
+	memcpy(op, lit, nlit);
+	op += nlit;
+	if (match_len)
+	{
+		*op++ = offset & 0xff;
+		*op++ = offset >> 8;
+		if (ml >= 15)
+			op = lz_put_length(op, ml - 15);
+	}
+	return op;
+}
+
+// Packs `n` bytes into dst, which needs room for lz_bound(n). Returns the packed size.
+static int lz_compress(const unsigned char *src, int n, unsigned char *dst)
 {
-	Tab *tab = &tabs[current_tab];
-	if (tab->child_pid > 0)
+	int table[1 << LZ_HASH_BITS]; // Last position + 1 of each 4-byte hash
+	memset(table, 0, sizeof(table));
+	unsigned char *op = dst;
+	int anchor = 0, ip = 0;
+	while (ip + LZ_MIN_MATCH <= n)
 	{
-		kill(tab->child_pid, SIGTSTP);
+		uint32_t seq, at;
+		memcpy(&seq, src + ip, 4);
+		int h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+		int ref = table[h] - 1;
+		table[h] = ip + 1;
+		if (ref < 0 || ip - ref > 65535 || (memcpy(&at, src + ref, 4), at != seq))
+		{
+			// Stride faster through data that isn't matching
+			ip += 1 + ((ip - anchor) >> 5);
+			continue;
+		}
 
-		// Store the suspended process with its command
-		if (tab->suspended_count < 10)
+		// Extend the match 8 bytes at a time
+		int len = LZ_MIN_MATCH, mismatch = 0;
+		while (!mismatch && ip + len + 8 <= n)
 		{
-			tab->suspended_processes[tab->suspended_count].pid = tab->child_pid;
-			// Store the last command that was executed
-			if (strlen(tab->input_buf) > 0)
+			uint64_t a, b;
+			memcpy(&a, src + ref + len, 8);
+			memcpy(&b, src + ip + len, 8);
+			if (a != b)
 			{
-				strncpy(tab->suspended_processes[tab->suspended_count].command,
-						tab->input_buf,
-						sizeof(tab->suspended_processes[tab->suspended_count].command) - 1);
-				tab->suspended_processes[tab->suspended_count].command[sizeof(tab->suspended_processes[tab->suspended_count].command) - 1] = '\0';
+				len += __builtin_ctzll(a ^ b) >> 3;
+				mismatch = 1;
 			}
 			else
 			{
-				strcpy(tab->suspended_processes[tab->suspended_count].command, "unknown");
+				len += 8;
 			}
-			tab->suspended_count++;
-
-			char msg[256];
-			snprintf(msg, sizeof(msg), "[%d] suspended", tab->child_pid);
-			add_line_to_tab(tab, msg);
 		}
-
-		add_line_to_tab(tab, "^Z");
-		redraw();
-		tab->child_pid = -1;
+		while (!mismatch && ip + len < n && src[ref + len] == src[ip + len])
+			len++;
+		op = lz_emit(op, src + anchor, ip - anchor, len, ip - ref);
+		ip += len;
+		anchor = ip;
 	}
+	op = lz_emit(op, src + anchor, n - anchor, 0, 0);
+	return op - dst;
 }
 
-static void find_matching_files(Tab *tab, const char *prefix)
+static int lz_get_length(const unsigned char **ip, const unsigned char *end, int *len)
 {
-	tab->auto_complete_count = 0;
-	DIR *dir = opendir(".");
-	if (!dir)
-		return;
-	struct dirent *entry;
-	while ((entry = readdir(dir)) != NULL && tab->auto_complete_count < 100)
+	int b;
+	do
 	{
-		if (strncmp(entry->d_name, prefix, strlen(prefix)) == 0)
+		if (*ip >= end)
+			return 0;
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+	return 1;
+}
+
+// Returns 1 if `src` unpacks to exactly `n` bytes
+static int lz_decompress(const unsigned char *src, int packed, unsigned char *dst, int n)
+{
+	const unsigned char *ip = src, *end = src + packed;
+	unsigned char *op = dst, *out_end = dst + n;
+	while (ip < end)
+	{
+		int token = *ip++;
+		int nlit = token >> 4;
+		if (nlit == 15 && !lz_get_length(&ip, end, &nlit))
+			return 0;
+		if (nlit > end - ip || nlit > out_end - op)
+			return 0;
+		memcpy(op, ip, nlit);
+		op += nlit;
+		ip += nlit;
+		if (ip == end)
+			break; // Last sequence
+
+		if (end - ip < 2)
+			return 0;
+		int offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		int len = token & 15;
+		if (len == 15 && !lz_get_length(&ip, end, &len))
+			return 0;
+		len += LZ_MIN_MATCH;
+		if (offset == 0 || offset > op - dst || len > out_end - op)
+			return 0;
+		const unsigned char *ref = op - offset;
+		if (offset >= len)
 		{
-			tab->auto_complete_list[tab->auto_complete_count++] = strdup(entry->d_name);
+			memcpy(op, ref, len);
 		}
+		else
+		{
+			// Overlapping match, e.g. a run of one repeated byte
+			for (int i = 0; i < len; i++)
+				op[i] = ref[i];
+		}
+		op += len;
 	}
-	closedir(dir);
+	return op == out_end;
 }
 
-static char *find_common_prefix(Tab *tab)
+/* -------------------- Cold Scrollback -------------------- */
+// Lines that leave the ring are packed into segments: for each line a
+// 16-bit length, the text and a terminating NUL, so unpacked text can be
+// handed out in place. Segments are compressed in memory up to a budget
+// and beyond it spilled to an unlinked temp file when a spill directory
+// is configured; otherwise the oldest are dropped.
+static int sb_max_lines = 1000000;			   // MYTERM_SCROLLBACK_LINES, per tab
+static int sb_ring_lines = MAX_LINES;		   // Ring size, less when sb_max_lines is
+static size_t sb_memory_budget = 32 << 20;	   // MYTERM_SCROLLBACK_MB, compressed bytes per tab
+static const char *sb_spill_dir = NULL;		   // MYTERM_SCROLLBACK_SPILL
+
+static void scrollback_configure()
 {
-	if (tab->auto_complete_count == 0)
-		return NULL;
-	int min_len = strlen(tab->auto_complete_list[0]);
-	for (int i = 1; i < tab->auto_complete_count; i++)
+	const char *lines = getenv("MYTERM_SCROLLBACK_LINES");
+	if (lines && atoi(lines) > 0)
+		sb_max_lines = atoi(lines);
+	sb_ring_lines = sb_max_lines < MAX_LINES ? sb_max_lines : MAX_LINES;
+	const char *mb = getenv("MYTERM_SCROLLBACK_MB");
+	if (mb && atoi(mb) > 0)
+		sb_memory_budget = (size_t)atoi(mb) << 20;
+	const char *dir = getenv("MYTERM_SCROLLBACK_SPILL");
+	if (dir && *dir)
+		sb_spill_dir = dir;
+}
+
+static void cold_init(ColdStore *cs)
+{
+	memset(cs, 0, sizeof(*cs));
+	cs->spill_fd = -1;
+	for (int i = 0; i < SB_COLD_VIEWS; i++)
+		cs->views[i].first_seq = -1;
+}
+
+// Drops every segment but keeps the buffers and the spill file
+static void cold_clear(ColdStore *cs)
+{
+	for (int i = cs->first; i < cs->nsegs; i++)
+		free(cs->segs[i].packed);
+	cs->first = cs->spilled = cs->nsegs = 0;
+	cs->raw_bytes = cs->mem_bytes = cs->spill_bytes = cs->spill_dead = 0;
+	if (cs->spill_fd >= 0 && ftruncate(cs->spill_fd, 0) == 0)
+		cs->spill_end = 0;
+	else
+		cs->spill_dead = cs->spill_end;
+	for (int i = 0; i < SB_COLD_VIEWS; i++)
+		cs->views[i].first_seq = -1;
+}
+
+static void cold_free(ColdStore *cs)
+{
+	cold_clear(cs);
+	free(cs->segs);
+	if (cs->spill_fd >= 0)
+		close(cs->spill_fd);
+	free(cs->raw);
+	free(cs->pack);
+	for (int i = 0; i < SB_COLD_VIEWS; i++)
 	{
-		int len = strlen(tab->auto_complete_list[i]);
-		if (len < min_len)
-			min_len = len;
+		free(cs->views[i].raw);
+		free(cs->views[i].lines);
 	}
-	for (int pos = 0; pos < min_len; pos++)
+	cold_init(cs);
+}
+
+static int cold_reserve(unsigned char **buf, int *cap, int n)
+{
+	if (n <= *cap)
+		return 1;
+	unsigned char *grown = realloc(*buf, n);
+	if (!grown)
+		return 0;
+	*buf = grown;
+	*cap = n;
+	return 1;
+}
+
+// Compresses cs->raw into a new segment
+static int cold_add(ColdStore *cs, int raw_size, long long first_seq, int nlines)
+{
+	if (cs->nsegs == cs->seg_cap)
 	{
-		char c = tab->auto_complete_list[0][pos];
-		for (int i = 1; i < tab->auto_complete_count; i++)
+		if (cs->first > 0)
 		{
-			if (tab->auto_complete_list[i][pos] != c)
-			{
-				char *prefix = malloc(pos + 1);
-				strncpy(prefix, tab->auto_complete_list[0], pos);
-				prefix[pos] = '\0';
-				return prefix;
-			}
+			// Reuse the room left by dropped segments
+			memmove(cs->segs, cs->segs + cs->first, (cs->nsegs - cs->first) * sizeof(ColdSegment));
+			cs->nsegs -= cs->first;
+			cs->spilled -= cs->first;
+			cs->first = 0;
+		}
+		if (cs->nsegs == cs->seg_cap)
+		{
+			int new_cap = cs->seg_cap ? cs->seg_cap * 2 : 64;
+			ColdSegment *grown = realloc(cs->segs, new_cap * sizeof(ColdSegment));
+			if (!grown)
+				return 0;
+			cs->segs = grown;
+			cs->seg_cap = new_cap;
 		}
 	}
-	char *prefix = malloc(min_len + 1);
-	strncpy(prefix, tab->auto_complete_list[0], min_len);
-	prefix[min_len] = '\0';
-	return prefix;
+	if (!cold_reserve(&cs->pack, &cs->pack_cap, lz_bound(raw_size)))
+		return 0;
+
+	int packed_size = lz_compress(cs->raw, raw_size, cs->pack);
+	unsigned char *packed = malloc(packed_size);
+	if (!packed)
+		return 0;
+	memcpy(packed, cs->pack, packed_size);
+
+	ColdSegment *seg = &cs->segs[cs->nsegs++];
+	seg->first_seq = first_seq;
+	seg->nlines = nlines;
+	seg->raw_size = raw_size;
+	seg->packed_size = packed_size;
+	seg->packed = packed;
+	seg->offset = 0;
+	cs->raw_bytes += raw_size;
+	cs->mem_bytes += packed_size;
+	return 1;
 }
 
-static void handle_auto_complete(Tab *tab)
+// Rewrites the live part of the spill file over the dropped part
+static void cold_compact_spill(ColdStore *cs)
 {
-	// Find the current word being typed
-	char current_word[BUFSIZE] = {0};
-	int word_start = tab->in_pos;
+	off_t end = 0;
+	for (int i = cs->first; i < cs->spilled; i++)
+	{
+		ColdSegment *seg = &cs->segs[i];
+		if (!cold_reserve(&cs->pack, &cs->pack_cap, seg->packed_size) ||
+			pread(cs->spill_fd, cs->pack, seg->packed_size, seg->offset) != seg->packed_size ||
+			pwrite(cs->spill_fd, cs->pack, seg->packed_size, end) != seg->packed_size)
+			return; // Segments moved so far are still consistent
+		seg->offset = end;
+		end += seg->packed_size;
+	}
+	if (ftruncate(cs->spill_fd, end) == 0)
+	{
+		cs->spill_end = end;
+		cs->spill_dead = 0;
+	}
+}
 
-	// Find the start of the current word
-	while (word_start > 0 && tab->input_buf[word_start - 1] != ' ' &&
-		   tab->input_buf[word_start - 1] != '\n' &&
-		   tab->input_buf[word_start - 1] != '|' &&
-		   tab->input_buf[word_start - 1] != '>' &&
-		   tab->input_buf[word_start - 1] != '<' &&
-		   tab->input_buf[word_start - 1] != '&')
+// Moves the oldest segment still in memory to the spill file. Returns 0
+// if spilling is off or failed.
+static int cold_spill_oldest(ColdStore *cs)
+{
+	if (cs->spilled == cs->nsegs || !sb_spill_dir || cs->spill_failed)
+		return 0;
+
+	if (cs->spill_fd < 0)
 	{
-		word_start--;
+		char path[BUFSIZE];
+		snprintf(path, sizeof(path), "%s/myterm-scrollback-XXXXXX", sb_spill_dir);
+		cs->spill_fd = mkstemp(path);
+		if (cs->spill_fd < 0)
+		{
+			cs->spill_failed = 1;
+			return 0;
+		}
+		// Unlinked right away, so the file goes when the tab does, and
+		// not inherited by commands
+		unlink(path);
+		fcntl(cs->spill_fd, F_SETFD, FD_CLOEXEC);
 	}
 
-	int word_len = tab->in_pos - word_start;
+	ColdSegment *seg = &cs->segs[cs->spilled];
+	if (pwrite(cs->spill_fd, seg->packed, seg->packed_size, cs->spill_end) != seg->packed_size)
+	{
+		cs->spill_failed = 1;
+		return 0;
+	}
+	seg->offset = cs->spill_end;
+	cs->spill_end += seg->packed_size;
+	cs->spill_bytes += seg->packed_size;
+	cs->mem_bytes -= seg->packed_size;
+	free(seg->packed);
+	seg->packed = NULL;
+	cs->spilled++;
+	return 1;
+}
 
-	if (word_len <= 0)
+static void cold_drop_oldest(ColdStore *cs)
+{
+	ColdSegment *seg = &cs->segs[cs->first];
+	for (int i = 0; i < SB_COLD_VIEWS; i++)
+		if (cs->views[i].first_seq == seg->first_seq)
+			cs->views[i].first_seq = -1;
+
+	cs->raw_bytes -= seg->raw_size;
+	if (seg->packed)
 	{
-		// If no word to complete, show all files
-		strcpy(current_word, "");
+		cs->mem_bytes -= seg->packed_size;
+		free(seg->packed);
 	}
 	else
 	{
-		strncpy(current_word, tab->input_buf + word_start, word_len);
-		current_word[word_len] = '\0';
+		cs->spill_bytes -= seg->packed_size;
+		cs->spill_dead += seg->packed_size;
 	}
+	cs->first++;
+	if (cs->spilled < cs->first)
+		cs->spilled = cs->first;
 
-	// Clear previous auto-complete list
-	for (int i = 0; i < tab->auto_complete_count; i++)
+	if (cs->spill_dead > ((size_t)8 << 20) && cs->spill_dead > cs->spill_bytes)
+		cold_compact_spill(cs);
+}
+
+static int cold_unpack(ColdStore *cs, ColdSegment *seg, ColdView *view)
+{
+	view->first_seq = -1;
+	const unsigned char *packed = seg->packed;
+	if (!packed)
 	{
-		free(tab->auto_complete_list[i]);
+		if (!cold_reserve(&cs->pack, &cs->pack_cap, seg->packed_size) ||
+			pread(cs->spill_fd, cs->pack, seg->packed_size, seg->offset) != seg->packed_size)
+			return 0;
+		packed = cs->pack;
 	}
-	tab->auto_complete_count = 0;
+	if (!cold_reserve((unsigned char **)&view->raw, &view->raw_cap, seg->raw_size))
+		return 0;
+	if (seg->nlines > view->lines_cap)
+	{
+		Line *lines = realloc(view->lines, seg->nlines * sizeof(Line));
+		if (!lines)
+			return 0;
+		view->lines = lines;
+		view->lines_cap = seg->nlines;
+	}
+	if (!lz_decompress(packed, seg->packed_size, (unsigned char *)view->raw, seg->raw_size))
+		return 0;
 
-	// Find matching files in current directory
-	DIR *dir = opendir(tab->current_directory);
-	if (!dir)
+	char *p = view->raw, *end = view->raw + seg->raw_size;
+	for (int i = 0; i < seg->nlines; i++)
 	{
-		// Fallback to current working directory if tab directory fails
-		dir = opendir(".");
+		if (end - p < 3)
+			return 0;
+		int len = (unsigned char)p[0] | (unsigned char)p[1] << 8;
+		if (len > end - p - 3)
+			return 0;
+		view->lines[i] = (Line){.text = p + 2, .len = len};
+		p += len + 3;
 	}
+	view->first_seq = seg->first_seq;
+	return 1;
+}
 
-	if (!dir)
+// The cold lines from seq to the end of its segment; *n is their count.
+// Their text lies in order in one buffer, valid until SB_COLD_VIEWS other
+// segments have been read.
+static Line *cold_run(ColdStore *cs, long long seq, int *n)
+{
+	static char nothing[1];
+	static Line lost;
+
+	int lo = cs->first, hi = cs->nsegs - 1;
+	while (lo < hi)
 	{
-		add_line_to_tab(tab, "Error: Cannot open directory for auto-completion");
-		return;
+		int mid = (lo + hi + 1) / 2;
+		if (cs->segs[mid].first_seq <= seq)
+			lo = mid;
+		else
+			hi = mid - 1;
 	}
+	ColdSegment *seg = &cs->segs[lo];
 
-	struct dirent *entry;
-	while ((entry = readdir(dir)) != NULL && tab->auto_complete_count < 100)
+	cs->clock++;
+	ColdView *view = NULL, *oldest = &cs->views[0];
+	for (int i = 0; i < SB_COLD_VIEWS; i++)
 	{
-		// Skip hidden files unless the current word starts with '.'
-		if (entry->d_name[0] == '.' && current_word[0] != '.')
+		if (cs->views[i].first_seq == seg->first_seq)
+			view = &cs->views[i];
+		if (cs->views[i].last_use < oldest->last_use)
+			oldest = &cs->views[i];
+	}
+	if (!view)
+	{
+		view = oldest;
+		if (!cold_unpack(cs, seg, view))
 		{
-			continue;
+			// Unreadable, shown as an empty line
+			lost = (Line){.text = nothing};
+			*n = 1;
+			return &lost;
 		}
+	}
+	view->last_use = cs->clock;
+	*n = seg->nlines - (int)(seq - seg->first_seq);
+	return &view->lines[seq - seg->first_seq];
+}
 
-		// Check if this entry matches our current word
-		if (strncmp(entry->d_name, current_word, word_len) == 0)
+// A cold line, valid until SB_COLD_VIEWS other segments have been read
+static Line *cold_line(ColdStore *cs, long long seq)
+{
+	int n;
+	return cold_run(cs, seq, &n);
+}
+
+/* -------------------- Scrollback -------------------- */
+static void scrollback_init(Scrollback *sb)
+{
+	sb->ring = NULL;
+	sb->cap = 0;
+	sb->head = 0;
+	sb->hot = 0;
+	sb->count = 0;
+	sb->first_seq = 0;
+	sb->first_chunk = NULL;
+	sb->last_chunk = NULL;
+	sb->spare_chunks = NULL;
+	sb->spare_count = 0;
+	sb->wraps = (Arena){NULL, 16384, 0};
+	sb->wrap_epoch = 1;
+	sb->wrap_width = 0;
+	cold_init(&sb->cold);
+}
+
+static void scrollback_free(Scrollback *sb)
+{
+	free(sb->ring);
+	arena_free(&sb->wraps);
+	cold_free(&sb->cold);
+	TextChunk *lists[2] = {sb->first_chunk, sb->spare_chunks};
+	for (int i = 0; i < 2; i++)
+	{
+		TextChunk *c = lists[i];
+		while (c)
 		{
-			tab->auto_complete_list[tab->auto_complete_count++] = strdup(entry->d_name);
+			TextChunk *next = c->next;
+			free(c);
+			c = next;
 		}
 	}
-	closedir(dir);
+	scrollback_init(sb);
+}
 
-	if (tab->auto_complete_count == 0)
+// Forgets every line, as Ctrl+L does. Sequence numbers carry on so painted
+// frames never mistake new lines for old ones. The cost is per chunk and
+// segment, not per line: the tail chunk is kept for new output, a couple
+// more are kept as spares and the rest are freed.
+static void scrollback_clear(Scrollback *sb)
+{
+	sb->first_seq += sb->count;
+	sb->count = 0;
+	sb->hot = 0;
+	sb->head = 0;
+	cold_clear(&sb->cold);
+
+	TextChunk *c = sb->first_chunk;
+	while (c && c != sb->last_chunk)
 	{
-		// No matches found
-		return;
+		TextChunk *next = c->next;
+		if (sb->spare_count < SB_SPARE_CHUNKS)
+		{
+			c->next = sb->spare_chunks;
+			sb->spare_chunks = c;
+			sb->spare_count++;
+		}
+		else
+		{
+			free(c);
+		}
+		c = next;
 	}
-	else if (tab->auto_complete_count == 1)
+	if (sb->last_chunk)
 	{
-		// Single match - complete it
-		char *match = tab->auto_complete_list[0];
-		int match_len = strlen(match);
-		int remaining_len = match_len - word_len;
+		sb->last_chunk->used = 0;
+		sb->last_chunk->live = 0;
+	}
+	sb->first_chunk = sb->last_chunk;
 
-		if (remaining_len > 0 && tab->in_pos + remaining_len < BUFSIZE - 1)
-		{
-			// Insert the remaining part of the filename
-			memmove(tab->input_buf + tab->in_pos + remaining_len,
-					tab->input_buf + tab->in_pos,
-					strlen(tab->input_buf + tab->in_pos) + 1);
+	arena_reset(&sb->wraps);
+	sb->wrap_epoch++;
+}
 
-			memcpy(tab->input_buf + tab->in_pos, match + word_len, remaining_len);
-			tab->in_pos += remaining_len;
+// The i-th oldest line still held: O(1) in the ring, one binary search
+// and at worst one segment decompression in the cold store
+static Line *scrollback_line(Scrollback *sb, int i)
+{
+	int cold = sb->count - sb->hot;
+	if (i < cold)
+		return cold_line(&sb->cold, sb->first_seq + i);
+	return &sb->ring[(sb->head + i - cold) % sb->cap];
+}
 
-			// Add a space if it's a complete word (not a partial path)
-			if (tab->in_pos < BUFSIZE - 1)
-			{
-				tab->input_buf[tab->in_pos] = ' ';
-				tab->in_pos++;
-				tab->input_buf[tab->in_pos] = '\0';
-			}
+// Line i and the lines after it that share its buffer, *n in all
+static Line *scrollback_run(Scrollback *sb, int i, int *n)
+{
+	if (i < sb->count - sb->hot)
+		return cold_run(&sb->cold, sb->first_seq + i, n);
+	*n = 1;
+	return scrollback_line(sb, i);
+}
+
+// Takes the oldest line out of the ring; the caller accounts for where it went
+static void scrollback_evict_oldest(Scrollback *sb)
+{
+	Line *old = &sb->ring[sb->head];
+	TextChunk *c = old->chunk;
+
+	sb->head = (sb->head + 1) % sb->cap;
+	sb->hot--;
+
+	// Lines are packed in order, so an emptied chunk is always the first one.
+	// The last chunk is kept because new text is still being appended to it.
+	if (--c->live == 0 && c != sb->last_chunk)
+	{
+		sb->first_chunk = c->next;
+		if (sb->spare_count < SB_SPARE_CHUNKS)
+		{
+			c->next = sb->spare_chunks;
+			sb->spare_chunks = c;
+			sb->spare_count++;
+		}
+		else
+		{
+			free(c);
 		}
+	}
+}
 
-		free(tab->auto_complete_list[0]);
-		tab->auto_complete_count = 0;
+// Doubles the ring, unrolling it so the oldest line sits in slot 0
+static int scrollback_grow(Scrollback *sb)
+{
+	int new_cap = sb->cap ? sb->cap * 2 : 64;
+	if (new_cap > sb_ring_lines)
+		new_cap = sb_ring_lines;
+	Line *ring = malloc(new_cap * sizeof(Line));
+	if (!ring)
+		return 0;
+	for (int i = 0; i < sb->hot; i++)
+		ring[i] = sb->ring[(sb->head + i) % sb->cap];
+	free(sb->ring);
+	sb->ring = ring;
+	sb->cap = new_cap;
+	sb->head = 0;
+	return 1;
+}
+
+static TextChunk *scrollback_new_chunk(Scrollback *sb)
+{
+	TextChunk *c = sb->spare_chunks;
+	if (c)
+	{
+		sb->spare_chunks = c->next;
+		sb->spare_count--;
 	}
 	else
 	{
-		// Multiple matches
-		char *common_prefix = find_common_prefix(tab);
+		c = malloc(sizeof(TextChunk));
+		if (!c)
+			return NULL;
+	}
+	c->next = NULL;
+	c->used = 0;
+	c->live = 0;
 
-		if (common_prefix && strlen(common_prefix) > word_len)
+	if (sb->last_chunk)
+		sb->last_chunk->next = c;
+	else
+		sb->first_chunk = c;
+	sb->last_chunk = c;
+	return c;
+}
+
+// Drops the oldest lines while over the line limit, and the oldest cold
+// segments while over the memory budget once spilling is off or failing.
+// The oldest segment may start before first_seq; its first lines are gone.
+static void scrollback_trim(Scrollback *sb)
+{
+	ColdStore *cs = &sb->cold;
+	if (sb->count > sb_max_lines)
+	{
+		sb->first_seq += sb->count - sb_max_lines;
+		sb->count = sb_max_lines;
+	}
+	while (cs->first < cs->nsegs)
+	{
+		long long end = cs->segs[cs->first].first_seq + cs->segs[cs->first].nlines;
+		if (end > sb->first_seq)
 		{
-			// Complete to common prefix
-			int common_len = strlen(common_prefix);
-			int remaining_len = common_len - word_len;
+			if (cs->mem_bytes <= sb_memory_budget)
+				break;
+			if (cold_spill_oldest(cs))
+				continue;
+			sb->count -= end - sb->first_seq;
+			sb->first_seq = end;
+		}
+		cold_drop_oldest(cs);
+	}
+}
 
-			if (remaining_len > 0 && tab->in_pos + remaining_len < BUFSIZE - 1)
-			{
-				memmove(tab->input_buf + tab->in_pos + remaining_len,
-						tab->input_buf + tab->in_pos,
-						strlen(tab->input_buf + tab->in_pos) + 1);
+// Makes room in the full ring by compressing its oldest lines into a cold
+// segment, or dropping the oldest line when scrollback is limited to the ring
+static void scrollback_freeze(Scrollback *sb)
+{
+	ColdStore *cs = &sb->cold;
+	if (sb_max_lines <= MAX_LINES)
+	{
+		scrollback_evict_oldest(sb);
+		sb->first_seq++;
+		sb->count--;
+		return;
+	}
 
-				memcpy(tab->input_buf + tab->in_pos, common_prefix + word_len, remaining_len);
-				tab->in_pos += remaining_len;
-				tab->input_buf[tab->in_pos] = '\0';
-			}
+	int n = sb->hot < SB_SEGMENT_LINES ? sb->hot : SB_SEGMENT_LINES;
+	int raw_size = 0;
+	for (int i = 0; i < n; i++)
+		raw_size += sb->ring[(sb->head + i) % sb->cap].len + 3;
 
-			free(common_prefix);
-		}
-		else
+	long long seq = sb->first_seq + sb->count - sb->hot;
+	int stored = cold_reserve(&cs->raw, &cs->raw_cap, raw_size);
+	if (stored)
+	{
+		unsigned char *p = cs->raw;
+		for (int i = 0; i < n; i++)
 		{
-			add_line_to_tab(tab, "Multiple matches:");
+			Line *ln = &sb->ring[(sb->head + i) % sb->cap];
+			p[0] = ln->len & 0xff;
+			p[1] = ln->len >> 8;
+			memcpy(p + 2, ln->text, ln->len + 1);
+			p += ln->len + 3;
+		}
+		stored = cold_add(cs, raw_size, seq, n);
+	}
+	if (!stored)
+	{
+		// Out of memory: everything older than the ring goes, so the
+		// scrollback stays contiguous
+		cold_clear(cs);
+		sb->first_seq = seq + n;
+		sb->count = sb->hot - n;
+	}
 
-			for (int i = 0; i < tab->auto_complete_count - 1; i++)
-			{
-				for (int j = i + 1; j < tab->auto_complete_count; j++)
-				{
-					if (strcasecmp(tab->auto_complete_list[i], tab->auto_complete_list[j]) > 0)
-					{
+	for (int i = 0; i < n; i++)
+		scrollback_evict_oldest(sb);
+	scrollback_trim(sb);
+}
+
+static void scrollback_append(Scrollback *sb, const char *s, int len)
+{
+	if (len > SB_CHUNK_SIZE - 1)
+		len = SB_CHUNK_SIZE - 1;
+
+	if (sb->hot == sb_ring_lines)
+		scrollback_freeze(sb);
+	else if (sb->hot == sb->cap && !scrollback_grow(sb))
+		return;
+
+	TextChunk *c = sb->last_chunk;
+	if (!c || c->used + len + 1 > SB_CHUNK_SIZE)
+	{
+		// Retire an idle tail chunk before starting a new one
+		if (c && c->live == 0)
+		{
+			c->used = 0;
+		}
+		else
+		{
+			c = scrollback_new_chunk(sb);
+			if (!c)
+				return;
+		}
+	}
+
+	Line *line = &sb->ring[(sb->head + sb->hot) % sb->cap];
+	line->text = c->data + c->used;
+	line->len = len;
+	line->chunk = c;
+	line->wrap_epoch = 0;
+	line->breaks = NULL;
+	memcpy(line->text, s, len);
+	line->text[len] = '\0';
+	c->used += len + 1;
+	c->live++;
+	sb->hot++;
+	sb->count++;
+	if (sb->count > sb_max_lines)
+		scrollback_trim(sb);
+}
+
+/* -------------------- Output Line Framing -------------------- */
+// Length of s without a trailing UTF-8 sequence that runs past len
+static int utf8_cut(const char *s, int len)
+{
+	for (int i = len - 1; i > 0 && i >= len - 3; i--)
+	{
+		unsigned char c = s[i];
+		if ((c & 0xC0) == 0x80)
+			continue;
+		int need = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+		return i + need > len ? i : len;
+	}
+	return len;
+}
+
+// Appends one line, splitting it every LINE_SPLIT bytes at a character
+// boundary. Every line the framer produces goes through here.
+static void framer_emit(Scrollback *sb, const char *p, int len)
+{
+	while (len > LINE_SPLIT)
+	{
+		int cut = utf8_cut(p, LINE_SPLIT);
+		scrollback_append(sb, p, cut);
+		p += cut;
+		len -= cut;
+	}
+	scrollback_append(sb, p, len);
+}
+
+static void framer_init(LineFramer *fr)
+{
+	fr->partial = NULL;
+	fr->partial_len = 0;
+}
+
+static void framer_release(LineFramer *fr)
+{
+	free(fr->partial);
+	framer_init(fr);
+}
+
+static void framer_carry(LineFramer *fr, Scrollback *sb, const char *p, int len)
+{
+	if (!fr->partial && !(fr->partial = malloc(LINE_SPLIT)))
+		return;
+
+	while (len > 0)
+	{
+		// A full buffer is emitted up to its last whole character and the
+		// rest of that character stays for the next piece
+		if (fr->partial_len == LINE_SPLIT)
+		{
+			int cut = utf8_cut(fr->partial, LINE_SPLIT);
+			scrollback_append(sb, fr->partial, cut);
+			fr->partial_len -= cut;
+			memmove(fr->partial, fr->partial + cut, fr->partial_len);
+		}
+
+		int room = LINE_SPLIT - fr->partial_len;
+		int n = len < room ? len : room;
+		memcpy(fr->partial + fr->partial_len, p, n);
+		fr->partial_len += n;
+		p += n;
+		len -= n;
+	}
+}
+
+// Feed one read() worth of output. Complete lines are appended to the
+// scrollback straight from `buf`; only a trailing partial line is copied.
+static void framer_feed(LineFramer *fr, Scrollback *sb, const char *buf, size_t n)
+{
+	const char *p = buf;
+	const char *end = buf + n;
+	const char *nl;
+
+	while (p < end && (nl = memchr(p, '\n', end - p)) != NULL)
+	{
+		if (fr->partial_len > 0)
+		{
+			framer_carry(fr, sb, p, nl - p);
+			framer_emit(sb, fr->partial, fr->partial_len);
+			fr->partial_len = 0;
+		}
+		else
+		{
+			framer_emit(sb, p, nl - p);
+		}
+		p = nl + 1;
+	}
+
+	if (p < end)
+		framer_carry(fr, sb, p, end - p);
+}
+
+// Emit whatever is left once the stream reaches EOF
+static void framer_flush(LineFramer *fr, Scrollback *sb)
+{
+	if (fr->partial_len > 0)
+		framer_emit(sb, fr->partial, fr->partial_len);
+	framer_release(fr);
+}
+
+/* -------------------- GUI Drawing -------------------- */
+static void add_line_to_tab(Tab *tab, const char *s)
+{
+	scrollback_append(&tab->lines, s, strlen(s));
+}
+
+static void add_line_to_current_tab(const char *s)
+{
+	add_line_to_tab(tabs[current_tab], s);
+}
+
+static void add_line(const char *s)
+{
+	add_line_to_current_tab(s);
+}
+
+/* -------------------- Tab Management -------------------- */
+// A fresh tab with empty buffers, or NULL if out of memory
+static Tab *tab_new(int number)
+{
+	Tab *tab = calloc(1, sizeof(Tab));
+	if (!tab)
+		return NULL;
+	if (!reserve_text(&tab->input_buf, &tab->input_cap, 0) ||
+		!reserve_text(&tab->search_term, &tab->search_cap, 0))
+	{
+		free(tab->input_buf);
+		free(tab);
+		return NULL;
+	}
+	tab->input_buf[0] = '\0';
+	tab->search_term[0] = '\0';
+	scrollback_init(&tab->lines);
+	tab->scratch = (Arena){NULL, 4096, 0};
+	tab->commands.cursor = -1;
+	tab->job.state = JOB_IDLE;
+	tab->job.out_fd = -1;
+	tab->shell_stdin[0] = tab->shell_stdin[1] = -1;
+	tab->shell_stdout[0] = tab->shell_stdout[1] = -1;
+	for (int i = 0; i < 10; i++)
+		tab->suspended_processes[i].pid = -1;
+
+	// Initialize current directory
+	tab->current_directory = getcwd(NULL, 0);
+	if (!tab->current_directory)
+		tab->current_directory = strdup("/");
+
+	tab->number = number;
+	snprintf(tab->tab_name, sizeof(tab->tab_name), "Tab %d", number);
+	return tab;
+}
+
+// Frees a tab's memory; its processes must already be gone
+static void tab_free(Tab *tab)
+{
+	scrollback_free(&tab->lines);
+	free_tab_frame(tab);
+	arena_free(&tab->scratch);
+	for (int i = 0; i < tab->suspended_count; i++)
+		free(tab->suspended_processes[i].command);
+	free(tab->job.command);
+	free(tab->input_buf);
+	free(tab->search_term);
+	free(tab->shell_carry);
+	free(tab->hsearch.results);
+	free(tab->find.term);
+	free(tab->find.scanned);
+	free(tab->find.hits);
+	if (tab->commands.count > tab->commands.first)
+	{
+		free(tab->commands.recs[tab->commands.count - 1].command);
+		free(tab->commands.recs[tab->commands.count - 1].cwd);
+	}
+	free(tab->commands.recs);
+	free(tab->current_directory);
+	free(tab);
+}
+
+static int tab_append(Tab *tab)
+{
+	if (tab_count == tab_capacity)
+	{
+		int new_capacity = tab_capacity ? tab_capacity * 2 : 8;
+		Tab **grown = realloc(tabs, new_capacity * sizeof(Tab *));
+		if (!grown)
+			return 0;
+		tabs = grown;
+		tab_capacity = new_capacity;
+	}
+	tabs[tab_count++] = tab;
+	tab_generation++;
+	return 1;
+}
+
+static void create_new_tab()
+{
+	Tab *tab = tab_new(tab_count + 1);
+	if (!tab)
+		return;
+	if (!tab_append(tab))
+	{
+		tab_free(tab);
+		return;
+	}
+
+	// Add welcome message to the new tab
+	char welcome[BUFSIZE];
+	snprintf(welcome, sizeof(welcome), "New tab %d created - Use Ctrl+W to close tab", tab_count);
+	add_line_to_tab(tab, welcome);
+}
+
+static void close_current_tab()
+{
+	if (tab_count <= 1)
+		return;
+
+	Tab *tab = tabs[current_tab];
+
+	// Kill shell process if exists
+	shell_stop(tab);
+
+	// Kill the running job, if any
+	job_discard(tab);
+
+	// Kill background processes for this tab
+	for (int i = 0; i < tab->bg_pid_count; i++)
+	{
+		if (tab->background_pids[i] > 0)
+		{
+			kill(tab->background_pids[i], SIGTERM);
+			waitpid(tab->background_pids[i], NULL, 0);
+		}
+	}
+
+	// Kill suspended processes for this tab
+	for (int i = 0; i < tab->suspended_count; i++)
+	{
+		SuspendedProcess *sp = &tab->suspended_processes[i];
+		if (sp->pid > 0)
+		{
+			kill(-sp->pid, SIGTERM);
+			kill(-sp->pid, SIGCONT);
+			while (waitpid(-sp->pid, NULL, 0) > 0)
+				;
+		}
+		if (sp->out_fd >= 0)
+			close(sp->out_fd);
+	}
+
+	tab_free(tab);
+
+	// Remove it from the list
+	memmove(tabs + current_tab, tabs + current_tab + 1, (tab_count - current_tab - 1) * sizeof(Tab *));
+	tab_count--;
+	tab_generation++;
+
+	// Adjust current_tab if needed
+	if (current_tab >= tab_count)
+	{
+		current_tab = tab_count - 1;
+	}
+
+	// Add close message to current tab
+	char msg[64];
+	snprintf(msg, sizeof(msg), "Tab closed. Now in %s", tabs[current_tab]->tab_name);
+	add_line_to_tab(tabs[current_tab], msg);
+}
+
+static void switch_tab(int direction)
+{
+	if (tab_count <= 1)
+		return;
+
+	current_tab = (current_tab + direction + tab_count) % tab_count;
+	tab_switched();
+}
+
+/* -------------------- Fonts and Glyph Cache -------------------- */
+// Text is UTF-8 throughout. Each code point is resolved once to the font
+// that has it (the primary font or a fontconfig fallback), its glyph index
+// and its advance. Xft keeps rasterized glyphs on the server, so drawing a
+// character seen before only composites it from there.
+#define GLYPH_PAGE 256
+#define MAX_FALLBACK_FONTS 16
+
+typedef struct
+{
+	XftFont *font; // NULL until the code point is first looked up
+	FT_UInt index;
+	short advance;
+} CachedGlyph;
+
+typedef struct
+{
+	int monospace;
+	int advance; // Width of every ASCII glyph when monospace
+	CachedGlyph *pages[0x110000 / GLYPH_PAGE];
+	XftFont *fallbacks[MAX_FALLBACK_FONTS];
+	int nfallbacks;
+	long glyphs; // Code points resolved so far
+} FontMetrics;
+
+static FontMetrics metrics;
+
+// Decodes one UTF-8 sequence. Malformed input decodes as U+FFFD and
+// consumes a single byte, so every byte string can be drawn.
+static unsigned utf8_decode(const char *str, int len, int *size)
+{
+	const unsigned char *s = (const unsigned char *)str;
+	unsigned c = s[0];
+	*size = 1;
+	if (c < 0x80)
+		return c;
+
+	int n;
+	unsigned min;
+	if (c >= 0xC2 && c <= 0xDF)
+		n = 1, min = 0x80, c &= 0x1F;
+	else if (c >= 0xE0 && c <= 0xEF)
+		n = 2, min = 0x800, c &= 0x0F;
+	else if (c >= 0xF0 && c <= 0xF4)
+		n = 3, min = 0x10000, c &= 0x07;
+	else
+		return 0xFFFD;
+	if (n >= len)
+		return 0xFFFD;
+
+	for (int i = 1; i <= n; i++)
+	{
+		if ((s[i] & 0xC0) != 0x80)
+			return 0xFFFD;
+		c = (c << 6) | (s[i] & 0x3F);
+	}
+	if (c < min || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF))
+		return 0xFFFD;
+	*size = n + 1;
+	return c;
+}
+
+// Start of the code point before pos
+static int utf8_prev(const char *s, int pos)
+{
+	if (pos <= 0)
+		return 0;
+	int p = pos - 1;
+	while (p > 0 && pos - p < 4 && ((unsigned char)s[p] & 0xC0) == 0x80)
+		p--;
+	int size;
+	utf8_decode(s + p, pos - p, &size);
+	return p + size == pos ? p : pos - 1;
+}
+
+// Start of the code point after pos
+static int utf8_next(const char *s, int pos, int len)
+{
+	if (pos >= len)
+		return len;
+	int size;
+	utf8_decode(s + pos, len - pos, &size);
+	return pos + size;
+}
+
+// Asks fontconfig for a font covering c, reusing fallbacks opened before
+static XftFont *fallback_font(unsigned c)
+{
+	for (int i = 0; i < metrics.nfallbacks; i++)
+		if (XftCharExists(dpy, metrics.fallbacks[i], c))
+			return metrics.fallbacks[i];
+	if (metrics.nfallbacks == MAX_FALLBACK_FONTS)
+		return NULL;
+
+	FcPattern *pattern = FcNameParse((const FcChar8 *)FONT_NAME);
+	FcCharSet *charset = FcCharSetCreate();
+	if (!pattern || !charset)
+	{
+		if (pattern)
+			FcPatternDestroy(pattern);
+		if (charset)
+			FcCharSetDestroy(charset);
+		return NULL;
+	}
+	FcCharSetAddChar(charset, c);
+	FcPatternAddCharSet(pattern, FC_CHARSET, charset);
+	FcCharSetDestroy(charset);
+
+	FcResult result;
+	FcPattern *match = XftFontMatch(dpy, DefaultScreen(dpy), pattern, &result);
+	FcPatternDestroy(pattern);
+	if (!match)
+		return NULL;
+	XftFont *f = XftFontOpenPattern(dpy, match);
+	if (!f)
+	{
+		FcPatternDestroy(match);
+		return NULL;
+	}
+	if (!XftCharExists(dpy, f, c))
+	{
+		XftFontClose(dpy, f);
+		return NULL;
+	}
+	metrics.fallbacks[metrics.nfallbacks++] = f;
+	return f;
+}
+
+static CachedGlyph *lookup_glyph(unsigned c)
+{
+	// Control characters take a space's place
+	if (c < 0x20 || c == 0x7F)
+		c = ' ';
+
+	CachedGlyph **page = &metrics.pages[c / GLYPH_PAGE];
+	if (!*page)
+	{
+		*page = calloc(GLYPH_PAGE, sizeof(CachedGlyph));
+		if (!*page)
+		{
+			static CachedGlyph missing;
+			missing.font = font;
+			missing.advance = metrics.advance;
+			return &missing;
+		}
+	}
+	CachedGlyph *g = &(*page)[c % GLYPH_PAGE];
+	if (g->font)
+		return g;
+
+	XftFont *f = font;
+	if (!XftCharExists(dpy, font, c))
+	{
+		XftFont *fallback = fallback_font(c);
+		if (fallback)
+			f = fallback;
+	}
+	XGlyphInfo info;
+	g->font = f;
+	g->index = XftCharIndex(dpy, f, c);
+	XftGlyphExtents(dpy, f, &g->index, 1, &info);
+	g->advance = info.xOff;
+	metrics.glyphs++;
+	return g;
+}
+
+static void load_font_metrics()
+{
+	metrics.advance = lookup_glyph('M')->advance;
+	metrics.monospace = 1;
+	for (unsigned c = ' '; c < 0x7F; c++)
+		if (lookup_glyph(c)->advance != metrics.advance)
+			metrics.monospace = 0;
+}
+
+static int text_width(const char *s, int len)
+{
+	int w = 0;
+	for (int i = 0; i < len;)
+	{
+		if ((unsigned char)s[i] < 0x80 && metrics.monospace)
+		{
+			w += metrics.advance;
+			i++;
+			continue;
+		}
+		int size;
+		w += lookup_glyph(utf8_decode(s + i, len - i, &size))->advance;
+		i += size;
+	}
+	return w;
+}
+
+/* -------------------- Command Index -------------------- */
+// Where each command's output sits in the tab's scrollback. Records are
+// appended as commands run, so they are ordered by line: finding the
+// command at a line is a binary search and stepping between prompts is
+// an index increment. A collapsed command's output is shown as one row,
+// and the view steps from that row straight past its last line, so a
+// collapsed log is never laid out or painted however long it is.
+
+// Forgets commands whose lines have all left the scrollback
+static void commands_trim(Tab *tab)
+{
+	CommandIndex *ci = &tab->commands;
+	while (ci->first < ci->count && ci->recs[ci->first].end_seq >= 0 &&
+		   ci->recs[ci->first].end_seq <= tab->lines.first_seq)
+	{
+		if (ci->recs[ci->first].collapsed)
+			ci->collapsed--;
+		ci->first++;
+	}
+	if (ci->first > 0 && ci->first * 2 >= ci->count)
+	{
+		memmove(ci->recs, ci->recs + ci->first, (ci->count - ci->first) * sizeof(CommandRecord));
+		ci->count -= ci->first;
+		ci->cursor = ci->cursor >= ci->first ? ci->cursor - ci->first : -1;
+		ci->first = 0;
+	}
+}
+
+// Starts a record once the prompt and the command line are in the scrollback
+static void command_begin(Tab *tab, const char *cmdline)
+{
+	CommandIndex *ci = &tab->commands;
+	Scrollback *sb = &tab->lines;
+	commands_trim(tab);
+	if (ci->count == ci->cap)
+	{
+		int new_cap = ci->cap ? ci->cap * 2 : 16;
+		CommandRecord *grown = realloc(ci->recs, new_cap * sizeof(CommandRecord));
+		if (!grown)
+			return;
+		ci->recs = grown;
+		ci->cap = new_cap;
+	}
+
+	CommandRecord *rec = &ci->recs[ci->count++];
+	long long end = sb->first_seq + sb->count;
+	rec->prompt_seq = end - 2;
+	rec->out_seq = end;
+	rec->end_seq = -1;
+	rec->start_time = time(NULL);
+	rec->started = now_seconds();
+	rec->duration = 0;
+	rec->status = -1;
+	rec->collapsed = 0;
+	rec->command = strdup(cmdline);
+	rec->cwd = strdup(tab->current_directory);
+}
+
+// Closes the running command's record after its last line of output and
+// writes it to the history journal
+static void command_end(Tab *tab, int status)
+{
+	CommandIndex *ci = &tab->commands;
+	if (ci->count == ci->first)
+		return;
+	CommandRecord *rec = &ci->recs[ci->count - 1];
+	if (rec->end_seq >= 0)
+		return;
+	rec->end_seq = tab->lines.first_seq + tab->lines.count;
+	rec->duration = now_seconds() - rec->started;
+	rec->status = status;
+	if (rec->command && rec->cwd && rec->command[0])
+		history_log(rec->command, rec->cwd, tab->number, rec->start_time, rec->duration, status);
+	free(rec->command);
+	free(rec->cwd);
+	rec->command = rec->cwd = NULL;
+}
+
+// Index of the last command whose prompt is at or before line `seq`;
+// below `first` if there is none
+static int command_at(Tab *tab, long long seq)
+{
+	CommandIndex *ci = &tab->commands;
+	int lo = ci->first, hi = ci->count;
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		if (ci->recs[mid].prompt_seq <= seq)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo - 1;
+}
+
+// Line a collapsed command's row stands for: its first line of output
+// still held
+static long long fold_anchor(Tab *tab, const CommandRecord *rec)
+{
+	return rec->out_seq > tab->lines.first_seq ? rec->out_seq : tab->lines.first_seq;
+}
+
+// The collapsed command whose output includes line `seq`, or NULL
+static CommandRecord *fold_at(Tab *tab, long long seq)
+{
+	CommandIndex *ci = &tab->commands;
+	if (ci->collapsed == 0)
+		return NULL;
+	int i = command_at(tab, seq);
+	if (i < ci->first)
+		return NULL;
+	CommandRecord *rec = &ci->recs[i];
+	if (!rec->collapsed || seq < fold_anchor(tab, rec) || seq >= rec->end_seq)
+		return NULL;
+	return rec;
+}
+
+static void fold_set(Tab *tab, CommandRecord *rec, int collapsed)
+{
+	if (rec->collapsed == collapsed)
+		return;
+	rec->collapsed = collapsed;
+	tab->commands.collapsed += collapsed ? 1 : -1;
+}
+
+// Text of a collapsed command's row
+static int fold_summary(Tab *tab, const CommandRecord *rec, char *out, size_t size)
+{
+	char when[16];
+	strftime(when, sizeof(when), "%H:%M:%S", localtime(&rec->start_time));
+	int n = snprintf(out, size, "[+] %lld lines collapsed (started %s, %.1f s, exit %d) - Ctrl+O expands",
+					 rec->end_seq - fold_anchor(tab, rec), when, rec->duration, rec->status);
+	return n < (int)size ? n : (int)size - 1;
+}
+
+/* -------------------- Line Wrapping -------------------- */
+// Output lines are soft-wrapped to the window width. A line is wrapped the
+// first time it is laid out at a given width, so a resize costs nothing
+// until lines scroll into view. The view is addressed in wrapped rows.
+static int wrap_width()
+{
+	int w = win_width - 8;
+	return w > 1 ? w : 1;
+}
+
+// Rows break between characters; a glyph wider than the row gets a row of its own
+static int line_rows(Scrollback *sb, Line *ln)
+{
+	int width = wrap_width();
+	if (sb->wrap_width != width || sb->wraps.used > SB_WRAP_BUDGET)
+	{
+		// A new width lays everything out again, so the old breaks can go
+		arena_reset(&sb->wraps);
+		sb->wrap_epoch++;
+		sb->wrap_width = width;
+	}
+	if (ln->wrap_epoch == sb->wrap_epoch)
+		return ln->nrows;
+
+	unsigned short local[LINE_BREAKS_LOCAL];
+	unsigned short *breaks = local;
+	int rows = 1, cap = LINE_BREAKS_LOCAL, x = 0;
+	for (int i = 0; i < ln->len;)
+	{
+		int size = 1, advance = metrics.advance;
+		if ((unsigned char)ln->text[i] >= 0x80 || !metrics.monospace)
+			advance = lookup_glyph(utf8_decode(ln->text + i, ln->len - i, &size))->advance;
+		if (x > 0 && x + advance > width)
+		{
+			if (rows - 1 == cap)
+			{
+				// A very long line; it can't need more than a row per byte
+				unsigned short *all = arena_alloc(&sb->wraps, ln->len * sizeof(unsigned short));
+				if (!all)
+					break; // The rest of the line stays on its last row, clipped
+				memcpy(all, breaks, cap * sizeof(unsigned short));
+				breaks = all;
+				cap = ln->len;
+			}
+			breaks[rows - 1] = i;
+			rows++;
+			x = 0;
+		}
+		x += advance;
+		i += size;
+	}
+
+	ln->breaks = breaks != local ? breaks : NULL;
+	if (rows > 1 && breaks == local)
+	{
+		ln->breaks = arena_alloc(&sb->wraps, (rows - 1) * sizeof(unsigned short));
+		if (!ln->breaks)
+			rows = 1;
+		else
+			memcpy(ln->breaks, breaks, (rows - 1) * sizeof(unsigned short));
+	}
+	ln->nrows = rows;
+	ln->wrap_epoch = sb->wrap_epoch;
+	return rows;
+}
+
+static void line_segment(Scrollback *sb, Line *ln, int row, const char **text, int *len)
+{
+	line_rows(sb, ln);
+	int start = row > 0 ? ln->breaks[row - 1] : 0;
+	int end = row < ln->nrows - 1 ? ln->breaks[row] : ln->len;
+	*text = ln->text + start;
+	*len = end - start;
+}
+
+static Line *line_at(Scrollback *sb, long long seq)
+{
+	return scrollback_line(sb, (int)(seq - sb->first_seq));
+}
+
+// Puts pos on the last row of line `seq`, or on the row of the collapsed
+// command it belongs to
+static void last_row_of(Tab *tab, RowPos *pos, long long seq)
+{
+	CommandRecord *fold = fold_at(tab, seq);
+	if (fold)
+	{
+		pos->seq = fold_anchor(tab, fold);
+		pos->row = 0;
+	}
+	else
+	{
+		pos->seq = seq;
+		pos->row = line_rows(&tab->lines, line_at(&tab->lines, seq)) - 1;
+	}
+}
+
+// Moves pos by delta wrapped rows, stopping at either end of the scrollback.
+// Returns how many rows it actually moved.
+static int move_rows(Tab *tab, RowPos *pos, int delta)
+{
+	Scrollback *sb = &tab->lines;
+	int moved = 0;
+	long long last_seq = sb->first_seq + sb->count - 1;
+	while (delta < 0)
+	{
+		if (pos->row > 0)
+		{
+			int k = pos->row < -delta ? pos->row : -delta;
+			pos->row -= k;
+			delta += k;
+			moved += k;
+		}
+		else if (pos->seq > sb->first_seq)
+		{
+			last_row_of(tab, pos, pos->seq - 1);
+			delta++;
+			moved++;
+		}
+		else
+			break;
+	}
+	while (delta > 0)
+	{
+		CommandRecord *fold = fold_at(tab, pos->seq);
+		long long next = fold ? fold->end_seq : pos->seq + 1;
+		int left = fold ? 0 : line_rows(sb, line_at(sb, pos->seq)) - 1 - pos->row;
+		if (left > 0)
+		{
+			int k = left < delta ? left : delta;
+			pos->row += k;
+			delta -= k;
+			moved += k;
+		}
+		else if (next <= last_seq)
+		{
+			pos->seq = next;
+			pos->row = 0;
+			delta--;
+			moved++;
+		}
+		else
+			break;
+	}
+	return moved;
+}
+
+// Top row of a view of `rows` rows. A scrolled view that has come back
+// down to the newest output follows the bottom again.
+static RowPos view_top(Tab *tab, int rows)
+{
+	Scrollback *sb = &tab->lines;
+	RowPos bottom = {sb->first_seq, 0};
+	if (sb->count == 0)
+	{
+		tab->scrolled = 0;
+		return bottom;
+	}
+
+	last_row_of(tab, &bottom, sb->first_seq + sb->count - 1);
+	move_rows(tab, &bottom, -(rows - 1));
+	if (!tab->scrolled)
+		return bottom;
+
+	RowPos top = tab->view;
+	if (top.seq < sb->first_seq)
+		top = (RowPos){sb->first_seq, 0};
+	CommandRecord *fold = fold_at(tab, top.seq);
+	if (fold)
+		top = (RowPos){fold_anchor(tab, fold), 0};
+	int nrows = fold ? 1 : line_rows(sb, line_at(sb, top.seq));
+	if (top.row >= nrows)
+		top.row = nrows - 1;
+	if (top.seq > bottom.seq || (top.seq == bottom.seq && top.row >= bottom.row))
+	{
+		tab->scrolled = 0;
+		return bottom;
+	}
+	tab->view = top;
+	return top;
+}
+
+/* -------------------- Render Backends -------------------- */
+// Frames are painted into an off-screen copy of the window through one of
+// these backends and the changed span is then presented. "xft" keeps the
+// copy in a server-side Pixmap and draws with Xft; "shm" rasterizes into a
+// shared-memory XImage on the client from a glyph atlas, so painting
+// never goes through the protocol and presenting is one XShmPutImage.
+// Each tab has its own surface, so switching tabs only presents a
+// different one.
+typedef struct
+{
+	int width, height;
+	Pixmap pixmap; // xft
+	XftDraw *draw;
+	XImage *image; // shm
+	XShmSegmentInfo shm;
+} Surface;
+
+typedef struct
+{
+	const char *name;
+	int (*init)(); // Returns 0 if the backend cannot run on this display
+	void (*shutdown)();
+	Surface *(*create)(int width, int height); // NULL on failure
+	void (*destroy)(Surface *surface);
+	void (*fill)(int x, int y, int w, int h, const XftColor *color);
+	void (*glyphs)(const XftGlyphFontSpec *specs, int n, const XftColor *color);
+	void (*copy_rows)(int src_y, int dst_y, int h); // Full-width move inside the surface
+	void (*present)(int x, int y, int w, int h);	// Copy to the window
+} RenderBackend;
+
+static Surface *target; // Surface the drawing calls go to
+
+// Xft backend
+static GC fill_gc;
+
+static int xft_init()
+{
+	fill_gc = XCreateGC(dpy, win, 0, NULL);
+	return 1;
+}
+
+static void xft_shutdown()
+{
+	XFreeGC(dpy, fill_gc);
+}
+
+static Surface *xft_create(int width, int height)
+{
+	int screen = DefaultScreen(dpy);
+	Surface *surface = calloc(1, sizeof(Surface));
+	if (!surface)
+		return NULL;
+	surface->width = width;
+	surface->height = height;
+	surface->pixmap = XCreatePixmap(dpy, win, width, height, DefaultDepth(dpy, screen));
+	surface->draw = XftDrawCreate(dpy, surface->pixmap, DefaultVisual(dpy, screen), colormap);
+	if (!surface->draw)
+	{
+		XFreePixmap(dpy, surface->pixmap);
+		free(surface);
+		return NULL;
+	}
+	return surface;
+}
+
+static void xft_destroy(Surface *surface)
+{
+	XftDrawDestroy(surface->draw);
+	XFreePixmap(dpy, surface->pixmap);
+	free(surface);
+}
+
+static void xft_fill(int x, int y, int w, int h, const XftColor *color)
+{
+	XSetForeground(dpy, fill_gc, color->pixel);
+	XFillRectangle(dpy, target->pixmap, fill_gc, x, y, w, h);
+}
+
+static void xft_glyphs(const XftGlyphFontSpec *specs, int n, const XftColor *color)
+{
+	XftDrawGlyphFontSpec(target->draw, color, specs, n);
+}
+
+static void xft_copy_rows(int src_y, int dst_y, int h)
+{
+	XCopyArea(dpy, target->pixmap, target->pixmap, gc, 0, src_y, target->width, h, 0, dst_y);
+}
+
+static void xft_present(int x, int y, int w, int h)
+{
+	XCopyArea(dpy, target->pixmap, win, gc, x, y, w, h, x, y);
+}
+
+static const RenderBackend xft_backend = {
+	"xft", xft_init, xft_shutdown, xft_create, xft_destroy, xft_fill, xft_glyphs, xft_copy_rows, xft_present};
+
+// Shared-memory software backend. Glyph coverage bitmaps come from
+// FreeType through Xft's faces and are kept in an atlas keyed by font and
+// glyph index; printable ASCII is rendered up front.
+typedef struct
+{
+	XftFont *font; // NULL for an empty slot
+	FT_UInt index;
+	short left, top; // Bitmap origin relative to the pen position
+	short width, height;
+	size_t offset; // Start of the coverage bytes in atlas.pixels
+} AtlasGlyph;
+
+static struct
+{
+	AtlasGlyph *slots; // Open-addressed hash table
+	int nslots;
+	int used;
+	unsigned char *pixels;
+	size_t size;
+	size_t cap;
+} atlas;
+
+static int shm_failed;
+
+static int shm_error_handler(Display *d, XErrorEvent *e)
+{
+	(void)d;
+	(void)e;
+	shm_failed = 1;
+	return 0;
+}
+
+static unsigned atlas_hash(XftFont *f, FT_UInt index)
+{
+	unsigned long h = (unsigned long)(uintptr_t)f * 2654435761u ^ index * 40503u;
+	return (unsigned)(h ^ (h >> 15));
+}
+
+static AtlasGlyph *atlas_slot(XftFont *f, FT_UInt index)
+{
+	unsigned i = atlas_hash(f, index) & (atlas.nslots - 1);
+	while (atlas.slots[i].font && (atlas.slots[i].font != f || atlas.slots[i].index != index))
+		i = (i + 1) & (atlas.nslots - 1);
+	return &atlas.slots[i];
+}
+
+static int atlas_grow()
+{
+	int nslots = atlas.nslots ? atlas.nslots * 2 : 1024;
+	AtlasGlyph *old = atlas.slots;
+	int old_n = atlas.nslots;
+	atlas.slots = calloc(nslots, sizeof(AtlasGlyph));
+	if (!atlas.slots)
+	{
+		atlas.slots = old;
+		return 0;
+	}
+	atlas.nslots = nslots;
+	for (int i = 0; i < old_n; i++)
+		if (old[i].font)
+			*atlas_slot(old[i].font, old[i].index) = old[i];
+	free(old);
+	return 1;
+}
+
+static unsigned char *atlas_alloc(size_t n, size_t *offset)
+{
+	if (atlas.size + n > atlas.cap)
+	{
+		size_t cap = atlas.cap ? atlas.cap : 65536;
+		while (cap < atlas.size + n)
+			cap *= 2;
+		unsigned char *grown = realloc(atlas.pixels, cap);
+		if (!grown)
+			return NULL;
+		atlas.pixels = grown;
+		atlas.cap = cap;
+	}
+	*offset = atlas.size;
+	atlas.size += n;
+	return atlas.pixels + *offset;
+}
+
+// Copies a rendered FreeType bitmap into the atlas as 8-bit coverage.
+// Colour bitmaps (emoji) keep only their alpha and are scaled down to the
+// line height, nearest neighbour.
+static void atlas_store(AtlasGlyph *g, FT_GlyphSlot slot)
+{
+	FT_Bitmap *bm = &slot->bitmap;
+	int w = bm->width, h = bm->rows;
+	int step = 1;
+	if (bm->pixel_mode == FT_PIXEL_MODE_BGRA && h > font->ascent + font->descent)
+		step = (h + font->ascent + font->descent - 1) / (font->ascent + font->descent);
+	int out_w = w / step, out_h = h / step;
+
+	g->left = slot->bitmap_left / step;
+	g->top = bm->pixel_mode == FT_PIXEL_MODE_BGRA ? font->ascent : slot->bitmap_top;
+	g->width = 0;
+	g->height = 0;
+	if (out_w <= 0 || out_h <= 0)
+		return;
+
+	unsigned char *dst = atlas_alloc((size_t)out_w * out_h, &g->offset);
+	if (!dst)
+		return;
+	for (int y = 0; y < out_h; y++)
+	{
+		const unsigned char *row = bm->buffer + (long)(y * step) * bm->pitch;
+		for (int x = 0; x < out_w; x++)
+		{
+			int sx = x * step;
+			unsigned char a;
+			if (bm->pixel_mode == FT_PIXEL_MODE_MONO)
+				a = (row[sx >> 3] & (0x80 >> (sx & 7))) ? 255 : 0;
+			else if (bm->pixel_mode == FT_PIXEL_MODE_BGRA)
+				a = row[sx * 4 + 3];
+			else
+				a = row[sx];
+			dst[y * out_w + x] = a;
+		}
+	}
+	g->width = out_w;
+	g->height = out_h;
+}
+
+static AtlasGlyph *atlas_get(XftFont *f, FT_UInt index)
+{
+	static AtlasGlyph empty;
+	if ((atlas.used + 1) * 4 > atlas.nslots * 3 && !atlas_grow())
+		return &empty;
+	AtlasGlyph *g = atlas_slot(f, index);
+	if (g->font)
+		return g;
+
+	g->font = f;
+	g->index = index;
+	atlas.used++;
+	FT_Face face = XftLockFace(f);
+	if (!face)
+		return g;
+	FT_Int32 flags = FT_LOAD_RENDER;
+	if (FT_HAS_COLOR(face))
+		flags |= FT_LOAD_COLOR;
+	if (FT_Load_Glyph(face, index, flags) == 0)
+		atlas_store(g, face->glyph);
+	XftUnlockFace(f);
+	return g;
+}
+
+static void shm_destroy(Surface *surface)
+{
+	XShmDetach(dpy, &surface->shm);
+	XDestroyImage(surface->image);
+	shmdt(surface->shm.shmaddr);
+	free(surface);
+}
+
+static Surface *shm_create(int width, int height)
+{
+	int screen = DefaultScreen(dpy);
+	Surface *surface = calloc(1, sizeof(Surface));
+	if (!surface)
+		return NULL;
+	surface->width = width;
+	surface->height = height;
+	XShmSegmentInfo *info = &surface->shm;
+	XImage *image = XShmCreateImage(dpy, DefaultVisual(dpy, screen), DefaultDepth(dpy, screen), ZPixmap,
+									NULL, info, width, height);
+	if (!image)
+	{
+		free(surface);
+		return NULL;
+	}
+	info->shmid = shmget(IPC_PRIVATE, (size_t)image->bytes_per_line * height, IPC_CREAT | 0600);
+	if (info->shmid < 0)
+	{
+		XDestroyImage(image);
+		free(surface);
+		return NULL;
+	}
+	info->shmaddr = shmat(info->shmid, NULL, 0);
+	info->readOnly = False;
+
+	// Attaching fails with an X error on a display that is not local
+	shm_failed = info->shmaddr == (char *)-1;
+	if (!shm_failed)
+	{
+		XErrorHandler old_handler = XSetErrorHandler(shm_error_handler);
+		XShmAttach(dpy, info);
+		XSync(dpy, False);
+		XSetErrorHandler(old_handler);
+	}
+	shmctl(info->shmid, IPC_RMID, NULL);
+	if (shm_failed)
+	{
+		if (info->shmaddr != (char *)-1)
+			shmdt(info->shmaddr);
+		XDestroyImage(image);
+		free(surface);
+		return NULL;
+	}
+	image->data = info->shmaddr;
+	surface->image = image;
+	return surface;
+}
+
+static int shm_init()
+{
+	// Pixels are written directly as 32-bit xRGB
+	Visual *visual = DefaultVisual(dpy, DefaultScreen(dpy));
+	if (!XShmQueryExtension(dpy) || visual->red_mask != 0xFF0000 || visual->green_mask != 0xFF00 ||
+		visual->blue_mask != 0xFF)
+		return 0;
+	Surface *probe = shm_create(1, 1);
+	if (!probe)
+		return 0;
+	int ok = probe->image->bits_per_pixel == 32;
+	shm_destroy(probe);
+	if (!ok)
+		return 0;
+
+	for (unsigned c = ' '; c < 0x7F; c++)
+	{
+		CachedGlyph *g = lookup_glyph(c);
+		atlas_get(g->font, g->index);
+	}
+	return 1;
+}
+
+static void shm_shutdown()
+{
+}
+
+// Clips a rectangle to the image; returns 0 if nothing is left
+static int shm_clip(int *x, int *y, int *w, int *h)
+{
+	if (*x < 0)
+		*w += *x, *x = 0;
+	if (*y < 0)
+		*h += *y, *y = 0;
+	if (*x + *w > target->width)
+		*w = target->width - *x;
+	if (*y + *h > target->height)
+		*h = target->height - *y;
+	return *w > 0 && *h > 0;
+}
+
+static uint32_t *shm_row(int y)
+{
+	return (uint32_t *)(target->image->data + (long)y * target->image->bytes_per_line);
+}
+
+static void shm_fill(int x, int y, int w, int h, const XftColor *color)
+{
+	if (!shm_clip(&x, &y, &w, &h))
+		return;
+	uint32_t pixel = color->pixel;
+	for (int r = 0; r < h; r++)
+	{
+		uint32_t *p = shm_row(y + r) + x;
+		for (int i = 0; i < w; i++)
+			p[i] = pixel;
+	}
+}
+
+static uint32_t blend(uint32_t dst, uint32_t src, unsigned a)
+{
+	uint32_t out = 0;
+	for (int shift = 0; shift < 24; shift += 8)
+	{
+		int d = (dst >> shift) & 0xFF, s = (src >> shift) & 0xFF;
+		unsigned v = (unsigned)(d * 255 + (s - d) * (int)a);
+		out |= ((v + 1 + (v >> 8)) >> 8) << shift;
+	}
+	return out;
+}
+
+static void shm_glyphs(const XftGlyphFontSpec *specs, int n, const XftColor *color)
+{
+	uint32_t pixel = color->pixel;
+	for (int k = 0; k < n; k++)
+	{
+		AtlasGlyph *g = atlas_get(specs[k].font, specs[k].glyph);
+		int x0 = specs[k].x + g->left, y0 = specs[k].y - g->top;
+		int x = x0, y = y0, w = g->width, h = g->height;
+		if (!w || !shm_clip(&x, &y, &w, &h))
+			continue;
+		const unsigned char *cov = atlas.pixels + g->offset + (y - y0) * g->width + (x - x0);
+		for (int r = 0; r < h; r++, cov += g->width)
+		{
+			uint32_t *p = shm_row(y + r) + x;
+			for (int i = 0; i < w; i++)
+			{
+				if (cov[i] == 255)
+					p[i] = pixel;
+				else if (cov[i])
+					p[i] = blend(p[i], pixel, cov[i]);
+			}
+		}
+	}
+}
+
+static void shm_copy_rows(int src_y, int dst_y, int h)
+{
+	memmove(shm_row(dst_y), shm_row(src_y), (size_t)h * target->image->bytes_per_line);
+}
+
+// The server reads the segment after the request is queued, so wait for
+// it before painting into the image again.
+static void shm_present(int x, int y, int w, int h)
+{
+	XShmPutImage(dpy, win, gc, target->image, x, y, x, y, w, h, False);
+	XSync(dpy, False);
+}
+
+static const RenderBackend shm_backend = {
+	"shm", shm_init, shm_shutdown, shm_create, shm_destroy, shm_fill, shm_glyphs, shm_copy_rows, shm_present};
+
+static const RenderBackend *renderer = &xft_backend;
+
+// Starts the named backend, falling back to xft
+static void init_renderer(const char *name)
+{
+	renderer = name && strcmp(name, "shm") == 0 ? &shm_backend : &xft_backend;
+	if (name && *name && strcmp(name, renderer->name) != 0)
+		fprintf(stderr, "MyTerm: unknown renderer '%s', using xft\n", name);
+	if (!renderer->init())
+	{
+		fprintf(stderr, "MyTerm: %s renderer unavailable on this display, using xft\n", renderer->name);
+		renderer = &xft_backend;
+		if (!renderer->init())
+		{
+			fprintf(stderr, "Cannot create the back buffer\n");
+			exit(1);
+		}
+	}
+}
+
+// Font, colours, the window GC and the backend chosen by MYTERM_RENDERER
+static void setup_drawing()
+{
+	int screen = DefaultScreen(dpy);
+	const char *font_name = getenv("MYTERM_FONT");
+	font = XftFontOpenName(dpy, screen, font_name && *font_name ? font_name : FONT_NAME);
+	if (!font)
+	{
+		fprintf(stderr, "Cannot load font\n");
+		exit(1);
+	}
+	load_font_metrics();
+
+	gc = XCreateGC(dpy, win, 0, NULL);
+	XSetForeground(dpy, gc, WhitePixel(dpy, screen));
+	XSetBackground(dpy, gc, BlackPixel(dpy, screen));
+	// Copies come from off-screen, which never has obscured regions
+	XSetGraphicsExposures(dpy, gc, False);
+
+	colormap = DefaultColormap(dpy, screen);
+	XftColorAllocName(dpy, DefaultVisual(dpy, screen), colormap, "green", &green_color);
+	XftColorAllocName(dpy, DefaultVisual(dpy, screen), colormap, "white", &white_color);
+	XftColorAllocName(dpy, DefaultVisual(dpy, screen), colormap, "black", &black_color);
+	XftColorAllocName(dpy, DefaultVisual(dpy, screen), colormap, "goldenrod4", &match_color);
+	XftColorAllocName(dpy, DefaultVisual(dpy, screen), colormap, "DarkOrange3", &current_match_color);
+
+	init_renderer(getenv("MYTERM_RENDERER"));
+}
+
+/* -------------------- Damage Tracking -------------------- */
+// Screen layout, top to bottom: tab bar, scroll indicator, output rows and
+// the prompt. Each band is repainted on its own.
+#define INDICATOR_TOP LINE_H
+#define ROWS_TOP (LINE_H * 2)
+#define PROMPT_TOP (win_height - LINE_H * 2 + font->descent)
+#define MAX_ROWS 256
+
+#define DAMAGE_TABS (1 << 0)
+#define DAMAGE_INDICATOR (1 << 1)
+#define DAMAGE_ROWS (1 << 2)
+#define DAMAGE_PROMPT (1 << 3)
+#define DAMAGE_ALL (DAMAGE_TABS | DAMAGE_INDICATOR | DAMAGE_ROWS | DAMAGE_PROMPT)
+
+// What is painted on a tab's surface. redraw() compares the tab state
+// against it and repaints only the bands and rows that differ. Every tab
+// keeps its own, so a tab switch only presents a different surface.
+typedef struct Frame
+{
+	Surface *surface;
+	unsigned damage; // Bands forced dirty regardless of the comparison
+	unsigned tab_generation;
+	long long end_seq; // Scrollback end when last painted
+	char indicator[64];
+	long long row_seq[MAX_ROWS]; // Scrollback line on each row, -1 if blank
+	int row_seg[MAX_ROWS];		 // Which wrapped row of that line, -1 for a collapsed command
+	int prompt_search; // Which prompt: input, history search or scrollback search
+	int prompt_pos;
+	int prompt_choice; // History search candidate shown
+	unsigned find_generation;
+	char *prompt; // Input line as painted, grown like the tab's own buffer
+	int prompt_cap;
+} Frame;
+
+static Frame *frame;	 // Frame of the tab being painted
+static Frame *on_screen; // Frame last presented to the window
+
+typedef struct
+{
+	long frames;
+	long draw_calls;
+	int last_frame_calls;
+	int max_frame_calls;
+	long switches; // Tab switches, timed from the key to the presented frame
+	double switch_total;
+	double switch_last;
+	double switch_max;
+} DrawStats;
+
+static DrawStats draw_stats;
+static int frame_calls;
+
+// Colour that text and filled rectangles are drawn in
+static XftColor *pen = &white_color;
+static int present_top = HEIGHT, present_bottom = 0;
+
+// Text of one output row; text is NULL for a blank row
+typedef struct
+{
+	const char *text;
+	int len;
+	const char *line; // The whole line the row belongs to
+	int line_len;
+	long long seq; // -1 for the row of a collapsed command
+} RowSpan;
+
+static Finder *highlight; // Search whose matches are highlighted, or NULL
+
+// Copies of the cold lines on screen. A cold line is only valid until a few
+// other segments have been unpacked, and laying out a screen of collapsed
+// commands can pass through more than that before the rows are painted.
+static Arena row_copies = {NULL, 65536, 0};
+
+static int visible_rows()
+{
+	int rows = (PROMPT_TOP - ROWS_TOP) / LINE_H;
+	if (rows < 1)
+		return 1;
+	return rows < MAX_ROWS ? rows : MAX_ROWS;
+}
+
+static void damage_all()
+{
+	if (tabs[current_tab]->frame)
+		tabs[current_tab]->frame->damage = DAMAGE_ALL;
+}
+
+static void free_tab_frame(Tab *tab)
+{
+	if (!tab->frame)
+		return;
+	if (tab->frame->surface)
+		renderer->destroy(tab->frame->surface);
+	if (on_screen == tab->frame)
+		on_screen = NULL;
+	free(tab->frame->prompt);
+	free(tab->frame);
+	tab->frame = NULL;
+}
+
+static void mark_changed(int y, int h)
+{
+	if (y < present_top)
+		present_top = y < 0 ? 0 : y;
+	if (y + h > present_bottom)
+		present_bottom = y + h > win_height ? win_height : y + h;
+}
+
+// Glyphs are queued with their positions and sent in one request, which
+// may mix glyphs from the primary and fallback fonts.
+#define GLYPH_QUEUE 4096
+
+static XftGlyphFontSpec glyph_queue[GLYPH_QUEUE];
+static int glyph_count;
+
+static void flush_glyphs()
+{
+	if (glyph_count > 0)
+	{
+		renderer->glyphs(glyph_queue, glyph_count, pen);
+		frame_calls++;
+		glyph_count = 0;
+	}
+}
+
+// Queues the glyphs of s at baseline y, clipped to the window width
+static void queue_text(int x, int y, const char *s, int len)
+{
+	for (int i = 0; i < len && x < win_width;)
+	{
+		int size;
+		CachedGlyph *g = lookup_glyph(utf8_decode(s + i, len - i, &size));
+		i += size;
+		if (glyph_count == GLYPH_QUEUE)
+			flush_glyphs();
+		glyph_queue[glyph_count++] = (XftGlyphFontSpec){g->font, g->index, x, y};
+		x += g->advance;
+	}
+}
+
+// Every X drawing request goes through these so frames can be measured
+static void draw_string(int x, int y, const char *s, int len)
+{
+	queue_text(x, y, s, len);
+	flush_glyphs();
+	mark_changed(y - font->ascent, font->ascent + font->descent);
+}
+
+static void fill_rect(int x, int y, int w, int h)
+{
+	renderer->fill(x, y, w, h, pen);
+	mark_changed(y, h);
+	frame_calls++;
+}
+
+static void clear_rect(int y, int h)
+{
+	renderer->fill(0, y, win_width, h, &black_color);
+	mark_changed(y, h);
+	frame_calls++;
+}
+
+// Copies everything painted since the last call to the window
+static void present()
+{
+	if (present_bottom > present_top)
+	{
+		renderer->present(0, present_top, win_width, present_bottom - present_top);
+		frame_calls++;
+	}
+	present_top = win_height;
+	present_bottom = 0;
+}
+
+// Surfaces are replaced at the new size when their tab is next painted;
+// lines rewrap lazily as they come into view.
+static void resize_window(int width, int height)
+{
+	win_width = width;
+	win_height = height;
+}
+
+// Presents part of the window again from the current tab's surface
+static void present_area(int x, int y, int w, int h)
+{
+	Frame *f = tabs[current_tab]->frame;
+	if (!f || f != on_screen)
+		return;
+	target = f->surface;
+	renderer->present(x, y, w, h);
+}
+
+/* -------------------- Scrollback Search -------------------- */
+// Searches run in slices of at most FIND_SLICE_MS between events, so a long
+// scrollback is searched over several frames instead of stalling typing.
+#define FIND_SLICE_MS 4
+
+// Offset of the first occurrence of needle in hay, or -1
+static int find_text(const char *hay, int n, const char *needle, int m)
+{
+	if (m == 0)
+		return -1;
+	const char *at = memmem(hay, n, needle, m);
+	return at ? (int)(at - hay) : -1;
+}
+
+// Offset of the last occurrence starting before `limit`, or -1
+static int find_text_before(const char *hay, int n, const char *needle, int m, int limit)
+{
+	int found = -1;
+	for (int from = 0, at; from < limit && (at = find_text(hay + from, n - from, needle, m)) >= 0;)
+	{
+		if (from + at >= limit)
+			break;
+		found = from + at;
+		from = found + 1;
+	}
+	return found;
+}
+
+// Index of the first of n lines, from `from` on, that contains the needle,
+// or -1. The lines' text must lie in order in one buffer, as in a cold
+// run: it is searched with one memmem() and a match that straddles two
+// lines is skipped.
+static int find_in_run(const Line *run, int n, int from, const char *needle, int m)
+{
+	if (from >= n || m == 0)
+		return -1;
+	const char *p = run[from].text, *end = run[n - 1].text + run[n - 1].len;
+	int j = from;
+	while (p < end && (p = memmem(p, end - p, needle, m)) != NULL)
+	{
+		while (run[j].text + run[j].len < p + m)
+			j++;
+		if (p >= run[j].text)
+			return j;
+		p++;
+	}
+	return -1;
+}
+
+// Index of the first hit at or after `seq`
+static int find_hit_index(const Finder *f, long long seq)
+{
+	int lo = 0, hi = f->nhits;
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		if (f->hits[mid] < seq)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static int find_add_hit(Finder *f, long long seq)
+{
+	if (f->nhits == f->hits_cap)
+	{
+		int new_cap = f->hits_cap ? f->hits_cap * 2 : 256;
+		long long *grown = realloc(f->hits, new_cap * sizeof(long long));
+		if (!grown)
+			return 0;
+		f->hits = grown;
+		f->hits_cap = new_cap;
+	}
+	f->hits[f->nhits++] = seq;
+	return 1;
+}
+
+// Work left for find_refresh()
+static int find_busy(const Tab *tab)
+{
+	const Finder *f = &tab->find;
+	const Scrollback *sb = &tab->lines;
+	if (!tab->in_find_mode || f->len == 0)
+		return 0;
+	return f->scanned_len != f->len || memcmp(f->scanned, f->term, f->len) != 0 ||
+		   f->cand_next < f->ncands || f->scanned_end < sb->first_seq + sb->count;
+}
+
+// Brings the hits up to date with the query and the scrollback, for at
+// most `budget` seconds. When the query contains the previous one only the
+// lines that matched it are checked again, and otherwise only lines added
+// since are scanned. Lines are visited in storage order, so each cold
+// segment is unpacked once. Returns 1 once the hits are complete.
+static int find_refresh(Tab *tab, double budget)
+{
+	Finder *f = &tab->find;
+	Scrollback *sb = &tab->lines;
+	long long end = sb->first_seq + sb->count;
+	int same = f->scanned_len == f->len && (f->len == 0 || memcmp(f->scanned, f->term, f->len) == 0);
+	if (same && f->scanned_end == end && f->cand_next == f->ncands &&
+		(f->nhits == 0 || f->hits[0] >= sb->first_seq))
+		return 1;
+	int old_hits = f->nhits;
+
+	// Drop lines that have left the scrollback
+	int gone = find_hit_index(f, sb->first_seq);
+	if (gone > 0)
+	{
+		memmove(f->hits, f->hits + gone, (f->nhits - gone) * sizeof(long long));
+		f->nhits -= gone;
+		for (int i = f->nhits; i < f->nhits + gone; i++)
+			f->hits[i] = -1;
+	}
+	if (f->cur_seq < sb->first_seq)
+		f->cur_seq = -1;
+
+	if (!same)
+	{
+		// A longer query only matches lines the old one did: its hits, and
+		// the candidates not checked yet if it was still narrowing
+		if (f->scanned_len > 0 && find_text(f->term, f->len, f->scanned, f->scanned_len) >= 0)
+		{
+			if (f->cand_next == f->ncands)
+				f->ncands = f->nhits;
+		}
+		else
+		{
+			f->ncands = 0;
+			f->scanned_end = sb->first_seq;
+		}
+		f->nhits = 0;
+		f->cand_next = 0;
+		f->scanned_len = 0;
+		if (reserve_text(&f->scanned, &f->scanned_cap, f->len))
+		{
+			memcpy(f->scanned, f->term, f->len);
+			f->scanned_len = f->len;
+		}
+	}
+
+	double deadline = now_seconds() + budget;
+	while (f->cand_next < f->ncands)
+	{
+		long long seq = f->hits[f->cand_next];
+		if (seq < sb->first_seq)
+		{
+			f->hits[f->cand_next++] = -1;
+			continue;
+		}
+		// Every candidate in the segment of this one. When they are a good
+		// part of it, one pass over the whole run beats one per line.
+		int n, first = f->cand_next;
+		Line *run = scrollback_run(sb, (int)(seq - sb->first_seq), &n);
+		while (f->cand_next < f->ncands && f->hits[f->cand_next] < seq + n)
+			f->cand_next++;
+		if ((f->cand_next - first) * 8 >= n)
+		{
+			// A line that matches now matched before, so every match
+			// among the lines scanned so far is one of the candidates
+			int k = -1;
+			while ((k = find_in_run(run, n, k + 1, f->term, f->len)) >= 0 && seq + k < f->scanned_end &&
+				   f->nhits < f->cand_next)
+				f->hits[f->nhits++] = seq + k;
+		}
+		else
+		{
+			for (int i = first; i < f->cand_next; i++)
+			{
+				long long c = f->hits[i];
+				if (c >= seq && find_text(run[c - seq].text, run[c - seq].len, f->term, f->len) >= 0)
+					f->hits[f->nhits++] = c;
+			}
+		}
+		for (int i = f->nhits > first ? f->nhits : first; i < f->cand_next; i++)
+			f->hits[i] = -1;
+		if (now_seconds() >= deadline)
+			break;
+	}
+
+	if (f->scanned_end < sb->first_seq)
+		f->scanned_end = sb->first_seq;
+	if (f->cand_next == f->ncands)
+	{
+		f->cand_next = f->ncands = 0;
+		// A cold segment at a time
+		while (f->len > 0 && f->scanned_end < end)
+		{
+			int n;
+			Line *run = scrollback_run(sb, (int)(f->scanned_end - sb->first_seq), &n);
+			int k = -1;
+			while ((k = find_in_run(run, n, k + 1, f->term, f->len)) >= 0)
+				if (!find_add_hit(f, f->scanned_end + k))
+					break;
+			if (k >= 0)
+				break;
+			f->scanned_end += n;
+			if (now_seconds() >= deadline)
+				break;
+		}
+		if (f->len == 0)
+			f->scanned_end = end;
+	}
+	if (!same || f->nhits != old_hits)
+		f->generation++;
+	return f->cand_next == f->ncands && f->scanned_end == end;
+}
+
+// Scrolls so the current match sits in the middle of the view
+static void find_show(Tab *tab)
+{
+	Finder *f = &tab->find;
+	Scrollback *sb = &tab->lines;
+	if (f->cur_seq < 0)
+		return;
+	// A match inside collapsed output expands it
+	CommandRecord *fold = fold_at(tab, f->cur_seq);
+	if (fold)
+		fold_set(tab, fold, 0);
+	Line *ln = line_at(sb, f->cur_seq);
+	int rows = line_rows(sb, ln), row = 0;
+	while (row + 1 < rows && ln->breaks[row] <= f->cur_off)
+		row++;
+	RowPos pos = {f->cur_seq, row};
+	move_rows(tab, &pos, -(visible_rows() / 2));
+	tab->view = pos;
+	tab->scrolled = 1;
+}
+
+// Makes the newest match at or above where the search started current
+static void find_select(Tab *tab)
+{
+	Finder *f = &tab->find;
+	f->cur_seq = -1;
+	f->select_pending = 0;
+	if (f->nhits > 0)
+	{
+		int i = find_hit_index(f, f->origin + 1) - 1;
+		f->cur_seq = f->hits[i < 0 ? 0 : i];
+		Line *ln = line_at(&tab->lines, f->cur_seq);
+		f->cur_off = find_text_before(ln->text, ln->len, f->term, f->len, ln->len);
+		find_show(tab);
+	}
+	f->generation++;
+}
+
+// Moves to the next older (dir < 0) or newer match, wrapping around
+static void find_step(Tab *tab, int dir)
+{
+	Finder *f = &tab->find;
+	find_refresh(tab, FIND_SLICE_MS / 1000.0);
+	if (f->nhits == 0)
+		return;
+	if (f->cur_seq < 0)
+	{
+		find_select(tab);
+		return;
+	}
+
+	Line *ln = line_at(&tab->lines, f->cur_seq);
+	int off;
+	if (dir < 0)
+	{
+		off = find_text_before(ln->text, ln->len, f->term, f->len, f->cur_off);
+	}
+	else
+	{
+		off = find_text(ln->text + f->cur_off + 1, ln->len - f->cur_off - 1, f->term, f->len);
+		if (off >= 0)
+			off += f->cur_off + 1;
+	}
+
+	if (off < 0)
+	{
+		// On to the next line with a match
+		int i = find_hit_index(f, f->cur_seq);
+		if (dir < 0)
+			i = i > 0 ? i - 1 : f->nhits - 1;
+		else
+		{
+			if (i < f->nhits && f->hits[i] == f->cur_seq)
+				i++;
+			if (i == f->nhits)
+				i = 0;
+		}
+		f->cur_seq = f->hits[i];
+		ln = line_at(&tab->lines, f->cur_seq);
+		off = dir < 0 ? find_text_before(ln->text, ln->len, f->term, f->len, ln->len)
+					  : find_text(ln->text, ln->len, f->term, f->len);
+	}
+	f->cur_off = off;
+	f->generation++;
+	find_show(tab);
+}
+
+static void find_start(Tab *tab)
+{
+	Finder *f = &tab->find;
+	Scrollback *sb = &tab->lines;
+	tab->in_find_mode = 1;
+	tab->in_search_mode = 0;
+	f->len = 0;
+	f->cur_seq = -1;
+	// Search upwards from the top of a scrolled view, else from the bottom
+	f->origin = tab->scrolled ? tab->view.seq : sb->first_seq + sb->count - 1;
+	f->generation++;
+}
+
+static void find_end(Tab *tab)
+{
+	tab->in_find_mode = 0;
+	tab->find.generation++;
+}
+
+// The query changed. A search that does not finish in one slice is
+// carried on by find_continue() and picks its match when done.
+static void find_update(Tab *tab)
+{
+	Finder *f = &tab->find;
+	f->cur_seq = -1;
+	f->generation++;
+	if (find_refresh(tab, FIND_SLICE_MS / 1000.0))
+		find_select(tab);
+	else
+		f->select_pending = 1;
+}
+
+// One more slice of an unfinished search, from the main loop
+static void find_continue(Tab *tab)
+{
+	if (find_refresh(tab, FIND_SLICE_MS / 1000.0) && tab->find.select_pending)
+		find_select(tab);
+}
+
+// "3/120 lines" style status for the search prompt
+static void find_status(Tab *tab, char *out, size_t size)
+{
+	Finder *f = &tab->find;
+	if (f->len == 0)
+		snprintf(out, size, "(Up/Down for older/newer matches, Esc to leave)");
+	else if (find_busy(tab))
+		snprintf(out, size, "(searching, %d lines so far)", f->nhits);
+	else if (f->nhits == 0)
+		snprintf(out, size, "(no matches)");
+	else if (f->cur_seq < 0)
+		snprintf(out, size, "(%d lines)", f->nhits);
+	else
+		snprintf(out, size, "(%d/%d lines)", find_hit_index(f, f->cur_seq) + 1, f->nhits);
+}
+
+/* -------------------- Painting -------------------- */
+// Tab bar as seen from tab `active`, which is highlighted
+static void paint_tabs(int active)
+{
+	clear_rect(0, LINE_H);
+	int tab_width = win_width / tab_count;
+	for (int i = 0; i < tab_count; i++)
+	{
+		int x = i * tab_width;
+		if (i == active)
+		{
+			// Highlight current tab
+			pen = &black_color;
+			fill_rect(x, 0, tab_width, LINE_H);
+			pen = &white_color;
+		}
+		draw_string(x + 4, LINE_H - 4, tabs[i]->tab_name, strlen(tabs[i]->tab_name));
+
+		// Outline
+		fill_rect(x, 0, tab_width, 1);
+		fill_rect(x, LINE_H - 1, tab_width, 1);
+		fill_rect(x, 0, 1, LINE_H);
+		fill_rect(x + tab_width - 1, 0, 1, LINE_H);
+	}
+}
+
+static void paint_indicator(const char *text)
+{
+	clear_rect(INDICATOR_TOP, LINE_H);
+	if (text[0])
+		draw_string(4, INDICATOR_TOP + LINE_H - font->descent, text, strlen(text));
+}
+
+// Backgrounds of the search matches on one row, including matches that
+// start or end on a neighbouring wrapped row
+static void paint_matches(int row, const RowSpan *span)
+{
+	const Finder *f = highlight;
+	int start = span->text - span->line, end = start + span->len;
+	int pos = start - f->len + 1 > 0 ? start - f->len + 1 : 0;
+	int limit = end + f->len - 1 < span->line_len ? end + f->len - 1 : span->line_len;
+	int at;
+	while (pos < limit && (at = find_text(span->line + pos, limit - pos, f->term, f->len)) >= 0)
+	{
+		int o = pos + at;
+		int a = o > start ? o : start;
+		int b = o + f->len < end ? o + f->len : end;
+		int x0 = 4 + text_width(span->text, a - start);
+		int x1 = 4 + text_width(span->text, b - start);
+		int current = span->seq == f->cur_seq && o == f->cur_off;
+		renderer->fill(x0, ROWS_TOP + row * LINE_H, x1 - x0, LINE_H, current ? &current_match_color : &match_color);
+		frame_calls++;
+		pos = o + 1;
+	}
+}
+
+// Paints a run of adjacent rows: one fill clears them and the glyphs of
+// every row go out in a single request.
+static void paint_rows(int first, int n, const RowSpan *rows)
+{
+	renderer->fill(0, ROWS_TOP + first * LINE_H, win_width, n * LINE_H, &black_color);
+	frame_calls++;
+	for (int k = 0; highlight && k < n; k++)
+	{
+		if (rows[k].text && rows[k].seq >= 0)
+			paint_matches(first + k, &rows[k]);
+	}
+	for (int k = 0; k < n; k++)
+	{
+		if (rows[k].text)
+		{
+			int baseline = ROWS_TOP + (first + k + 1) * LINE_H - font->descent;
+			queue_text(4, baseline, rows[k].text, rows[k].len);
+		}
+	}
+	flush_glyphs();
+	mark_changed(ROWS_TOP + first * LINE_H, n * LINE_H);
+}
+
+static void paint_prompt(Tab *tab)
+{
+	clear_rect(PROMPT_TOP, win_height - PROMPT_TOP);
+
+	if (tab->in_find_mode)
+	{
+		char status[64];
+		find_status(tab, status, sizeof(status));
+		int label_width = text_width("Find: ", 6);
+		int term_width = text_width(tab->find.term, tab->find.len);
+		draw_string(4, win_height - LINE_H, "Find: ", 6);
+		draw_string(4 + label_width, win_height - LINE_H, tab->find.term, tab->find.len);
+		fill_rect(4 + label_width + term_width, win_height - LINE_H + 2, 8, 2);
+		pen = &green_color;
+		draw_string(4 + label_width + term_width + 16, win_height - LINE_H, status, strlen(status));
+		pen = &white_color;
+	}
+	// History search: the query, then the candidate shown and its place
+	else if (tab->in_search_mode)
+	{
+		HistoryEntry *e = hs_current(tab);
+		const char *label = e || tab->search_pos == 0 ? "(reverse-i-search)`" : "(failed reverse-i-search)`";
+		int x = 4, y = win_height - LINE_H;
+		draw_string(x, y, label, strlen(label));
+		x += text_width(label, strlen(label));
+		draw_string(x, y, tab->search_term, tab->search_pos);
+		x += text_width(tab->search_term, tab->search_pos);
+		fill_rect(x, y + 2, 8, 2);
+		draw_string(x, y, "': ", 3);
+		x += text_width("': ", 3);
+		if (e)
+		{
+			// Only the first line of a multi-line command
+			const char *nl = memchr(e->text, '\n', e->len);
+			int len = nl ? nl - e->text : e->len;
+			int at = hs_locate(tab, e);
+			if (at >= 0 && at + tab->search_pos <= len)
+			{
+				int x0 = x + text_width(e->text, at);
+				int x1 = x + text_width(e->text, at + tab->search_pos);
+				pen = &match_color;
+				fill_rect(x0, y - LINE_H + font->descent, x1 - x0, LINE_H);
+				pen = &white_color;
+			}
+			draw_string(x, y, e->text, len);
+			x += text_width(e->text, len);
+
+			char status[32];
+			snprintf(status, sizeof(status), "  [%d/%d]", tab->hsearch.selected + 1, tab->hsearch.count);
+			pen = &green_color;
+			draw_string(x, y, status, strlen(status));
+			pen = &white_color;
+		}
+	}
+	else
+	{
+		char promptline[BUFSIZE * 2];
+		snprintf(promptline, sizeof(promptline), "%s", PROMPT);
+
+		// Draw prompt in green color
+		pen = &green_color;
+		draw_string(4, win_height - LINE_H, promptline, strlen(promptline));
+		pen = &white_color;
+
+		// Draw multiline input with proper line breaks
+		int prompt_width = text_width(PROMPT, strlen(PROMPT));
+		int current_y = win_height - LINE_H;
+		char *input_ptr = tab->input_buf;
+		int current_pos = 0;
+		int cursor_drawn = 0;
+
+		while (*input_ptr)
+		{
+			char line_buf[BUFSIZE];
+			int line_len = 0;
+
+			while (*input_ptr && *input_ptr != '\n' && line_len < BUFSIZE - 1)
+			{
+				line_buf[line_len++] = *input_ptr++;
+			}
+			line_buf[line_len] = '\0';
+
+			draw_string(4 + prompt_width, current_y, line_buf, line_len);
+
+			if (!cursor_drawn && current_pos + line_len >= tab->in_pos)
+			{
+				int cursor_pos_in_line = tab->in_pos - current_pos;
+				if (cursor_pos_in_line < 0)
+					cursor_pos_in_line = 0;
+				if (cursor_pos_in_line > line_len)
+					cursor_pos_in_line = line_len;
+
+				int cursor_x = 4 + prompt_width + text_width(line_buf, cursor_pos_in_line);
+				fill_rect(cursor_x, current_y + 2, 8, 2);
+				cursor_drawn = 1;
+			}
+
+			current_pos += line_len;
+
+			if (*input_ptr == '\n')
+			{
+				input_ptr++;
+				current_pos++;
+				current_y += LINE_H;
+				prompt_width = 0;
+			}
+		}
+
+		if (!cursor_drawn)
+		{
+			int cursor_x = 4 + prompt_width + text_width(input_ptr, strlen(input_ptr));
+			fill_rect(cursor_x, current_y + 2, 8, 2);
+		}
+	}
+}
+
+// When the view moved by fewer rows than it shows, the rows still on
+// screen are shifted inside the off-screen copy and only the
+// newly exposed rows are left for redraw() to paint.
+static void blit_rows(const long long *seq, const int *seg, int rows)
+{
+	if (frame->row_seq[0] < 0 || seq[0] < 0)
+		return;
+
+	// Find the new top row among the old rows, or the old top among the new
+	int shift = 0;
+	for (int r = 1; r < rows && !shift; r++)
+	{
+		if (frame->row_seq[r] == seq[0] && frame->row_seg[r] == seg[0])
+			shift = r;
+		else if (seq[r] == frame->row_seq[0] && seg[r] == frame->row_seg[0])
+			shift = -r;
+	}
+	if (!shift)
+		return;
+
+	int n = shift > 0 ? shift : -shift;
+	int kept = rows - n;
+	if (shift > 0)
+	{
+		// Content moves up
+		renderer->copy_rows(ROWS_TOP + n * LINE_H, ROWS_TOP, kept * LINE_H);
+		memmove(frame->row_seq, frame->row_seq + n, kept * sizeof(long long));
+		memmove(frame->row_seg, frame->row_seg + n, kept * sizeof(int));
+		for (int r = kept; r < rows; r++)
+			frame->row_seq[r] = -2;
+	}
+	else
+	{
+		// Content moves down
+		renderer->copy_rows(ROWS_TOP, ROWS_TOP + n * LINE_H, kept * LINE_H);
+		memmove(frame->row_seq + n, frame->row_seq, kept * sizeof(long long));
+		memmove(frame->row_seg + n, frame->row_seg, kept * sizeof(int));
+		for (int r = 0; r < n; r++)
+			frame->row_seq[r] = -2;
+	}
+	mark_changed(ROWS_TOP, rows * LINE_H);
+	frame_calls++;
+}
+
+// Brings a tab's surface up to date, repainting whatever differs from
+// what was painted on it last. Returns 0 if it has no surface.
+static int paint_tab(int index)
+{
+	Tab *tab = tabs[index];
+	if (!tab->frame)
+	{
+		tab->frame = calloc(1, sizeof(Frame));
+		if (!tab->frame)
+			return 0;
+	}
+	frame = tab->frame;
+
+	// Surfaces are created on first paint and replaced after a resize
+	Surface *surface = frame->surface;
+	if (surface && (surface->width != win_width || surface->height != win_height))
+	{
+		renderer->destroy(surface);
+		frame->surface = NULL;
+		if (on_screen == frame)
+			on_screen = NULL;
+	}
+	if (!frame->surface)
+	{
+		frame->surface = renderer->create(win_width, win_height);
+		if (!frame->surface)
+			return 0;
+		frame->damage = DAMAGE_ALL;
+	}
+	target = frame->surface;
+
+	if (frame->tab_generation != tab_generation)
+	{
+		frame->damage |= DAMAGE_TABS;
+		frame->tab_generation = tab_generation;
+	}
+	if (frame->find_generation != tab->find.generation)
+	{
+		frame->damage |= DAMAGE_ROWS | DAMAGE_PROMPT;
+		frame->find_generation = tab->find.generation;
+	}
+	if (frame->damage & DAMAGE_ROWS)
+	{
+		for (int r = 0; r < MAX_ROWS; r++)
+			frame->row_seq[r] = -2;
+	}
+
+	if (frame->damage & DAMAGE_TABS)
+		paint_tabs(index);
+
+	// Lay out the visible rows, in wrapped rows from the top of the view
+	int visible_lines = visible_rows();
+	Scrollback *sb = &tab->lines;
+	RowPos top = view_top(tab, visible_lines);
+	long long seq[MAX_ROWS];
+	int seg[MAX_ROWS];
+	RowSpan span[MAX_ROWS];
+	char fold_text[MAX_ROWS][96];
+	int filled = 0;
+	RowPos row = top;
+	arena_reset(&row_copies);
+	char *copy = NULL;
+	long long copy_seq = -1;
+	while (sb->count > 0 && filled < visible_lines)
+	{
+		CommandRecord *fold = fold_at(tab, row.seq);
+		if (fold)
+		{
+			span[filled].text = fold_text[filled];
+			span[filled].len = fold_summary(tab, fold, fold_text[filled], sizeof(fold_text[0]));
+			span[filled].line = span[filled].text;
+			span[filled].line_len = span[filled].len;
+			span[filled].seq = -1;
+			seg[filled] = -1;
+		}
+		else
+		{
+			Line *ln = line_at(sb, row.seq);
+			line_segment(sb, ln, row.row, &span[filled].text, &span[filled].len);
+			span[filled].line = ln->text;
+			span[filled].line_len = ln->len;
+			span[filled].seq = row.seq;
+			seg[filled] = row.row;
+			if (row.seq - sb->first_seq < sb->count - sb->hot)
+			{
+				// Once per line, however many rows it wraps to
+				if (copy_seq != row.seq && (copy = arena_alloc(&row_copies, ln->len + 1)) != NULL)
+				{
+					memcpy(copy, ln->text, ln->len + 1);
+					copy_seq = row.seq;
+				}
+				if (copy_seq == row.seq)
+				{
+					span[filled].text = copy + (span[filled].text - ln->text);
+					span[filled].line = copy;
+				}
+				else
+				{
+					span[filled].text = span[filled].line = "";
+					span[filled].len = span[filled].line_len = 0;
+				}
+			}
+		}
+		seq[filled] = row.seq;
+		filled++;
+		if (move_rows(tab, &row, 1) == 0)
+			break;
+	}
+	for (int r = filled; r < visible_lines; r++)
+	{
+		seq[r] = -1;
+		seg[r] = 0;
+		span[r].text = NULL;
+	}
+
+	// Draw scroll indicator if needed
+	char scroll_info[64] = "";
+	if (filled > 0 && (tab->scrolled || top.seq != sb->first_seq || top.row != 0))
+	{
+		int first = (int)(top.seq - sb->first_seq), last = (int)(seq[filled - 1] - sb->first_seq);
+		snprintf(scroll_info, sizeof(scroll_info), "Lines: %d-%d/%d (Use Up/Down to scroll)",
+				 first + 1, last + 1, sb->count);
+	}
+	if ((frame->damage & DAMAGE_INDICATOR) || strcmp(scroll_info, frame->indicator) != 0)
+	{
+		paint_indicator(scroll_info);
+		strcpy(frame->indicator, scroll_info);
+	}
+
+	blit_rows(seq, seg, visible_lines);
+	highlight = tab->in_find_mode && tab->find.len > 0 ? &tab->find : NULL;
+
+	// Draw visible rows whose content changed, batching adjacent rows
+	int run_start = -1;
+	for (int r = 0; r <= visible_lines; r++)
+	{
+		if (r < visible_lines && (frame->row_seq[r] != seq[r] || frame->row_seg[r] != seg[r]))
+		{
+			if (run_start < 0)
+				run_start = r;
+			frame->row_seq[r] = seq[r];
+			frame->row_seg[r] = seg[r];
+		}
+		else if (run_start >= 0)
+		{
+			paint_rows(run_start, r - run_start, span + run_start);
+			run_start = -1;
+		}
+	}
+
+	int mode = tab->in_find_mode ? 2 : tab->in_search_mode;
+	const char *input = tab->input_buf;
+	int pos = tab->in_pos, choice = 0;
+	if (mode == 1)
+	{
+		input = tab->search_term;
+		pos = tab->search_pos;
+		choice = tab->hsearch.count > 0 ? tab->hsearch.results[tab->hsearch.selected] : -1;
+	}
+	else if (mode == 2)
+	{
+		// Matched by find_generation instead, which changes with the query
+		input = "";
+		pos = 0;
+	}
+	if ((frame->damage & DAMAGE_PROMPT) || frame->prompt_search != mode || frame->prompt_pos != pos ||
+		frame->prompt_choice != choice || !frame->prompt || strcmp(frame->prompt, input) != 0)
+	{
+		paint_prompt(tab);
+		frame->prompt_search = mode;
+		frame->prompt_pos = pos;
+		frame->prompt_choice = choice;
+		if (reserve_text(&frame->prompt, &frame->prompt_cap, strlen(input)))
+			strcpy(frame->prompt, input);
+	}
+
+	frame->damage = 0;
+	frame->end_seq = tab->lines.first_seq + tab->lines.count;
+	return 1;
+}
+
+static double switch_started; // When the pending tab switch was asked for
+
+static void tab_switched()
+{
+	switch_started = now_seconds();
+}
+
+// Paints background tabs that have new output, then the current tab, and
+// presents. Switching to a tab whose surface is up to date is one present.
+static void redraw()
+{
+	frame_calls = 0;
+	for (int i = 0; i < tab_count; i++)
+	{
+		Frame *f = tabs[i]->frame;
+		if (i != current_tab && f &&
+			(f->end_seq != tabs[i]->lines.first_seq + tabs[i]->lines.count || f->tab_generation != tab_generation))
+			paint_tab(i);
+	}
+	// Nothing of a background tab goes to the window
+	present_top = win_height;
+	present_bottom = 0;
+
+	if (!paint_tab(current_tab))
+		return;
+	if (on_screen != frame)
+	{
+		mark_changed(0, win_height);
+		on_screen = frame;
+	}
+	present();
+
+	if (switch_started > 0)
+	{
+		// Wait for the server so the latency covers the whole switch
+		XSync(dpy, False);
+		double latency = now_seconds() - switch_started;
+		switch_started = 0;
+		draw_stats.switches++;
+		draw_stats.switch_total += latency;
+		draw_stats.switch_last = latency;
+		if (latency > draw_stats.switch_max)
+			draw_stats.switch_max = latency;
+	}
+
+	if (frame_calls > 0)
+	{
+		draw_stats.frames++;
+		draw_stats.draw_calls += frame_calls;
+		draw_stats.last_frame_calls = frame_calls;
+		if (frame_calls > draw_stats.max_frame_calls)
+			draw_stats.max_frame_calls = frame_calls;
+	}
+}
+
+static void show_draw_stats(Tab *tab)
+{
+	char msg[256];
+	snprintf(msg, sizeof(msg), "frames: %ld, draw calls: %ld (%.1f per frame, last %d, max %d)",
+			 draw_stats.frames, draw_stats.draw_calls,
+			 draw_stats.frames ? (double)draw_stats.draw_calls / draw_stats.frames : 0.0,
+			 draw_stats.last_frame_calls, draw_stats.max_frame_calls);
+	add_line_to_tab(tab, msg);
+	snprintf(msg, sizeof(msg), "tab switches: %ld, latency %.2f ms avg, %.2f ms last, %.2f ms max",
+			 draw_stats.switches,
+			 draw_stats.switches ? draw_stats.switch_total * 1000 / draw_stats.switches : 0.0,
+			 draw_stats.switch_last * 1000, draw_stats.switch_max * 1000);
+	add_line_to_tab(tab, msg);
+	ColdStore *cs = &tab->lines.cold;
+	snprintf(msg, sizeof(msg), "scrollback: %d lines (%d uncompressed), cold %.1f MB packed to %.1f MB in memory + %.1f MB spilled",
+			 tab->lines.count, tab->lines.hot, cs->raw_bytes / 1048576.0,
+			 cs->mem_bytes / 1048576.0, cs->spill_bytes / 1048576.0);
+	add_line_to_tab(tab, msg);
+}
+
+/* -------------------- Frame Pacing -------------------- */
+// Output only marks the screen stale; the main loop paints at most
+// target_fps times a second so fast commands are not held up by X.
+#define DEFAULT_FPS 60
+
+static double frame_interval = 1.0 / DEFAULT_FPS;
+static double last_frame_time = 0;
+static int redraw_pending = 2; // 0: none, 1: at the next frame slot, 2: right away
+
+static double now_seconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void request_redraw()
+{
+	if (redraw_pending == 0)
+		redraw_pending = 1;
+}
+
+// For events that must show without waiting for the frame slot, like a
+// command finishing
+static void request_redraw_now()
+{
+	redraw_pending = 2;
+}
+
+// Milliseconds until a pending frame is due, or -1 if nothing is pending
+static int frame_timeout()
+{
+	if (redraw_pending == 0)
+		return -1;
+	if (redraw_pending == 2)
+		return 0;
+	double wait = last_frame_time + frame_interval - now_seconds();
+	return wait <= 0 ? 0 : (int)(wait * 1000) + 1;
+}
+
+static void paint_if_due()
+{
+	if (redraw_pending == 0)
+		return;
+	double now = now_seconds();
+	if (redraw_pending == 2 || now >= last_frame_time + frame_interval)
+	{
+		redraw();
+		last_frame_time = now;
+		redraw_pending = 0;
+	}
+}
+
+/* -------------------- Process Launch -------------------- */
+// Commands are started with posix_spawn(), which glibc implements with
+// clone(CLONE_VM | CLONE_VFORK): the child runs on MyTerm's memory until
+// it execs, so starting a command costs the same however much scrollback
+// the tabs hold, where fork() first copied the page tables for all of it.
+// What the child used to do between fork() and exec() is described up
+// front instead: the working directory and the standard streams as file
+// actions, the process group and signal state as attributes. Every other
+// descriptor MyTerm opens is close-on-exec, so nothing else leaks in.
+extern char **environ;
+
+typedef struct
+{
+	const char *in_path;  // Opened as stdin, else
+	int in_fd;			  // duplicated onto stdin, -1 to keep MyTerm's
+	const char *out_path; // Truncated and opened as stdout, else
+	int out_fd;			  // duplicated onto stdout, -1 to keep MyTerm's
+	int err_to_out;		  // stderr goes wherever stdout goes
+	pid_t pgid;			  // Process group to join, 0 for a new one
+} LaunchSpec;
+
+// pipe() with both ends close-on-exec; launch() passes on only the ends it is told to
+static int launch_pipe(int fds[2])
+{
+	if (pipe(fds) == -1)
+		return -1;
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	return 0;
+}
+
+// Runs `path` with `argv` in `dir`, or in $HOME if that is gone, wired up
+// as `ls` says. Returns 0 and the child's pid, or an errno value: unlike
+// after fork(), a missing input file or program is reported to MyTerm.
+static int launch(const char *dir, const char *path, char *const argv[], const LaunchSpec *ls, pid_t *pid)
+{
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	int err = posix_spawn_file_actions_init(&actions);
+	if (err)
+		return err;
+	err = posix_spawnattr_init(&attr);
+	if (err)
+	{
+		posix_spawn_file_actions_destroy(&actions);
+		return err;
+	}
+
+	struct stat st;
+	if (!dir || stat(dir, &st) != 0 || !S_ISDIR(st.st_mode))
+		dir = getenv("HOME") ? getenv("HOME") : "/";
+	err = posix_spawn_file_actions_addchdir_np(&actions, dir);
+
+	// Relative paths are opened after the chdir, as the shell would
+	if (!err && ls->in_path)
+		err = posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, ls->in_path, O_RDONLY, 0);
+	else if (!err && ls->in_fd >= 0)
+		err = posix_spawn_file_actions_adddup2(&actions, ls->in_fd, STDIN_FILENO);
+	if (!err && ls->out_path)
+		err = posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, ls->out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	else if (!err && ls->out_fd >= 0)
+		err = posix_spawn_file_actions_adddup2(&actions, ls->out_fd, STDOUT_FILENO);
+	if (!err && ls->err_to_out)
+		err = posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+
+	// MyTerm catches these; the command gets the defaults and no blocked signals
+	sigset_t defaults, mask;
+	sigemptyset(&mask);
+	sigemptyset(&defaults);
+	sigaddset(&defaults, SIGINT);
+	sigaddset(&defaults, SIGQUIT);
+	sigaddset(&defaults, SIGTSTP);
+	sigaddset(&defaults, SIGTTIN);
+	sigaddset(&defaults, SIGTTOU);
+	sigaddset(&defaults, SIGPIPE);
+	sigaddset(&defaults, SIGCHLD);
+	if (!err)
+		err = posix_spawnattr_setsigmask(&attr, &mask);
+	if (!err)
+		err = posix_spawnattr_setsigdefault(&attr, &defaults);
+	if (!err)
+		err = posix_spawnattr_setpgroup(&attr, ls->pgid);
+	if (!err)
+		err = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+
+	// $PWD names the directory the command starts in, as a shell leaves it
+	int nenv = 0;
+	while (environ[nenv])
+		nenv++;
+	char **envp = malloc((nenv + 2) * sizeof(char *));
+	char *pwd = malloc(strlen(dir) + 5);
+	if (!err && (!envp || !pwd))
+		err = ENOMEM;
+	if (!err)
+	{
+		sprintf(pwd, "PWD=%s", dir);
+		int k = 0;
+		envp[k++] = pwd;
+		for (int i = 0; i < nenv; i++)
+		{
+			if (strncmp(environ[i], "PWD=", 4) != 0)
+				envp[k++] = environ[i];
+		}
+		envp[k] = NULL;
+		err = posix_spawn(pid, path, &actions, &attr, argv, envp);
+	}
+
+	free(envp);
+	free(pwd);
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+	return err;
+}
+
+// Runs a command line with bash -c in the tab's directory
+static int launch_shell(Tab *tab, const char *cmdline, const LaunchSpec *ls, pid_t *pid)
+{
+	char *argv[] = {"bash", "-c", (char *)cmdline, NULL};
+	return launch(tab->current_directory, "/bin/bash", argv, ls, pid);
+}
+
+// Simple commands skip bash. A command line made only of words, quotes
+// and backslash escapes, with nothing for a shell to expand or interpret,
+// is split here and its program found on $PATH and exec'd directly, which
+// saves a bash start-up on every `ls` or `make`. Anything else, including
+// a program that can't be found or is a script without a #! line, goes
+// to bash -c as before.
+#define MAX_SIMPLE_WORDS 256
+
+// Keywords, and builtins that act on the shell itself or that no program
+// on $PATH stands in for. Commands starting with these need bash. So do
+// builtins whose /bin namesakes behave differently: `echo -e`, printf's
+// %q, `kill %1` and `pwd` after a symlinked cd only work as bash has them.
+static const char *const shell_words[] = {
+	"!", "[[", "]]", "{", "}", "case", "coproc", "do", "done", "elif", "else", "esac", "fi", "for", "function",
+	"if", "in", "select", "then", "time", "until", "while", ".", ":", "[", "alias", "bg", "bind", "break",
+	"builtin", "caller", "cd", "command", "compgen", "complete", "compopt", "continue", "declare", "dirs",
+	"disown", "echo", "enable", "eval", "exec", "exit", "export", "false", "fc", "fg", "getopts", "hash", "help",
+	"history", "jobs", "kill", "let", "local", "logout", "mapfile", "popd", "printf", "pushd", "pwd", "read",
+	"readarray", "readonly", "return", "set", "shift", "shopt", "source", "suspend", "test", "times", "trap",
+	"true", "type", "typeset", "ulimit", "umask", "unalias", "unset", "wait"};
+
+// Splits a command line into argv[] if it needs nothing from a shell.
+// Returns the number of words, or -1 if bash must run it. The words are
+// allocated in `arena`.
+static int simple_command_words(Arena *arena, const char *cmd, char **argv, int max)
+{
+	char *out = arena_alloc(arena, strlen(cmd) + 1); // Unquoting never lengthens a word
+	if (!out)
+		return -1;
+	const char *p = cmd;
+	int argc = 0;
+	for (;;)
+	{
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (!*p)
+			break;
+		// A comment, or a tilde to expand
+		if (argc == max - 1 || *p == '#' || *p == '~')
+			return -1;
+		argv[argc++] = out;
+		while (*p && *p != ' ' && *p != '\t')
+		{
+			char c = *p++;
+			if (c == '\\')
+			{
+				if (!*p || *p == '\n')
+					return -1;
+				*out++ = *p++;
+			}
+			else if (c == '\'')
+			{
+				const char *close = strchr(p, '\'');
+				if (!close)
+					return -1;
+				memcpy(out, p, close - p);
+				out += close - p;
+				p = close + 1;
+			}
+			else if (c == '"')
+			{
+				for (; *p != '"'; p++)
+				{
+					if (!*p || *p == '$' || *p == '`')
+						return -1;
+					if (*p == '\\' && (p[1] == '"' || p[1] == '\\'))
+						p++;
+					*out++ = *p;
+				}
+				p++;
+			}
+			else if (strchr("|&;<>()$`*?[]{}\n\r", c))
+				return -1; // Operators, expansions and globs
+			else
+				*out++ = c;
+		}
+		*out++ = '\0';
+	}
+	argv[argc] = NULL;
+
+	// Variable assignments are shell syntax too
+	if (argc == 0 || strchr(argv[0], '='))
+		return -1;
+	for (size_t i = 0; i < sizeof(shell_words) / sizeof(shell_words[0]); i++)
+	{
+		if (strcmp(argv[0], shell_words[i]) == 0)
+			return -1;
+	}
+	return argc;
+}
+
+// The file `name` runs when started in `dir`, looked up on $PATH as
+// execvp() would, or NULL to leave the search, and the error message if
+// it fails, to bash
+static char *resolve_program(Arena *arena, const char *dir, const char *name)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	if (strchr(name, '/'))
+	{
+		if (name[0] == '/')
+			snprintf(path, sizeof(path), "%s", name);
+		else
+			snprintf(path, sizeof(path), "%s/%s", dir, name);
+		if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0)
+			return arena_strdup(arena, path);
+		return NULL;
+	}
+
+	const char *search = getenv("PATH");
+	while (search && *search)
+	{
+		const char *colon = strchr(search, ':');
+		int len = colon ? colon - search : (int)strlen(search);
+		// An empty or relative entry is relative to the working directory: let bash look
+		if (search[0] != '/')
+			return NULL;
+		if (snprintf(path, sizeof(path), "%.*s/%s", len, search, name) < (int)sizeof(path) &&
+			stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0)
+			return arena_strdup(arena, path);
+		search = colon ? colon + 1 : NULL;
+	}
+	return NULL;
+}
+
+// Runs a command line in the tab's directory, directly if it is simple
+// and its program can be found, else with bash -c
+static int launch_command(Tab *tab, const char *cmdline, const LaunchSpec *ls, pid_t *pid)
+{
+	char *argv[MAX_SIMPLE_WORDS];
+	char *path = NULL;
+	if (simple_command_words(&tab->scratch, cmdline, argv, MAX_SIMPLE_WORDS) > 0)
+		path = resolve_program(&tab->scratch, tab->current_directory, argv[0]);
+	if (path)
+	{
+		int err = launch(tab->current_directory, path, argv, ls, pid);
+		if (err != ENOEXEC)
+			return err;
+	}
+	return launch_shell(tab, cmdline, ls, pid);
+}
+
+// Tells the tab a command could not be started and returns the exit
+// status the shell would have given it: 1 when a redirection failed, as
+// is most likely when there is one, else 127
+static int launch_failed(Tab *tab, const char *cmdline, const LaunchSpec *ls, int err)
+{
+	char msg[BUFSIZE];
+	int redirected = (ls->in_path && strcmp(ls->in_path, "/dev/null") != 0) || ls->out_path;
+	snprintf(msg, sizeof(msg), "MyTerm: cannot start '%.*s'%s: %s", 4000, cmdline,
+			 redirected ? " with its redirections" : "", strerror(err));
+	add_line_to_tab(tab, msg);
+	return redirected ? 1 : 127;
+}
+
+/* -------------------- Persistent Shell -------------------- */
+// With MYTERM_PERSISTENT_SHELL=1 each tab keeps one bash for its
+// foreground commands, so variables, aliases and functions carry over
+// from one command to the next and a command costs no process start-up
+// of its own. The shell reads commands from a pipe. After each one it
+// prints a line that starts with a marker unique to the tab and carries
+// the exit status and working directory, and the job ends when that line
+// is read. Background commands still get a process of their own.
+static int persistent_shell = 0;
+
+// Stops the tab's shell and anything it is running
+static void shell_stop(Tab *tab)
+{
+	if (tab->shell_pid > 0)
+	{
+		kill(-tab->shell_pid, SIGTERM);
+		kill(-tab->shell_pid, SIGCONT);
+		waitpid(tab->shell_pid, NULL, 0);
+		tab->shell_pid = 0;
+	}
+	if (tab->job.coproc && tab->job.out_fd == tab->shell_stdout[0])
+		tab->job.out_fd = -1;
+	for (int i = 0; i < 2; i++)
+	{
+		if (tab->shell_stdin[i] >= 0)
+			close(tab->shell_stdin[i]);
+		if (tab->shell_stdout[i] >= 0)
+			close(tab->shell_stdout[i]);
+		tab->shell_stdin[i] = tab->shell_stdout[i] = -1;
+	}
+	tab->shell_carry_len = 0;
+}
+
+static int write_all(int fd, const char *p, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t w = write(fd, p, len);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			return -1;
+		p += w;
+		len -= w;
+	}
+	return 0;
+}
+
+// Starts the tab's shell in its own process group. Ctrl+C reaches the
+// whole group; the shell traps it, sets the status to 130 and breaks out
+// of the loop a command line runs in, so the rest of the line is skipped
+// but the shell lives. A line run in a group goes on to its next command.
+static int shell_start(Tab *tab)
+{
+	if (launch_pipe(tab->shell_stdin) == -1 || launch_pipe(tab->shell_stdout) == -1)
+	{
+		int err = errno;
+		shell_stop(tab);
+		return err;
+	}
+	LaunchSpec ls = {.in_fd = tab->shell_stdin[0], .out_fd = tab->shell_stdout[1], .err_to_out = 1};
+	char *argv[] = {"bash", NULL};
+	int err = launch(tab->current_directory, "/bin/bash", argv, &ls, &tab->shell_pid);
+	close(tab->shell_stdin[0]);
+	close(tab->shell_stdout[1]);
+	tab->shell_stdin[0] = tab->shell_stdout[1] = -1;
+	if (err)
+	{
+		tab->shell_pid = 0;
+		shell_stop(tab);
+		return err;
+	}
+
+	unsigned seed = (unsigned)(now_seconds() * 1e6) ^ (unsigned)getpid() * 2654435761u ^ (unsigned)tab->number;
+	snprintf(tab->shell_mark, sizeof(tab->shell_mark), "MyTerm-%08x-%d", seed * 2246822519u, tab->number);
+	const char *setup = "trap '__myterm_status=130; break 99 2>/dev/null' INT\nshopt -s expand_aliases\n";
+	if (write_all(tab->shell_stdin[1], setup, strlen(setup)) == -1)
+	{
+		err = errno;
+		shell_stop(tab);
+		return err;
+	}
+	return 0;
+}
+
+// Appends `s` to `out` quoted for the shell
+static int shell_quote(char **out, int *cap, int *len, const char *s)
+{
+	if (!reserve_text(out, cap, *len + strlen(s) * 4 + 2))
+		return 0;
+	char *p = *out + *len;
+	*p++ = '\'';
+	for (; *s; s++)
+	{
+		if (*s == '\'')
+		{
+			memcpy(p, "'\\''", 4);
+			p += 4;
+		}
+		else
+			*p++ = *s;
+	}
+	*p++ = '\'';
+	*len = p - *out;
+	return 1;
+}
+
+// Whether `word` appears in `s` with no letter, digit or _ either side
+static int shell_mentions(const char *s, const char *word)
+{
+	const char *name = "_0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+	size_t n = strlen(word);
+	for (const char *p = strstr(s, word); p; p = strstr(p + 1, word))
+	{
+		char before = p > s ? p[-1] : ' ', after = p[n];
+		if (!strchr(name, before) && (!after || !strchr(name, after)))
+			return 1;
+	}
+	return 0;
+}
+
+// Builds the script that runs a command line in the tab's shell. The
+// line is run with eval so that a syntax error or an unfinished construct
+// can't swallow the marker line. Returns NULL when out of memory.
+static char *shell_script(Tab *tab, const char *cmdline, int *len)
+{
+	// A line runs in a loop of one pass that the INT trap breaks out of,
+	// unless it has a break or continue of its own: then in a group, so
+	// those act as they do in bash. The cd below and the marker would
+	// clobber $? and $_, so the eval puts back the last line's $_ first
+	// and saves both after the command.
+	int loop = !shell_mentions(cmdline, "break") && !shell_mentions(cmdline, "continue");
+	char *script = NULL;
+	int cap = 0;
+	*len = 0;
+	// Follows cd in MyTerm without touching $OLDPWD when nothing changed
+	const char *parts[] = {"[[ $PWD = ", tab->current_directory, " ]] || cd -- ", tab->current_directory,
+						   loop ? "\nwhile :; do eval " : "\n{ eval ", "{ : \"$__myterm_last\"; ", "", cmdline, "",
+						   "\n}\n__myterm_status=$? __myterm_last=$_",
+						   loop ? " || __myterm_status=$?; break; done </dev/null\nprintf '\\036%s %d %s\\n' "
+								: " || __myterm_status=$?; } </dev/null\nprintf '\\036%s %d %s\\n' ",
+						   tab->shell_mark, " \"$__myterm_status\" \"$PWD\"\n"};
+	for (int i = 0; i < (int)(sizeof(parts) / sizeof(*parts)); i++)
+	{
+		int ok = i % 2 ? shell_quote(&script, &cap, len, parts[i])
+					   : reserve_text(&script, &cap, *len + strlen(parts[i]));
+		if (!ok)
+		{
+			free(script);
+			return NULL;
+		}
+		if (i % 2 == 0)
+		{
+			memcpy(script + *len, parts[i], strlen(parts[i]));
+			*len += strlen(parts[i]);
+		}
+	}
+	return script;
+}
+
+// Runs a command line in the tab's shell, starting the shell if there
+// is none. Returns 0 once the job is started, else an errno value.
+static int shell_run(Tab *tab, const char *cmdline)
+{
+	for (int attempt = 0;; attempt++)
+	{
+		// A shell that died while idle is replaced and the line sent once more
+		if (tab->shell_pid > 0 && waitpid(tab->shell_pid, NULL, WNOHANG) != 0)
+		{
+			tab->shell_pid = 0;
+			shell_stop(tab);
+		}
+		if (tab->shell_pid <= 0)
+		{
+			int err = shell_start(tab);
+			if (err)
+				return err;
+		}
+
+		int len;
+		char *script = shell_script(tab, cmdline, &len);
+		if (!script)
+			return ENOMEM;
+		int err = write_all(tab->shell_stdin[1], script, len) == -1 ? errno : 0;
+		free(script);
+		if (!err)
+			break;
+		// The shell has gone: the next command gets a new one
+		shell_stop(tab);
+		if (err != EPIPE || attempt > 0)
+			return err;
+	}
+	job_start(tab, tab->shell_pid, tab->shell_pid, tab->shell_stdout[0], cmdline);
+	tab->job.coproc = 1;
+	return 0;
+}
+
+// Takes the output of a command run in the shell, up to the marker line.
+// Returns 1 once it has been seen, with the command's exit status set.
+static int shell_output(Tab *tab, const char *buf, size_t len)
+{
+	Job *job = &tab->job;
+	// A marker may be split between reads, so a possible start of one is held back
+	if (tab->shell_carry_len > 0)
+	{
+		if (!reserve_text(&tab->shell_carry, &tab->shell_carry_cap, tab->shell_carry_len + len))
+			return 0;
+		memcpy(tab->shell_carry + tab->shell_carry_len, buf, len);
+		tab->shell_carry_len += len;
+		buf = tab->shell_carry;
+		len = tab->shell_carry_len;
+	}
+
+	char marker[40];
+	int mlen = snprintf(marker, sizeof(marker), "\036%s ", tab->shell_mark);
+	int at = find_text(buf, len, marker, mlen);
+	const char *nl = at >= 0 ? memchr(buf + at, '\n', len - at) : NULL;
+	size_t keep = len;
+	if (at >= 0)
+	{
+		keep = at;
+	}
+	else
+	{
+		// Hold back a tail that could be the start of the marker
+		for (size_t k = len > (size_t)mlen ? len - mlen + 1 : 0; k < len; k++)
+		{
+			if (buf[k] == '\036' && memcmp(buf + k, marker, len - k) == 0)
+			{
+				keep = k;
+				break;
+			}
+		}
+	}
+	framer_feed(&job->framer, &tab->lines, buf, keep);
+
+	if (nl)
+	{
+		char *end;
+		int status = strtol(buf + at + mlen, &end, 10);
+		job->last_status = W_EXITCODE(status & 0xff, 0);
+		// The shell may have changed directory itself
+		if (*end == ' ' && end + 1 < nl && end[1] == '/')
+		{
+			char *dir = strndup(end + 1, nl - end - 1);
+			if (dir)
+			{
+				free(tab->current_directory);
+				tab->current_directory = dir;
+			}
+		}
+		// Output that came in behind the marker, say from a background
+		// child of the command, still belongs to this command. It starts
+		// a line of its own.
+		size_t after = buf + len - (nl + 1);
+		if (after > 0)
+		{
+			framer_flush(&job->framer, &tab->lines);
+			framer_feed(&job->framer, &tab->lines, nl + 1, after);
+		}
+		tab->shell_carry_len = 0;
+		return 1;
+	}
+
+	// Keep the undecided tail; buf may be the carry buffer itself
+	size_t rest = len - keep;
+	if (rest > 0 && buf != tab->shell_carry && !reserve_text(&tab->shell_carry, &tab->shell_carry_cap, rest))
+		rest = 0;
+	if (rest > 0)
+		memmove(tab->shell_carry, buf + keep, rest);
+	tab->shell_carry_len = rest;
+	return 0;
+}
+
+/* -------------------- Event Loop -------------------- */
+// Signal handlers only set a flag and write a byte to this pipe, so poll()
+// can wait for signals alongside the X connection and command output.
+static int signal_pipe[2] = {-1, -1};
+static volatile sig_atomic_t sigchld_pending = 0;
+static volatile sig_atomic_t sigint_pending = 0;
+static volatile sig_atomic_t sigtstp_pending = 0;
+
+static void wake_main_loop()
+{
+	int saved_errno = errno;
+	if (write(signal_pipe[1], "s", 1) < 0)
+	{
+		// Pipe already full: a wakeup is pending anyway
+	}
+	errno = saved_errno;
+}
+
+static void sigchld_handler(int sig)
+{
+	(void)sig;
+	sigchld_pending = 1;
+	wake_main_loop();
+}
+
+static int setup_signal_pipe()
+{
+	if (pipe(signal_pipe) == -1)
+		return -1;
+	for (int i = 0; i < 2; i++)
+	{
+		fcntl(signal_pipe[i], F_SETFL, fcntl(signal_pipe[i], F_GETFL) | O_NONBLOCK);
+		fcntl(signal_pipe[i], F_SETFD, FD_CLOEXEC);
+	}
+
+	// Stops are reported too, so a job stopped by any means gets suspended
+	struct sigaction sa_chld;
+	memset(&sa_chld, 0, sizeof(sa_chld));
+	sa_chld.sa_handler = sigchld_handler;
+	sigemptyset(&sa_chld.sa_mask);
+	sa_chld.sa_flags = SA_RESTART;
+	return sigaction(SIGCHLD, &sa_chld, NULL);
+}
+
+// Sleeps until the X connection, a signal or one of `fds` is ready, or
+// until `timeout` ms pass (-1 waits forever). fds[0] and fds[1] are
+// filled in here; callers put their own fds after them.
+static void wait_for_events(struct pollfd *fds, int nfds, int timeout)
+{
+	fds[0].fd = ConnectionNumber(dpy);
+	fds[0].events = POLLIN;
+	fds[1].fd = signal_pipe[0];
+	fds[1].events = POLLIN;
+
+	// Requests sitting in Xlib's buffer must reach the server before we
+	// block, and events it has already read must not wait for the socket.
+	XFlush(dpy);
+	if (XPending(dpy) > 0)
+		timeout = 0;
+
+	if (poll(fds, nfds, timeout) < 0)
+	{
+		for (int i = 0; i < nfds; i++)
+			fds[i].revents = 0;
+		if (errno != EINTR)
+			perror("poll");
+	}
+
+	if (fds[1].revents & POLLIN)
+	{
+		char buf[64];
+		while (read(signal_pipe[0], buf, sizeof(buf)) > 0)
+			;
+	}
+}
+
+static void reap_background_processes()
+{
+	int reaped = 0;
+	for (int t = 0; t < tab_count; t++)
+	{
+		Tab *tab = tabs[t];
+		for (int i = 0; i < tab->bg_pid_count; i++)
+		{
+			if (tab->background_pids[i] > 0 && waitpid(tab->background_pids[i], NULL, WNOHANG) > 0)
+			{
+				char msg[256];
+				snprintf(msg, sizeof(msg), "[%d] done", tab->background_pids[i]);
+				add_line_to_tab(tab, msg);
+				tab->background_pids[i] = 0;
+				reaped = 1;
+			}
+		}
+	}
+	if (reaped)
+		request_redraw();
+}
+
+// ---------- multiWatch implementation ----------
+static char *trim_spaces(char *s)
+{
+	if (!s)
+		return s;
+	while (*s == ' ' || *s == '\t')
+		s++;
+	char *end = s + strlen(s) - 1;
+	while (end >= s && (*end == ' ' || *end == '\t' || *end == '\n' || *end == '\r'))
+	{
+		*end = '\0';
+		end--;
+	}
+	return s;
+}
+
+static int parse_multiwatch_list(char *arg, char **commands, int maxcmds)
+{
+	char *l = strchr(arg, '[');
+	if (!l)
+		return 0;
+	char *r = strchr(l, ']');
+	if (!r)
+		return 0;
+	*r = '\0';
+	l++;
+
+	int n = 0;
+	char *p = l;
+
+	while (*p && n < maxcmds)
+	{
+		while (*p == ' ' || *p == '\t' || *p == ',')
+			p++;
+		if (!*p)
+			break;
+
+		if (*p == '"')
+		{
+			p++;
+			char *start = p;
+			while (*p && *p != '"')
+			{
+				if (*p == '\\' && *(p + 1))
+					p++;
+				p++;
+			}
+			if (*p == '"')
+			{
+				*p = '\0';
+				commands[n++] = start;
+				p++;
+			}
+			else
+			{
+				commands[n++] = start;
+				break;
+			}
+		}
+		else
+		{
+			char *start = p;
+			while (*p && *p != ',')
+				p++;
+			if (*p == ',')
+			{
+				*p = '\0';
+				commands[n++] = trim_spaces(start);
+				p++;
+			}
+			else
+			{
+				commands[n++] = trim_spaces(start);
+				break;
+			}
+		}
+	}
+	return n;
+}
+
+static void multiWatch_runner(Tab *tab, const char *argline)
+{
+	MultiWatch *mw = calloc(1, sizeof(MultiWatch));
+	if (!mw)
+	{
+		add_line_to_tab(tab, "multiWatch: out of memory");
+		tab->builtin_status = 1;
+		return;
+	}
+	strncpy(mw->args, argline, sizeof(mw->args) - 1);
+
+	char *listpart = strchr(mw->args, '[');
+	if (!listpart)
+	{
+		add_line_to_tab(tab, "multiWatch: malformed arguments (expected [ ... ])");
+		tab->builtin_status = 1;
+		free(mw);
+		return;
+	}
+
+	mw->ncmd = parse_multiwatch_list(listpart, mw->commands, MAX_MW_CMDS);
+
+	if (mw->ncmd <= 0)
+	{
+		add_line_to_tab(tab, "multiWatch: no commands found");
+		tab->builtin_status = 1;
+		free(mw);
+		return;
+	}
+
+	add_line_to_tab(tab, "multiWatch: starting parallel execution");
+
+	static unsigned mw_sequence = 0;
+	pid_t pgid = 0;
+	int status = 0;
+	for (int i = 0; i < mw->ncmd; i++)
+	{
+		mw->fds[i] = -1;
+		framer_init(&mw->framers[i]);
+
+		// The spawn creates the file, so it is there once launch() returns
+		snprintf(mw->tempfiles[i], sizeof(mw->tempfiles[i]), "/tmp/.temp_mw_%d_%u.txt", (int)getpid(), mw_sequence++);
+		LaunchSpec ls = {.in_fd = -1, .out_path = mw->tempfiles[i], .out_fd = -1, .err_to_out = 1, .pgid = pgid};
+		pid_t pid;
+		int err = launch_command(tab, mw->commands[i], &ls, &pid);
+		if (err)
+		{
+			status = launch_failed(tab, mw->commands[i], &ls, err);
+			mw->ncmd = i;
+			break;
+		}
+		if (pgid == 0)
+			pgid = pid;
+		mw->pids[i] = pid;
+	}
+
+	if (mw->ncmd == 0)
+	{
+		command_end(tab, status);
+		free(mw);
+		return;
+	}
+
+	// The main loop reads the temp files from here on
+	job_start(tab, pgid, 0, -1, "multiWatch");
+	tab->job.mw = mw;
+}
+
+// Appends whatever the commands wrote to their temp files since the last
+// call. Returns 1 if anything was added to the tab.
+static int multiWatch_read(Tab *tab)
+{
+	MultiWatch *mw = tab->job.mw;
+	char buf[BUFSIZE];
+	int got = 0;
+
+	for (int i = 0; i < mw->ncmd; i++)
+	{
+		if (mw->fds[i] < 0)
+			mw->fds[i] = open(mw->tempfiles[i], O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+		if (mw->fds[i] < 0)
+			continue;
+
+		ssize_t r = read(mw->fds[i], buf, sizeof(buf));
+		if (r <= 0)
+			continue;
+
+		time_t now = time(NULL);
+		char ts[64];
+		strftime(ts, sizeof(ts), "%F %T", localtime(&now));
+		char header[256];
+		snprintf(header, sizeof(header), "\"%s\", %s:", mw->commands[i], ts);
+		add_line_to_tab(tab, header);
+		add_line_to_tab(tab, "----------------------------------------------------");
+		do
+		{
+			framer_feed(&mw->framers[i], &tab->lines, buf, r);
+		} while ((r = read(mw->fds[i], buf, sizeof(buf))) > 0);
+		add_line_to_tab(tab, "----------------------------------------------------");
+		got = 1;
+	}
+	return got;
+}
+
+static void multiWatch_cleanup(MultiWatch *mw)
+{
+	for (int i = 0; i < mw->ncmd; i++)
+	{
+		if (mw->fds[i] >= 0)
+			close(mw->fds[i]);
+		unlink(mw->tempfiles[i]);
+	}
+	free(mw);
+}
+
+// Called once every command has exited
+static void multiWatch_finish(Tab *tab)
+{
+	MultiWatch *mw = tab->job.mw;
+	multiWatch_read(tab);
+
+	for (int i = 0; i < mw->ncmd; i++)
+	{
+		if (mw->fds[i] < 0)
+		{
+			char err[256];
+			snprintf(err, sizeof(err), "Warning: Could not open temp file for PID %d", (int)mw->pids[i]);
+			add_line_to_tab(tab, err);
+		}
+
+		// Output that never got its final newline
+		if (mw->framers[i].partial_len > 0)
+		{
+			char header[256];
+			snprintf(header, sizeof(header), "\"%s\":", mw->commands[i]);
+			add_line_to_tab(tab, header);
+			add_line_to_tab(tab, "----------------------------------------------------");
+			framer_flush(&mw->framers[i], &tab->lines);
+			add_line_to_tab(tab, "----------------------------------------------------");
+		}
+		framer_release(&mw->framers[i]);
+	}
+
+	multiWatch_cleanup(mw);
+	tab->job.mw = NULL;
+	add_line_to_tab(tab, "multiWatch: execution completed");
+}
+
+/* -------------------- Job Engine -------------------- */
+#define JOB_READ_SIZE 65536	 // One pipe's worth of output per read()
+#define JOB_READ_BUDGET 16	 // Reads per wakeup, so one busy job cannot starve the rest
+#define MW_POLL_INTERVAL 100 // ms between multiWatch temp file reads
+
+static void job_start(Tab *tab, pid_t pgid, pid_t last_pid, int out_fd, const char *command)
+{
+	Job *job = &tab->job;
+	job->state = JOB_SPAWNED;
+	job->pgid = pgid;
+	job->last_pid = last_pid;
+	job->last_status = 0;
+	job->out_fd = out_fd;
+	job->mw = NULL;
+	job->coproc = 0;
+	framer_init(&job->framer);
+	free(job->command);
+	job->command = strdup(command);
+
+	if (out_fd >= 0)
+		fcntl(out_fd, F_SETFL, fcntl(out_fd, F_GETFL) | O_NONBLOCK);
+}
+
+// Reads output that is ready without blocking. Returns 1 if anything was
+// added to the tab.
+static int job_read_output(Tab *tab)
+{
+	Job *job = &tab->job;
+	if (job->mw)
+		return multiWatch_read(tab);
+
+	static char buf[JOB_READ_SIZE];
+	int got = 0;
+	for (int n = 0; n < JOB_READ_BUDGET && job->out_fd >= 0; n++)
+	{
+		ssize_t r = read(job->out_fd, buf, sizeof(buf));
+		if (r > 0 && job->coproc)
+		{
+			got = 1;
+			if (shell_output(tab, buf, r))
+			{
+				// Done; the pipe stays open for the shell's next command
+				job->out_fd = -1;
+				job->state = JOB_REAPED;
+			}
+			else if (job->state == JOB_SPAWNED)
+				job->state = JOB_STREAMING;
+		}
+		else if (r > 0)
+		{
+			framer_feed(&job->framer, &tab->lines, buf, r);
+			if (job->state == JOB_SPAWNED)
+				job->state = JOB_STREAMING;
+			got = 1;
+		}
+		else if (r < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		else
+		{
+			// EOF or error. An empty pipe also ends a job that has exited.
+			if (r == 0 || errno != EAGAIN || job->state == JOB_DRAINING)
+			{
+				close(job->out_fd);
+				job->out_fd = -1;
+				if (job->coproc)
+					tab->shell_stdout[0] = -1;
+			}
+			break;
+		}
+	}
+	return got;
+}
+
+static void job_suspend(Tab *tab)
+{
+	Job *job = &tab->job;
+	if (tab->suspended_count >= 10)
+	{
+		// No slot to remember it in, so keep it running
+		kill(-job->pgid, SIGCONT);
+		add_line_to_tab(tab, "Too many suspended jobs");
+		return;
+	}
+
+	framer_flush(&job->framer, &tab->lines);
+
+	// The output pipe stays open so fg can pick the job back up
+	SuspendedProcess *sp = &tab->suspended_processes[tab->suspended_count++];
+	sp->pid = job->pgid;
+	sp->last_pid = job->last_pid;
+	sp->out_fd = job->out_fd;
+	sp->command = job->command;
+	job->command = NULL;
+
+	char msg[256];
+	snprintf(msg, sizeof(msg), "[%d] suspended", job->pgid);
+	add_line_to_tab(tab, msg);
+	add_line_to_tab(tab, "^Z");
+	command_end(tab, 128 + SIGTSTP);
+
+	job->out_fd = -1;
+	job->state = JOB_IDLE;
+}
+
+// Collects exited processes after a SIGCHLD. Once none are left the job
+// moves on to draining its pipe.
+static void job_collect(Tab *tab)
+{
+	Job *job = &tab->job;
+	int status;
+	pid_t pid;
+
+	while ((pid = waitpid(-job->pgid, &status, WNOHANG | WUNTRACED)) > 0)
+	{
+		if (WIFSTOPPED(status))
+		{
+			if (!job->mw)
+			{
+				job_suspend(tab);
+				return;
+			}
+		}
+		else if (pid == job->last_pid)
+		{
+			job->last_status = status;
+		}
+	}
+
+	if (pid < 0 && errno == ECHILD)
+		job->state = JOB_DRAINING;
+}
+
+static void job_finish(Tab *tab)
+{
+	Job *job = &tab->job;
+	int status = 0;
+	if (job->mw)
+	{
+		multiWatch_finish(tab);
+	}
+	else
+	{
+		if (job->coproc && tab->shell_stdout[0] < 0)
+		{
+			// The shell itself exited, so the command's status is its status
+			framer_feed(&job->framer, &tab->lines, tab->shell_carry, tab->shell_carry_len);
+			tab->shell_pid = 0;
+			shell_stop(tab);
+			add_line_to_tab(tab, "The shell exited; the next command starts a new one");
+		}
+		framer_flush(&job->framer, &tab->lines);
+		if (WIFEXITED(job->last_status) && WEXITSTATUS(job->last_status) != 0)
+		{
+			char errbuf[256];
+			snprintf(errbuf, sizeof(errbuf), "Command exited with status %d", WEXITSTATUS(job->last_status));
+			add_line_to_tab(tab, errbuf);
+		}
+		if (WIFEXITED(job->last_status))
+			status = WEXITSTATUS(job->last_status);
+		else if (WIFSIGNALED(job->last_status))
+			status = 128 + WTERMSIG(job->last_status);
+	}
+	command_end(tab, status);
+
+	if (job->out_fd >= 0)
+	{
+		close(job->out_fd);
+		job->out_fd = -1;
+	}
+	job->state = JOB_IDLE;
+}
+
+// Moves a job whose processes are gone through draining to reaped.
+// Returns 1 if the job finished.
+static int job_advance(Tab *tab)
+{
+	Job *job = &tab->job;
+	if (job->state == JOB_DRAINING)
+	{
+		job_read_output(tab);
+		if (job->mw || job->out_fd < 0)
+			job->state = JOB_REAPED;
+	}
+
+	if (job->state == JOB_REAPED)
+	{
+		job_finish(tab);
+		return 1;
+	}
+	return 0;
+}
+
+// Ctrl+C: multiWatch commands are killed outright, like before
+static void job_interrupt(Tab *tab)
+{
+	Job *job = &tab->job;
+	if (job->state == JOB_IDLE)
+		return;
+	kill(-job->pgid, job->mw ? SIGKILL : SIGINT);
+	add_line_to_tab(tab, "^C");
+}
+
+// Ctrl+Z: the stop shows up as a SIGCHLD and job_collect() suspends the job
+static void job_stop(Tab *tab)
+{
+	Job *job = &tab->job;
+	if (job->state == JOB_IDLE || job->mw)
+		return;
+	if (job->coproc)
+	{
+		// Stopping it would stop the tab's shell with it
+		add_line_to_tab(tab, "Commands in the persistent shell can't be suspended");
+		return;
+	}
+	kill(-job->pgid, SIGTSTP);
+}
+
+// Kills a job outright when its tab is closed
+static void job_discard(Tab *tab)
+{
+	Job *job = &tab->job;
+	if (job->state == JOB_IDLE)
+		return;
+
+	kill(-job->pgid, SIGTERM);
+	kill(-job->pgid, SIGCONT);
+	while (waitpid(-job->pgid, NULL, 0) > 0)
+		;
+
+	if (job->out_fd >= 0)
+	{
+		close(job->out_fd);
+		job->out_fd = -1;
+	}
+	if (job->mw)
+	{
+		for (int i = 0; i < job->mw->ncmd; i++)
+			framer_release(&job->mw->framers[i]);
+		multiWatch_cleanup(job->mw);
+		job->mw = NULL;
+	}
+	framer_release(&job->framer);
+	job->state = JOB_IDLE;
+}
+
+// Fills fds[2...] with the output pipes of running jobs and returns the
+// number of entries. multiWatch jobs read temp files, so they need a timer.
+static int job_poll_set(struct pollfd *fds, int *fd_tab, int *timeout)
+{
+	int nfds = 2;
+	*timeout = -1;
+	for (int t = 0; t < tab_count; t++)
+	{
+		Job *job = &tabs[t]->job;
+		if (job->state == JOB_IDLE)
+			continue;
+		if (job->mw)
+		{
+			*timeout = MW_POLL_INTERVAL;
+		}
+		else if (job->out_fd >= 0)
+		{
+			fds[nfds].fd = job->out_fd;
+			fds[nfds].events = POLLIN;
+			fd_tab[nfds] = t;
+			nfds++;
+		}
+	}
+	return nfds;
+}
+
+// Runs every job one step after wait_for_events() and schedules a frame
+// if the current tab changed.
+static void service_jobs(struct pollfd *fds, int nfds, const int *fd_tab)
+{
+	int dirty = 0;
+
+	for (int i = 2; i < nfds; i++)
+	{
+		// Background tabs are painted too, so a later switch to them is one present
+		if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) && job_read_output(tabs[fd_tab[i]]))
+			dirty = 1;
+	}
+
+	if (sigint_pending)
+	{
+		sigint_pending = 0;
+		job_interrupt(tabs[current_tab]);
+		dirty = 1;
+	}
+	if (sigtstp_pending)
+	{
+		sigtstp_pending = 0;
+		job_stop(tabs[current_tab]);
+	}
+
+	int collect = sigchld_pending;
+	sigchld_pending = 0;
+	if (collect)
+		reap_background_processes();
+
+	for (int t = 0; t < tab_count; t++)
+	{
+		Tab *tab = tabs[t];
+		int changed = 0;
+		if (tab->job.state == JOB_IDLE)
+			continue;
+		if (tab->job.mw)
+			changed |= job_read_output(tab);
+		if (collect)
+		{
+			job_collect(tab);
+			changed |= tab->job.state == JOB_IDLE; // Suspended
+		}
+		if (job_advance(tab))
+		{
+			if (t == current_tab)
+				request_redraw_now();
+			dirty = 1;
+		}
+		if (changed)
+			dirty = 1;
+	}
+	if (dirty)
+		request_redraw();
+}
+
+// Line Navigation
+// Moves the view by delta wrapped rows, positive towards older output
+static void scroll_view(Tab *tab, int delta)
+{
+	RowPos top = view_top(tab, visible_rows());
+	if (tab->lines.count == 0)
+		return;
+	move_rows(tab, &top, -delta);
+	tab->view = top;
+	tab->scrolled = 1;
+	view_top(tab, visible_rows());
+}
+
+// The command the view is on: the one last jumped to if the view has not
+// moved since, else the one whose prompt is at or above the top row
+static int command_in_view(Tab *tab, RowPos top)
+{
+	CommandIndex *ci = &tab->commands;
+	if (ci->cursor >= ci->first && ci->cursor < ci->count &&
+		top.seq == ci->cursor_top.seq && top.row == ci->cursor_top.row)
+		return ci->cursor;
+	return -1;
+}
+
+// Ctrl+Up/Ctrl+Down: brings the previous or next command's prompt to the
+// top of the view. Past the newest command the view follows the bottom.
+static void command_jump(Tab *tab, int dir)
+{
+	CommandIndex *ci = &tab->commands;
+	Scrollback *sb = &tab->lines;
+	if (ci->count == ci->first || sb->count == 0)
+		return;
+	RowPos top = view_top(tab, visible_rows());
+	int i = command_in_view(tab, top);
+	if (i >= 0)
+	{
+		i += dir;
+	}
+	else if (!tab->scrolled && dir > 0)
+	{
+		return;
+	}
+	else
+	{
+		i = command_at(tab, top.seq);
+		if (dir > 0)
+			i++;
+		else if (i >= ci->first && ci->recs[i].prompt_seq >= top.seq && top.row == 0)
+			i--;
+	}
+
+	if (i < ci->first)
+		i = ci->first;
+	if (i >= ci->count)
+	{
+		tab->scrolled = 0;
+		ci->cursor = -1;
+		return;
+	}
+	long long seq = ci->recs[i].prompt_seq;
+	tab->view = (RowPos){seq > sb->first_seq ? seq : sb->first_seq, 0};
+	tab->scrolled = 1;
+	ci->cursor = i;
+	ci->cursor_top = view_top(tab, visible_rows());
+}
+
+// Ctrl+O: collapses or expands the output of the command in view, or of
+// the last finished command when following the bottom
+static void command_toggle_fold(Tab *tab)
+{
+	CommandIndex *ci = &tab->commands;
+	Scrollback *sb = &tab->lines;
+	if (ci->count == ci->first || sb->count == 0)
+		return;
+	RowPos top = view_top(tab, visible_rows());
+	int i = command_in_view(tab, top);
+	if (i < 0)
+		i = tab->scrolled ? command_at(tab, top.seq) : ci->count - 1;
+	if (i >= ci->first && ci->recs[i].end_seq < 0)
+		i--;
+	if (i < ci->first)
+		return;
+
+	CommandRecord *rec = &ci->recs[i];
+	if (!rec->collapsed && rec->end_seq - fold_anchor(tab, rec) < 2)
+		return; // Nothing worth hiding
+	fold_set(tab, rec, !rec->collapsed);
+	if (tab->scrolled)
+	{
+		long long seq = rec->prompt_seq;
+		tab->view = (RowPos){seq > sb->first_seq ? seq : sb->first_seq, 0};
+	}
+	ci->cursor = i;
+	ci->cursor_top = view_top(tab, visible_rows());
+}
+
+static void move_cursor_start(Tab *tab)
+{
+	tab->in_pos = 0;
+}
+
+static void move_cursor_end(Tab *tab)
+{
+	tab->in_pos = strlen(tab->input_buf);
+}
+
+// Signal Handling
+// SIGINT/SIGTSTP sent to MyTerm itself act like Ctrl+C/Ctrl+Z on the
+// current tab; the main loop does the work outside the handler.
+static void sigint_handler(int sig)
+{
+	(void)sig;
+	sigint_pending = 1;
+	wake_main_loop();
+}
+
+static void sigtstp_handler(int sig)
+{
+	(void)sig;
+	sigtstp_pending = 1;
+	wake_main_loop();
+}
+
+static void find_matching_files(Tab *tab, const char *prefix)
+{
+	tab->auto_complete_count = 0;
+	DIR *dir = opendir(".");
+	if (!dir)
+		return;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL && tab->auto_complete_count < 100)
+	{
+		if (strncmp(entry->d_name, prefix, strlen(prefix)) == 0)
+		{
+			tab->auto_complete_list[tab->auto_complete_count++] = arena_strdup(&tab->scratch, entry->d_name);
+		}
+	}
+	closedir(dir);
+}
+
+static char *find_common_prefix(Tab *tab)
+{
+	if (tab->auto_complete_count == 0)
+		return NULL;
+	int min_len = strlen(tab->auto_complete_list[0]);
+	for (int i = 1; i < tab->auto_complete_count; i++)
+	{
+		int len = strlen(tab->auto_complete_list[i]);
+		if (len < min_len)
+			min_len = len;
+	}
+	for (int pos = 0; pos < min_len; pos++)
+	{
+		char c = tab->auto_complete_list[0][pos];
+		for (int i = 1; i < tab->auto_complete_count; i++)
+		{
+			if (tab->auto_complete_list[i][pos] != c)
+			{
+				char *prefix = arena_alloc(&tab->scratch, pos + 1);
+				if (!prefix)
+					return NULL;
+				strncpy(prefix, tab->auto_complete_list[0], pos);
+				prefix[pos] = '\0';
+				return prefix;
+			}
+		}
+	}
+	char *prefix = arena_alloc(&tab->scratch, min_len + 1);
+	if (!prefix)
+		return NULL;
+	strncpy(prefix, tab->auto_complete_list[0], min_len);
+	prefix[min_len] = '\0';
+	return prefix;
+}
+
+static void handle_auto_complete(Tab *tab)
+{
+	// Find the current word being typed
+	char current_word[BUFSIZE] = {0};
+	int word_start = tab->in_pos;
+
+	// Find the start of the current word
+	while (word_start > 0 && tab->input_buf[word_start - 1] != ' ' &&
+		   tab->input_buf[word_start - 1] != '\n' &&
+		   tab->input_buf[word_start - 1] != '|' &&
+		   tab->input_buf[word_start - 1] != '>' &&
+		   tab->input_buf[word_start - 1] != '<' &&
+		   tab->input_buf[word_start - 1] != '&')
+	{
+		word_start--;
+	}
+
+	int word_len = tab->in_pos - word_start;
+
+	if (word_len <= 0)
+	{
+		// If no word to complete, show all files
+		strcpy(current_word, "");
+	}
+	else
+	{
+		strncpy(current_word, tab->input_buf + word_start, word_len);
+		current_word[word_len] = '\0';
+	}
+
+	// Clear previous auto-complete list
+	tab->auto_complete_count = 0;
+	arena_reset(&tab->scratch);
+
+	// Find matching files in current directory
+	DIR *dir = opendir(tab->current_directory);
+	if (!dir)
+	{
+		// Fallback to current working directory if tab directory fails
+		dir = opendir(".");
+	}
+
+	if (!dir)
+	{
+		add_line_to_tab(tab, "Error: Cannot open directory for auto-completion");
+		return;
+	}
+
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL && tab->auto_complete_count < 100)
+	{
+		// Skip hidden files unless the current word starts with '.'
+		if (entry->d_name[0] == '.' && current_word[0] != '.')
+		{
+			continue;
+		}
+
+		// Check if this entry matches our current word
+		if (strncmp(entry->d_name, current_word, word_len) == 0)
+		{
+			tab->auto_complete_list[tab->auto_complete_count++] = arena_strdup(&tab->scratch, entry->d_name);
+		}
+	}
+	closedir(dir);
+
+	if (tab->auto_complete_count == 0)
+	{
+		// No matches found
+		return;
+	}
+	else if (tab->auto_complete_count == 1)
+	{
+		// Single match - complete it
+		char *match = tab->auto_complete_list[0];
+		int match_len = strlen(match);
+		int remaining_len = match_len - word_len;
+
+		int input_len = strlen(tab->input_buf);
+		if (remaining_len > 0 && reserve_text(&tab->input_buf, &tab->input_cap, input_len + remaining_len + 1))
+		{
+			// Insert the remaining part of the filename
+			memmove(tab->input_buf + tab->in_pos + remaining_len,
+					tab->input_buf + tab->in_pos,
+					strlen(tab->input_buf + tab->in_pos) + 1);
+
+			memcpy(tab->input_buf + tab->in_pos, match + word_len, remaining_len);
+			tab->in_pos += remaining_len;
+
+			// Add a space if it's a complete word (not a partial path)
+			tab->input_buf[tab->in_pos] = ' ';
+			tab->in_pos++;
+			tab->input_buf[tab->in_pos] = '\0';
+		}
+
+		tab->auto_complete_count = 0;
+	}
+	else
+	{
+		// Multiple matches
+		char *common_prefix = find_common_prefix(tab);
+
+		if (common_prefix && strlen(common_prefix) > word_len)
+		{
+			// Complete to common prefix
+			int common_len = strlen(common_prefix);
+			int remaining_len = common_len - word_len;
+
+			int input_len = strlen(tab->input_buf);
+			if (remaining_len > 0 && reserve_text(&tab->input_buf, &tab->input_cap, input_len + remaining_len))
+			{
+				memmove(tab->input_buf + tab->in_pos + remaining_len,
+						tab->input_buf + tab->in_pos,
+						strlen(tab->input_buf + tab->in_pos) + 1);
+
+				memcpy(tab->input_buf + tab->in_pos, common_prefix + word_len, remaining_len);
+				tab->in_pos += remaining_len;
+				tab->input_buf[tab->in_pos] = '\0';
+			}
+		}
+		else
+		{
+			add_line_to_tab(tab, "Multiple matches:");
+
+			for (int i = 0; i < tab->auto_complete_count - 1; i++)
+			{
+				for (int j = i + 1; j < tab->auto_complete_count; j++)
+				{
+					if (strcasecmp(tab->auto_complete_list[i], tab->auto_complete_list[j]) > 0)
+					{
 						char *temp = tab->auto_complete_list[i];
 						tab->auto_complete_list[i] = tab->auto_complete_list[j];
 						tab->auto_complete_list[j] = temp;
@@ -1071,808 +6155,1513 @@ static void handle_auto_complete(Tab *tab)
 				}
 			}
 
-			int max_per_line = 2;
-			int items_per_col = (tab->auto_complete_count + max_per_line - 1) / max_per_line;
-
-			for (int row = 0; row < items_per_col; row++)
+			int max_per_line = 2;
+			int items_per_col = (tab->auto_complete_count + max_per_line - 1) / max_per_line;
+
+			for (int row = 0; row < items_per_col; row++)
+			{
+				char line[BUFSIZE] = "";
+				int line_len = 0;
+
+				for (int col = 0; col < max_per_line; col++)
+				{
+					int index = row + col * items_per_col;
+					if (index < tab->auto_complete_count)
+					{
+						char item[256];
+						// Add indicator for directories
+						char full_path[BUFSIZE];
+						// Safe path construction - use filename only to avoid path length issues
+						strncpy(full_path, tab->auto_complete_list[index], sizeof(full_path) - 1);
+						full_path[sizeof(full_path) - 1] = '\0';
+
+						struct stat st;
+						int is_dir = 0;
+						if (stat(full_path, &st) == 0 && S_ISDIR(st.st_mode))
+						{
+							is_dir = 1;
+						}
+
+						if (is_dir)
+						{
+							snprintf(item, sizeof(item), "%-30s/", tab->auto_complete_list[index]);
+						}
+						else
+						{
+							snprintf(item, sizeof(item), "%-30s", tab->auto_complete_list[index]);
+						}
+
+						// Check if we have space in the line
+						if (line_len + strlen(item) < sizeof(line) - 10)
+						{
+							strcat(line, item);
+							line_len += strlen(item);
+						}
+					}
+				}
+
+				if (strlen(line) > 0)
+				{
+					add_line_to_tab(tab, line);
+				}
+			}
+		}
+
+		// Clean up auto-complete list
+		tab->auto_complete_count = 0;
+	}
+}
+
+/* -------------------- Command Execution -------------------- */
+static void execute_command(Tab *tab, const char *cmdline)
+{
+	if (!cmdline || strlen(cmdline) == 0)
+		return;
+
+	// Nothing from the previous command is needed any more
+	arena_reset(&tab->scratch);
+	tab->auto_complete_count = 0;
+	tab->builtin_status = 0;
+
+	// Save to file-based history
+	save_to_history(cmdline);
+
+	if (strncmp(cmdline, "history", 7) == 0 && (cmdline[7] == '\0' || cmdline[7] == ' '))
+	{
+		history_command(tab, cmdline + 7);
+		return;
+	}
+
+	if (strncmp(cmdline, "cd", 2) == 0 && (cmdline[2] == ' ' || cmdline[2] == '\0'))
+	{
+		const char *path = cmdline + 2;
+		while (*path == ' ')
+			path++;
+		if (*path == '\0')
+		{
+			path = getenv("HOME");
+			if (!path)
+				path = "/";
+		}
+
+		// Store the current directory before changing
+		char old_cwd[BUFSIZE];
+		if (getcwd(old_cwd, sizeof(old_cwd)) == NULL)
+		{
+			strcpy(old_cwd, "unknown");
+		}
+
+		if (chdir(path) == -1)
+		{
+			char errbuf[256];
+			snprintf(errbuf, sizeof(errbuf), "cd: %s", strerror(errno));
+			add_line_to_tab(tab, errbuf);
+			tab->builtin_status = 1;
+		}
+		else
+		{
+			// Update tab's current directory
+			char *cwd = getcwd(NULL, 0);
+			if (!cwd)
+				cwd = strdup(path); // Fallback
+			if (cwd)
+			{
+				free(tab->current_directory);
+				tab->current_directory = cwd;
+			}
+			char okbuf[256];
+			int len = strlen(tab->current_directory);
+			if (len > 200)
+			{
+				// Truncate very long directory names
+				snprintf(okbuf, sizeof(okbuf), "[changed directory to ...%.200s]", tab->current_directory + (len - 200));
+			}
+			else
+			{
+				snprintf(okbuf, sizeof(okbuf), "[changed directory to %.200s]", tab->current_directory);
+			}
+			add_line_to_tab(tab, okbuf);
+		}
+		return;
+	}
+
+	if (strcmp(cmdline, "fg") == 0)
+	{
+		if (tab->suspended_count == 0)
+		{
+			add_line_to_tab(tab, "fg: no suspended jobs");
+			tab->builtin_status = 1;
+			return;
+		}
+
+		// Get the most recently suspended process
+		int last_index = tab->suspended_count - 1;
+		SuspendedProcess *sp = &tab->suspended_processes[last_index];
+		pid_t pid_to_resume = sp->pid;
+
+		if (kill(-pid_to_resume, SIGCONT) == -1)
+		{
+			char errbuf[256];
+			snprintf(errbuf, sizeof(errbuf), "fg: cannot resume [%d]: %s", pid_to_resume, strerror(errno));
+			add_line_to_tab(tab, errbuf);
+			tab->builtin_status = 1;
+			// Remove the process from suspended list since it's gone
+			if (sp->out_fd >= 0)
+				close(sp->out_fd);
+			free(sp->command);
+			tab->suspended_count--;
+			return;
+		}
+
+		char msg[256];
+		// Truncate long commands for display
+		char truncated_cmd[200];
+		strncpy(truncated_cmd, tab->suspended_processes[last_index].command, sizeof(truncated_cmd) - 1);
+		truncated_cmd[sizeof(truncated_cmd) - 1] = '\0';
+		if (strlen(tab->suspended_processes[last_index].command) > sizeof(truncated_cmd) - 1)
+		{
+			strcpy(truncated_cmd + sizeof(truncated_cmd) - 4, "...");
+		}
+		snprintf(msg, sizeof(msg), "Resumed [%d]: %s", pid_to_resume, truncated_cmd);
+		add_line_to_tab(tab, msg);
+
+		// Make it the tab's running job again and remove it from the list
+		job_start(tab, sp->pid, sp->last_pid, sp->out_fd, sp->command);
+		free(sp->command);
+		tab->job.state = JOB_STREAMING;
+		tab->suspended_count--;
+		return;
+	}
+
+	if (strcmp(cmdline, "stats") == 0)
+	{
+		show_draw_stats(tab);
+		return;
+	}
+
+	if (strcmp(cmdline, "jobs") == 0)
+	{
+		if (tab->suspended_count == 0)
+		{
+			add_line_to_tab(tab, "No suspended jobs");
+			return;
+		}
+
+		add_line_to_tab(tab, "Suspended jobs:");
+		for (int i = 0; i < tab->suspended_count; i++)
+		{
+			char job_info[256];
+			// Truncate long commands for display
+			char truncated_cmd[200];
+			strncpy(truncated_cmd, tab->suspended_processes[i].command, sizeof(truncated_cmd) - 1);
+			truncated_cmd[sizeof(truncated_cmd) - 1] = '\0';
+			if (strlen(tab->suspended_processes[i].command) > sizeof(truncated_cmd) - 1)
+			{
+				strcpy(truncated_cmd + sizeof(truncated_cmd) - 4, "...");
+			}
+			snprintf(job_info, sizeof(job_info), "[%d] %d %s",
+					 i + 1,
+					 tab->suspended_processes[i].pid,
+					 truncated_cmd);
+			add_line_to_tab(tab, job_info);
+		}
+		return;
+	}
+
+	if (strncmp(cmdline, "multiWatch", 10) == 0)
+	{
+		const char *args = cmdline + 10;
+		while (*args == ' ')
+			args++;
+		multiWatch_runner(tab, args);
+		return;
+	}
+
+	if (strcmp(cmdline, "exit") == 0)
+	{
+		command_end(tab, 0);
+		add_line_to_tab(tab, "Closing MyTerm...");
+		redraw();
+		sleep(1);
+		XCloseDisplay(dpy);
+		exit(0);
+	}
+
+	// Check for background process (ending with &)
+	int run_in_background = 0;
+	char *clean_cmdline = arena_strdup(&tab->scratch, cmdline);
+	if (!clean_cmdline)
+	{
+		add_line_to_tab(tab, "Error: Out of memory");
+		tab->builtin_status = 1;
+		return;
+	}
+
+	// Remove trailing spaces and check for &
+	char *end = clean_cmdline + strlen(clean_cmdline) - 1;
+	while (end > clean_cmdline && (*end == ' ' || *end == '\t'))
+	{
+		end--;
+	}
+	if (end > clean_cmdline && *end == '&')
+	{
+		run_in_background = 1;
+		*end = '\0';
+		// Remove any spaces before the &
+		end--;
+		while (end > clean_cmdline && (*end == ' ' || *end == '\t'))
+		{
+			*end = '\0';
+			end--;
+		}
+	}
+
+	// The tab's shell runs pipes and redirections itself
+	if (persistent_shell && !run_in_background)
+	{
+		int err = shell_run(tab, clean_cmdline);
+		if (err)
+		{
+			char msg[256];
+			snprintf(msg, sizeof(msg), "MyTerm: cannot start the tab's shell: %s", strerror(err));
+			add_line_to_tab(tab, msg);
+			command_end(tab, 127);
+		}
+		return;
+	}
+
+	// Pipes
+	if (strchr(clean_cmdline, '|'))
+	{
+		char *pipeline = arena_strdup(&tab->scratch, clean_cmdline);
+		if (!pipeline)
+		{
+			add_line_to_tab(tab, "Error: Out of memory");
+			tab->builtin_status = 1;
+			return;
+		}
+		char *commands[64];
+		int ncmd = 0;
+		char *tok = strtok(pipeline, "|");
+		while (tok && ncmd < 64)
+		{
+			while (*tok == ' ' || *tok == '\t')
+				tok++;
+			char *end = tok + strlen(tok) - 1;
+			while (end >= tok && (*end == ' ' || *end == '\t' || *end == '\n'))
+			{
+				*end = '\0';
+				end--;
+			}
+			commands[ncmd++] = tok;
+			tok = strtok(NULL, "|");
+		}
+		if (ncmd == 0)
+			return;
+
+		int pipes[64][2];
+		for (int i = 0; i < ncmd - 1; ++i)
+		{
+			if (launch_pipe(pipes[i]) == -1)
+			{
+				perror("pipe");
+				return;
+			}
+		}
+		int gui_pipe[2];
+		if (launch_pipe(gui_pipe) == -1)
+		{
+			perror("pipe gui");
+			for (int i = 0; i < ncmd - 1; ++i)
+			{
+				close(pipes[i][0]);
+				close(pipes[i][1]);
+			}
+			return;
+		}
+
+		pid_t pids[64];
+		int started = 0, err = 0;
+		LaunchSpec ls;
+		for (int i = 0; i < ncmd; ++i)
+		{
+			// Every stage joins the first stage's process group. The first
+			// reads nothing, the last writes to MyTerm, stderr included.
+			ls = (LaunchSpec){.in_path = i == 0 ? "/dev/null" : NULL,
+							 .in_fd = i > 0 ? pipes[i - 1][0] : -1,
+							 .out_fd = i < ncmd - 1 ? pipes[i][1] : gui_pipe[1],
+							 .err_to_out = i == ncmd - 1,
+							 .pgid = i > 0 ? pids[0] : 0};
+			err = launch_command(tab, commands[i], &ls, &pids[i]);
+			if (err)
+				break;
+			started++;
+			if (run_in_background)
 			{
-				char line[BUFSIZE] = "";
-				int line_len = 0;
-
-				for (int col = 0; col < max_per_line; col++)
-				{
-					int index = row + col * items_per_col;
-					if (index < tab->auto_complete_count)
-					{
-						char item[256];
-						// Add indicator for directories
-						char full_path[BUFSIZE];
-						// Safe path construction - use filename only to avoid path length issues
-						strncpy(full_path, tab->auto_complete_list[index], sizeof(full_path) - 1);
-						full_path[sizeof(full_path) - 1] = '\0';
-
-						struct stat st;
-						int is_dir = 0;
-						if (stat(full_path, &st) == 0 && S_ISDIR(st.st_mode))
-						{
-							is_dir = 1;
-						}
-
-						if (is_dir)
-						{
-							snprintf(item, sizeof(item), "%-30s/", tab->auto_complete_list[index]);
-						}
-						else
-						{
-							snprintf(item, sizeof(item), "%-30s", tab->auto_complete_list[index]);
-						}
-
-						// Check if we have space in the line
-						if (line_len + strlen(item) < sizeof(line) - 10)
-						{
-							strcat(line, item);
-							line_len += strlen(item);
-						}
-					}
-				}
-
-				if (strlen(line) > 0)
+				// Add to background processes
+				if (tab->bg_pid_count < 10)
 				{
-					add_line_to_tab(tab, line);
+					tab->background_pids[tab->bg_pid_count++] = pids[i];
+					char msg[256];
+					snprintf(msg, sizeof(msg), "[%d] running in background", pids[i]);
+					add_line_to_tab(tab, msg);
 				}
 			}
+		}
+		for (int i = 0; i < ncmd - 1; ++i)
+		{
+			close(pipes[i][0]);
+			close(pipes[i][1]);
+		}
+		close(gui_pipe[1]);
 
-			if (common_prefix)
-				free(common_prefix);
+		if (err)
+		{
+			// A half-built pipeline is no use: stop the stages that did start
+			int status = launch_failed(tab, commands[started], &ls, err);
+			if (started > 0)
+				kill(-pids[0], SIGKILL);
+			while (started > 0 && !run_in_background && waitpid(-pids[0], NULL, 0) > 0)
+				;
+			close(gui_pipe[0]);
+			command_end(tab, status);
+		}
+		else if (!run_in_background)
+		{
+			// The main loop streams the output from here on
+			job_start(tab, pids[0], pids[ncmd - 1], gui_pipe[0], clean_cmdline);
+		}
+		else
+		{
+			close(gui_pipe[0]);
+			// Don't wait for background processes
 		}
+		return;
+	}
 
-		// Clean up auto-complete list
-		for (int i = 0; i < tab->auto_complete_count; i++)
+	// Handle redirection and regular commands with proper output capture
+	char *input_file = NULL;
+	char *output_file = NULL;
+	char *cmd_copy = arena_strdup(&tab->scratch, clean_cmdline);
+	if (!cmd_copy)
+	{
+		add_line_to_tab(tab, "Error: Out of memory");
+		tab->builtin_status = 1;
+		return;
+	}
+
+	char *input_redir = strchr(cmd_copy, '<');
+	char *output_redir = strchr(cmd_copy, '>');
+	if (input_redir)
+	{
+		*input_redir = '\0';
+		input_file = input_redir + 1;
+		while (*input_file == ' ')
+			input_file++;
+		char *end = input_file + strlen(input_file) - 1;
+		while (end >= input_file && (*end == ' ' || *end == '\n' || *end == '\r'))
+		{
+			*end = '\0';
+			end--;
+		}
+	}
+	if (output_redir)
+	{
+		*output_redir = '\0';
+		output_file = output_redir + 1;
+		while (*output_file == ' ')
+			output_file++;
+		char *end = output_file + strlen(output_file) - 1;
+		while (end >= output_file && (*end == ' ' || *end == '\n' || *end == '\r'))
 		{
-			free(tab->auto_complete_list[i]);
+			*end = '\0';
+			end--;
 		}
-		tab->auto_complete_count = 0;
 	}
-}
 
-/* -------------------- Command Execution -------------------- */
-static void execute_command(Tab *tab, const char *cmdline)
-{
-	if (!cmdline || strlen(cmdline) == 0)
+	char *trimmed_cmd = cmd_copy;
+	while (*trimmed_cmd == ' ')
+		trimmed_cmd++;
+	char *end_cmd = trimmed_cmd + strlen(trimmed_cmd) - 1;
+	while (end_cmd >= trimmed_cmd && (*end_cmd == ' ' || *end_cmd == '\n' || *end_cmd == '\r'))
+	{
+		*end_cmd = '\0';
+		end_cmd--;
+	}
+
+	if (strlen(trimmed_cmd) == 0)
+	{
+		if (input_file || output_file)
+		{
+			add_line_to_tab(tab, "Error: Redirection specified but no command given");
+		}
 		return;
+	}
 
-	// Save to file-based history
-	save_to_history(cmdline);
+	int output_pipe[2];
+	if (launch_pipe(output_pipe) == -1)
+	{
+		perror("pipe");
+		return;
+	}
 
-	if (strcmp(cmdline, "history") == 0)
+	// Output, errors included, goes to the file if there is one, else to the tab
+	LaunchSpec ls = {.in_path = input_file,
+					 .in_fd = -1,
+					 .out_path = output_file,
+					 .out_fd = output_file ? -1 : output_pipe[1],
+					 .err_to_out = 1};
+	pid_t pid;
+	int err = launch_command(tab, trimmed_cmd, &ls, &pid);
+	close(output_pipe[1]);
+	if (err)
 	{
-		show_history_from_file(tab);
+		close(output_pipe[0]);
+		command_end(tab, launch_failed(tab, trimmed_cmd, &ls, err));
 		return;
 	}
 
-	if (strncmp(cmdline, "cd", 2) == 0 && (cmdline[2] == ' ' || cmdline[2] == '\0'))
+	if (run_in_background)
 	{
-		const char *path = cmdline + 2;
-		while (*path == ' ')
-			path++;
-		if (*path == '\0')
+		// Add to background processes
+		if (tab->bg_pid_count < 10)
 		{
-			path = getenv("HOME");
-			if (!path)
-				path = "/";
+			tab->background_pids[tab->bg_pid_count++] = pid;
+			char msg[256];
+			snprintf(msg, sizeof(msg), "[%d] running in background", pid);
+			add_line_to_tab(tab, msg);
 		}
+		close(output_pipe[0]);
+	}
+	else
+	{
+		// The main loop streams the output from here on
+		job_start(tab, pid, pid, output_pipe[0], trimmed_cmd);
+	}
+}
 
-		// Store the current directory before changing
-		char old_cwd[BUFSIZE];
-		if (getcwd(old_cwd, sizeof(old_cwd)) == NULL)
+/* -------------------- Benchmarks -------------------- */
+// Synthetic command output: path-like lines of varying length plus some
+// blank lines, fed through the framer in pipe-sized reads.
+static void bench_framer()
+{
+	size_t total = 256 * 1024 * 1024;
+	char *data = malloc(total);
+	if (!data)
+	{
+		fprintf(stderr, "bench: out of memory\n");
+		return;
+	}
+
+	size_t pos = 0;
+	unsigned seed = 12345;
+	while (pos < total)
+	{
+		seed = seed * 1103515245 + 12345;
+		int len = (seed >> 16) % 160;
+		if (len < 8)
+			len = 0;
+		for (int i = 0; i < len && pos < total; i++)
+			data[pos++] = (i % 9 == 0) ? '/' : 'a' + (i + len) % 26;
+		if (pos < total)
+			data[pos++] = '\n';
+	}
+
+	size_t read_sizes[] = {4096, 65536};
+	for (int r = 0; r < 2; r++)
+	{
+		static Scrollback sb;
+		LineFramer framer;
+		scrollback_init(&sb);
+		framer_init(&framer);
+
+		double t0 = now_seconds();
+		for (size_t off = 0; off < total; off += read_sizes[r])
 		{
-			strcpy(old_cwd, "unknown");
+			size_t n = total - off < read_sizes[r] ? total - off : read_sizes[r];
+			framer_feed(&framer, &sb, data + off, n);
 		}
+		framer_flush(&framer, &sb);
+		double dt = now_seconds() - t0;
 
-		if (chdir(path) == -1)
+		printf("framer: %zu MB in %zu-byte reads: %.1f MB/s\n",
+			   total >> 20, read_sizes[r], (total / 1048576.0) / dt);
+		scrollback_free(&sb);
+	}
+
+	// Newline scan alone
+	size_t lines = 0;
+	double t0 = now_seconds();
+	for (const char *p = data, *end = data + total; (p = memchr(p, '\n', end - p)) != NULL; p++)
+		lines++;
+	double dt = now_seconds() - t0;
+	printf("memchr: %.1f MB/s (%zu lines)\n", (total / 1048576.0) / dt, lines);
+
+	free(data);
+}
+
+static int bench_log_line(char *line, int size, int i, int total, unsigned *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	unsigned module = (*seed >> 8) % 97, file = (*seed >> 16) % 512;
+	return snprintf(line, size, "[%6d/%d] CC src/module_%u/file_%u.c -o build/obj/module_%u/file_%u.o",
+					i, total, module, file, module, file);
+}
+
+// A million build-log lines through one tab's scrollback: append rate,
+// cold storage size, then reading lines back from far up the history
+static void bench_scrollback()
+{
+	static Scrollback sb;
+	scrollback_init(&sb);
+	int total = sb_max_lines;
+	size_t bytes = 0;
+	unsigned seed = 12345;
+	double t0 = now_seconds();
+	for (int i = 0; i < total; i++)
+	{
+		char line[256];
+		int n = bench_log_line(line, sizeof(line), i, total, &seed);
+		scrollback_append(&sb, line, n);
+		bytes += n + 1;
+	}
+	double dt = now_seconds() - t0;
+	ColdStore *cs = &sb.cold;
+	printf("scrollback: %d lines (%.1f MB) appended at %.1f MB/s, %d held\n",
+		   total, bytes / 1048576.0, (bytes / 1048576.0) / dt, sb.count);
+	printf("scrollback: cold %.1f MB packed to %.1f MB in memory + %.1f MB spilled (%.1fx)\n",
+		   cs->raw_bytes / 1048576.0, cs->mem_bytes / 1048576.0, cs->spill_bytes / 1048576.0,
+		   cs->mem_bytes + cs->spill_bytes ? (double)cs->raw_bytes / (cs->mem_bytes + cs->spill_bytes) : 0.0);
+
+	// A screenful at a time from random places, like jumping with the scrollbar
+	int cold = sb.count - sb.hot, reads = 2000;
+	size_t check = 0;
+	t0 = now_seconds();
+	for (int i = 0; i < reads && cold > 0; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		int at = (seed >> 4) % cold;
+		for (int r = 0; r < 40 && at + r < sb.count; r++)
+			check += scrollback_line(&sb, at + r)->len;
+	}
+	dt = now_seconds() - t0;
+	printf("scrollback: random screenful from cold storage: %.1f us (%zu)\n", dt * 1e6 / reads, check);
+
+	// Paging up through the whole history
+	t0 = now_seconds();
+	for (int i = sb.count - 1; i >= 0; i--)
+		check += scrollback_line(&sb, i)->len;
+	dt = now_seconds() - t0;
+	printf("scrollback: scrolled through all lines at %.1f M lines/s\n", sb.count / dt / 1e6);
+	scrollback_free(&sb);
+}
+
+// Fills buf with n bytes of one kind of codec test data
+static void codec_sample(unsigned char *buf, int n, int kind, unsigned *seed)
+{
+	for (int i = 0; i < n; i++)
+	{
+		*seed = *seed * 1103515245 + 12345;
+		unsigned r = *seed >> 8;
+		switch (kind)
 		{
-			char errbuf[256];
-			snprintf(errbuf, sizeof(errbuf), "cd: %s", strerror(errno));
-			add_line_to_tab(tab, errbuf);
+		case 0: // Incompressible
+			buf[i] = r;
+			break;
+		case 1: // One long run
+			buf[i] = 0;
+			break;
+		case 2: // A short pattern, overlapping matches
+			buf[i] = "abcabd"[i % (1 + n % 6)];
+			break;
+		case 3: // Literal and match lengths around the 15 and 255 escapes
+			buf[i] = (i / (14 + n % 3) + i / 255) % 2 ? r : 'x';
+			break;
+		default: // Random, then repeated from just inside and outside 64 KiB back
+			buf[i] = i < 65536 + 64 ? r : buf[i - 65535 - (int)(r % 3)];
+			break;
 		}
-		else
+	}
+}
+
+// Round trips of the cold store codec: buffers of each kind and awkward
+// sizes compress and unpack to the same bytes, damaged input is refused or
+// at least stays in bounds, and lines of every sort come back from cold
+// segments and the spill file unchanged. Returns the number of failures.
+static int bench_codec()
+{
+	static const int sizes[] = {0, 1, 3, 4, 5, 15, 16, 19, 255, 256, 270, 4096, 65535, 65536, 65600, 140000, 300000};
+	const int nsizes = sizeof(sizes) / sizeof(sizes[0]);
+	int max = sizes[nsizes - 1];
+	unsigned char *src = malloc(max), *packed = malloc(lz_bound(max));
+	if (!src || !packed)
+	{
+		fprintf(stderr, "bench: out of memory\n");
+		return 1;
+	}
+
+	unsigned seed = 12345;
+	int failures = 0, buffers = 0, damaged = 0, refused = 0;
+	for (int kind = 0; kind < 5; kind++)
+	{
+		for (int i = 0; i < nsizes; i++)
 		{
-			// Update tab's current directory
-			if (getcwd(tab->current_directory, sizeof(tab->current_directory)) == NULL)
+			int n = sizes[i];
+			codec_sample(src, n, kind, &seed);
+			int size = lz_compress(src, n, packed);
+			// Exactly n bytes, so a memory checker catches any overrun
+			unsigned char *out = malloc(n ? n : 1);
+			if (!out)
+				break;
+			buffers++;
+			if (size > lz_bound(n) || !lz_decompress(packed, size, out, n) || memcmp(src, out, n) != 0)
 			{
-				strcpy(tab->current_directory, path); // Fallback
+				printf("codec: FAIL kind %d, %d bytes (packed %d)\n", kind, n, size);
+				failures++;
 			}
-			char okbuf[256];
-			int len = strlen(tab->current_directory);
-			if (len > 200)
+			// Unpacking to the wrong size must fail, and flipped bytes must
+			// not write past the output
+			else if (n > 0 && lz_decompress(packed, size, out, n - 1))
 			{
-				// Truncate very long directory names
-				snprintf(okbuf, sizeof(okbuf), "[changed directory to ...%.200s]", tab->current_directory + (len - 200));
+				printf("codec: FAIL kind %d, %d bytes unpacked into %d\n", kind, n, n - 1);
+				failures++;
 			}
-			else
+			for (int k = 0; k < 50 && size > 0; k++)
 			{
-				snprintf(okbuf, sizeof(okbuf), "[changed directory to %.200s]", tab->current_directory);
+				seed = seed * 1103515245 + 12345;
+				int at = (seed >> 8) % size;
+				packed[at] ^= 1 + (seed >> 20) % 255;
+				damaged++;
+				refused += !lz_decompress(packed, size, out, n);
+				lz_compress(src, n, packed);
 			}
-			add_line_to_tab(tab, okbuf);
+			free(out);
 		}
-		return;
 	}
+	printf("codec: %d buffers round-tripped, %d failures; %d of %d damaged blocks refused\n",
+		   buffers, failures, refused, damaged);
+
+	// Lines through a scrollback, in memory and then spilled to disk
+	char tmp_dir[] = "/tmp/myterm-codec-XXXXXX";
+	const char *dirs[] = {NULL, mkdtemp(tmp_dir)};
+	size_t budget = sb_memory_budget;
+	const char *spill = sb_spill_dir;
+	const int nlines = 5000;
+	char **lines = calloc(nlines, sizeof(char *));
+	int *lens = calloc(nlines, sizeof(int));
+	for (int pass = 0; pass < 2 && lines && lens; pass++)
+	{
+		static Scrollback sb;
+		if (pass == 1 && !dirs[1])
+		{
+			printf("codec: no temporary directory, spill skipped\n");
+			break;
+		}
+		sb_spill_dir = dirs[pass];
+		sb_memory_budget = pass ? 64 << 10 : budget;
+		scrollback_init(&sb);
+		int bad = 0;
+		for (int i = 0; i < nlines; i++)
+		{
+			seed = seed * 1103515245 + 12345;
+			int kind = (seed >> 8) % 6;
+			int n = kind == 0 ? 0 : kind == 1 ? SB_CHUNK_SIZE - 1 : kind == 2 ? LINE_SPLIT : (seed >> 12) % 300;
+			free(lines[i]);
+			lines[i] = malloc(n + 1);
+			if (!lines[i])
+				break;
+			// Binary lines with NULs, UTF-8, and text that compresses
+			codec_sample((unsigned char *)lines[i], n, kind == 3 ? 0 : kind == 4 ? 2 : 3, &seed);
+			if (kind == 5)
+				for (int k = 0; k + 4 <= n; k += 4)
+					memcpy(lines[i] + k, "\xe2\x82\xac ", 4);
+			lens[i] = n;
+			scrollback_append(&sb, lines[i], n);
+		}
+		for (int i = 0; i < sb.count; i++)
+		{
+			long long seq = sb.first_seq + i;
+			Line *ln = scrollback_line(&sb, i);
+			if (ln->len != lens[seq] || memcmp(ln->text, lines[seq], ln->len) != 0 || ln->text[ln->len] != '\0')
+				bad++;
+		}
+		printf("codec: %d lines, %d cold in %d segments, %.1f MB spilled: %d differ\n", sb.count,
+			   sb.count - sb.hot, sb.cold.nsegs - sb.cold.first, sb.cold.spill_bytes / 1048576.0, bad);
+		failures += bad;
+		scrollback_free(&sb);
+	}
+	if (dirs[1])
+		rmdir(dirs[1]);
+	sb_memory_budget = budget;
+	sb_spill_dir = spill;
+	for (int i = 0; lines && i < nlines; i++)
+		free(lines[i]);
+	free(lines);
+	free(lens);
+	free(src);
+	free(packed);
+	return failures;
+}
+
+// The status queued with expected record i. Most make runs succeed, so
+// compaction has repeats to drop.
+static int journal_status(int i)
+{
+	if (i % 100 == 99)
+		return i % 3 == 0 ? 2 : 0;
+	return i % 7 == 0 ? -1 : i % 256;
+}
+
+// Whether record r holds what was queued as expected record i
+static int journal_matches(const HistoryRecord *r, char **cmds, int i)
+{
+	const char *cwd = cmds[i] + strlen(cmds[i]) + 1;
+	return r && r->cmd_len == strlen(cmds[i]) && r->cwd_len == strlen(cwd) &&
+		   memcmp(record_command(r), cmds[i], r->cmd_len) == 0 && memcmp(record_cwd(r), cwd, r->cwd_len) == 0 &&
+		   r->start_ms == (int64_t)i * 1000 && r->duration_ms == (uint32_t)(i % 50) * 1000 &&
+		   r->status == journal_status(i) && r->tab == (uint32_t)(i % 9);
+}
+
+// Checks every record read back through the index, newest first, against
+// the first n queued. Returns how many differ.
+static int journal_verify(char **cmds, int n, const char *stage)
+{
+	HistoryReader rd;
+	if (!reader_open(&rd))
+	{
+		printf("journal: FAIL %s: cannot open\n", stage);
+		return 1;
+	}
+	int bad = rd.count == n ? 0 : 1;
+	for (int k = 0; k < rd.count && k < n; k++)
+		bad += !journal_matches(reader_record(&rd, k), cmds, n - 1 - k);
+	printf("journal: %s: %d records, %d differ\n", stage, rd.count, bad);
+	reader_close(&rd);
+	return bad;
+}
+
+// Whether a compaction must keep record i of the n in recs, oldest first,
+// worked out the slow way
+static int journal_kept(const HistoryRecord **recs, int n, int i)
+{
+	const HistoryRecord *r = recs[i];
+	int latest = 1, slowest = 1;
+	for (int j = 0; j < n; j++)
+	{
+		const HistoryRecord *o = recs[j];
+		if (j == i || o->cmd_len != r->cmd_len || memcmp(record_command(o), record_command(r), r->cmd_len) != 0)
+			continue;
+		if (o->duration_ms > r->duration_ms || (o->duration_ms == r->duration_ms && j > i))
+			slowest = 0;
+		if (j > i && o->status == r->status && o->cwd_len == r->cwd_len &&
+			memcmp(record_cwd(o), record_cwd(r), r->cwd_len) == 0)
+			latest = 0;
+	}
+	return r->status > 0 || latest || slowest;
+}
+
+// The records a compaction of the journal should leave, oldest first and
+// back to back, or NULL
+static char *journal_expected(size_t *len)
+{
+	HistoryReader rd;
+	if (!reader_open(&rd))
+		return NULL;
+	const HistoryRecord **recs = malloc((rd.count + 1) * sizeof(HistoryRecord *));
+	char *want = malloc(rd.data_len + 1);
+	int n = 0;
+	for (int k = rd.count - 1; recs && k >= 0; k--)
+	{
+		if ((recs[n] = reader_record(&rd, k)) != NULL)
+			n++;
+	}
+	*len = 0;
+	for (int i = 0; recs && want && i < n; i++)
+	{
+		if (!journal_kept(recs, n, i))
+			continue;
+		memcpy(want + *len, recs[i], recs[i]->size);
+		*len += recs[i]->size;
+	}
+	if (!recs)
+	{
+		free(want);
+		want = NULL;
+	}
+	free(recs);
+	reader_close(&rd);
+	return want;
+}
 
-	if (strcmp(cmdline, "fg") == 0)
+// Writes records of every shape to a journal in a temporary directory and
+// reads them back: after batched appends, after a record that reached the
+// journal without its index entry and a torn record behind it, and after a
+// compaction. Returns the number of failures.
+static int bench_journal()
+{
+	char dir[] = "/tmp/myterm-journal-XXXXXX", path[PATH_MAX], idx_path[PATH_MAX];
+	if (!mkdtemp(dir))
 	{
-		if (tab->suspended_count == 0)
-		{
-			add_line_to_tab(tab, "fg: no suspended jobs");
-			return;
-		}
-
-		// Get the most recently suspended process
-		int last_index = tab->suspended_count - 1;
-		pid_t pid_to_resume = tab->suspended_processes[last_index].pid;
+		perror("journal");
+		return 1;
+	}
+	snprintf(path, sizeof(path), "%s/history", dir);
+	snprintf(idx_path, sizeof(idx_path), "%s/history.idx", dir);
+	writer.path = path;
+	writer.idx_path = idx_path;
+
+	// Command, NUL, directory, NUL. Empty, long, UTF-8 and multi-line
+	// commands; every 100th repeats so compaction has work.
+	const int n = 5000;
+	char **cmds = calloc(n + 1, sizeof(char *));
+	unsigned seed = 12345;
+	int failures = 0, queued = 0;
+	for (int i = 0; cmds && i < n; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		int len = i % 50 == 0 ? 0 : i % 97 == 0 ? BUFSIZE - 1 : (seed >> 8) % 120;
+		if (!(cmds[i] = malloc(len + 64)))
+			break;
+		for (int k = 0; k < len; k++)
+			cmds[i][k] = i % 3 == 0 && k % 3 == 0 ? (char)("\xc3\xa9\n"[k % 3]) : (char)('a' + (seed >> (k % 16)) % 26);
+		if (i % 100 == 99)
+			len = snprintf(cmds[i], 64, "make -j%d", i % 3);
+		cmds[i][len] = '\0';
+		snprintf(cmds[i] + len + 1, 63, i % 100 == 99 ? "/src" : "/home/user/%d", i);
+		if (!history_queue(cmds[i], cmds[i] + len + 1, i % 9, (int64_t)i * 1000, i % 50, journal_status(i)))
+			break;
+		queued++;
+		if ((seed >> 16) % 40 == 0)
+			history_flush();
+	}
+	history_flush();
+	failures += queued != n || writer.pending_len != 0;
+	failures += journal_verify(cmds, queued, "appended");
 
-		if (kill(pid_to_resume, SIGCONT) == -1)
+	// A crash between the journal and index writes, then a torn record
+	if (queued == n && history_queue(cmds[0], cmds[0] + 1, 0, 0, 0, -1))
+	{
+		int fd = open(path, O_WRONLY | O_APPEND);
+		if (fd < 0 || write(fd, writer.pending, writer.pending_len) != writer.pending_len ||
+			write(fd, writer.pending, sizeof(HistoryRecord) + 1) < 0)
+			failures++;
+		if (fd >= 0)
+			close(fd);
+		writer.pending_len = 0;
+		close(writer.fd);
+		close(writer.idx_fd);
+		writer.fd = writer.idx_fd = -1;
+		if (writer_lock())
 		{
-			char errbuf[256];
-			snprintf(errbuf, sizeof(errbuf), "fg: cannot resume [%d]: %s", pid_to_resume, strerror(errno));
-			add_line_to_tab(tab, errbuf);
-			// Remove the process from suspended list since it's gone
-			tab->suspended_count--;
-			return;
+			journal_repair();
+			flock(writer.fd, LOCK_UN);
 		}
-
-		char msg[256];
-		// Truncate long commands for display
-		char truncated_cmd[200];
-		strncpy(truncated_cmd, tab->suspended_processes[last_index].command, sizeof(truncated_cmd) - 1);
-		truncated_cmd[sizeof(truncated_cmd) - 1] = '\0';
-		if (strlen(tab->suspended_processes[last_index].command) > sizeof(truncated_cmd) - 1)
+		HistoryReader rd;
+		if (reader_open(&rd))
 		{
-			strcpy(truncated_cmd + sizeof(truncated_cmd) - 4, "...");
+			int ok = rd.count == n + 1 && journal_matches(reader_record(&rd, 0), cmds, 0) &&
+					 journal_matches(reader_record(&rd, 1), cmds, n - 1);
+			printf("journal: repaired: %d records, unindexed record %s\n", rd.count, ok ? "recovered" : "LOST");
+			failures += !ok;
+			reader_close(&rd);
 		}
-		snprintf(msg, sizeof(msg), "Resumed [%d]: %s", pid_to_resume, truncated_cmd);
-		add_line_to_tab(tab, msg);
-
-		// Set as current child process
-		tab->child_pid = pid_to_resume;
-
-		// Remove from suspended list
-		tab->suspended_count--;
+	}
 
-		// Wait for the resumed process
-		int status;
-		pid_t result = waitpid(pid_to_resume, &status, 0);
-		if (result > 0)
+	// Compaction, against what journal_kept() says it should keep
+	size_t want_len = 0;
+	char *want = journal_expected(&want_len);
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		history_compact();
+		_exit(0);
+	}
+	if (pid > 0)
+		waitpid(pid, NULL, 0);
+	close(writer.fd);
+	close(writer.idx_fd);
+	writer.fd = writer.idx_fd = -1;
+	HistoryReader rd;
+	if (want && reader_open(&rd))
+	{
+		int bad = 0, repeats = 0;
+		size_t at = 0;
+		for (int k = rd.count - 1; k >= 0; k--)
 		{
-			if (WIFEXITED(status))
-			{
-				snprintf(msg, sizeof(msg), "[%d] exited with status %d", pid_to_resume, WEXITSTATUS(status));
-				add_line_to_tab(tab, msg);
-			}
-			else if (WIFSIGNALED(status))
-			{
-				snprintf(msg, sizeof(msg), "[%d] killed by signal %d", pid_to_resume, WTERMSIG(status));
-				add_line_to_tab(tab, msg);
-			}
+			const HistoryRecord *r = reader_record(&rd, k);
+			bad += !r || at + r->size > want_len || memcmp(want + at, r, r->size) != 0;
+			at += r ? r->size : 0;
+			repeats += r && r->cmd_len >= 7 && memcmp(record_command(r), "make -j", 7) == 0;
 		}
-		tab->child_pid = -1;
-		return;
+		bad += at != want_len;
+		printf("journal: compacted: %d records, %d make runs, %d differ\n", rd.count, repeats, bad);
+		failures += bad;
+		reader_close(&rd);
 	}
+	else
+		failures++;
+	free(want);
+
+	unlink(path);
+	unlink(idx_path);
+	rmdir(dir);
+	for (int i = 0; cmds && i < n; i++)
+		free(cmds[i]);
+	free(cmds);
+	return failures;
+}
 
-	if (strcmp(cmdline, "jobs") == 0)
+// Ctrl+R over 100k history entries: indexing them, then each keystroke
+// of a few queries, which should each take well under a frame
+static void bench_history()
+{
+	static const char *forms[] = {
+		"git commit -m 'fix issue %u'", "make -j8 target_%u", "cd /src/module_%u/lib",
+		"grep -rn pattern_%u src/", "ssh deploy@host%u.example.com", "docker run --rm image:%u",
+		"python3 scripts/report_%u.py --verbose", "vim src/module_%u/main.c"};
+	Tab *tab = tab_new(1);
+	if (!tab)
+		return;
+	unsigned seed = 12345;
+	char line[256];
+	for (int i = 0; i < 100000; i++)
 	{
-		if (tab->suspended_count == 0)
-		{
-			add_line_to_tab(tab, "No suspended jobs");
+		seed = seed * 1103515245 + 12345;
+		snprintf(line, sizeof(line), forms[(seed >> 8) % 8], (seed >> 12) % 20000);
+		char *copy = arena_strdup(&history.added, line);
+		if (!copy || !history_push(copy, strlen(copy)))
 			return;
-		}
+	}
 
-		add_line_to_tab(tab, "Suspended jobs:");
-		for (int i = 0; i < tab->suspended_count; i++)
+	double t0 = now_seconds();
+	trigrams_update();
+	printf("history: indexed %d entries in %.1f ms\n", history.count, (now_seconds() - t0) * 1000);
+
+	static const char *queries[] = {"git commit", "make -j8 target_1999", "ssh deploy@host4", "Docker", "grpatsrc", "no such command"};
+	for (int q = 0; q < 6; q++)
+	{
+		double worst = 0, total = 0;
+		int n = strlen(queries[q]);
+		for (int k = 1; k <= n; k++)
 		{
-			char job_info[256];
-			// Truncate long commands for display
-			char truncated_cmd[200];
-			strncpy(truncated_cmd, tab->suspended_processes[i].command, sizeof(truncated_cmd) - 1);
-			truncated_cmd[sizeof(truncated_cmd) - 1] = '\0';
-			if (strlen(tab->suspended_processes[i].command) > sizeof(truncated_cmd) - 1)
-			{
-				strcpy(truncated_cmd + sizeof(truncated_cmd) - 4, "...");
-			}
-			snprintf(job_info, sizeof(job_info), "[%d] %d %s",
-					 i + 1,
-					 tab->suspended_processes[i].pid,
-					 truncated_cmd);
-			add_line_to_tab(tab, job_info);
+			if (!reserve_text(&tab->search_term, &tab->search_cap, k))
+				return;
+			memcpy(tab->search_term, queries[q], k);
+			tab->search_term[k] = '\0';
+			tab->search_pos = k;
+			t0 = now_seconds();
+			hs_refresh(tab);
+			double dt = now_seconds() - t0;
+			total += dt;
+			if (dt > worst)
+				worst = dt;
 		}
-		return;
+		HistoryEntry *e = hs_current(tab);
+		printf("history: \"%s\" %d candidates, %.3f ms per key (max %.3f), best: %.*s\n", queries[q],
+			   tab->hsearch.count, total * 1000 / n, worst * 1000, e ? e->len : 0, e ? e->text : "");
 	}
+	tab_free(tab);
+}
 
-	if (strncmp(cmdline, "multiWatch", 10) == 0)
+// Ctrl+F over a million build-log lines, typed a character at a time
+// Runs a search to the end in the slices the main loop would use
+static int bench_find_slices(Tab *tab, double *total, double *longest)
+{
+	int slices = 0;
+	*total = *longest = 0;
+	do
 	{
-		const char *args = cmdline + 10;
-		while (*args == ' ')
-			args++;
-		multiWatch_runner(tab, args);
+		double t0 = now_seconds();
+		find_refresh(tab, FIND_SLICE_MS / 1000.0);
+		double dt = now_seconds() - t0;
+		*total += dt;
+		if (dt > *longest)
+			*longest = dt;
+		slices++;
+	} while (find_busy(tab));
+	return slices;
+}
+
+static void bench_search()
+{
+	Tab *tab = tab_new(1);
+	if (!tab)
 		return;
+	Scrollback *sb = &tab->lines;
+	unsigned seed = 12345;
+	for (int i = 0; i < sb_max_lines; i++)
+	{
+		char line[256];
+		int n = bench_log_line(line, sizeof(line), i, sb_max_lines, &seed);
+		scrollback_append(sb, line, n);
 	}
 
-	if (strcmp(cmdline, "exit") == 0)
+	const char *query = "module_42/file_7";
+	Finder *f = &tab->find;
+	tab->in_find_mode = 1;
+	double t0, dt;
+	for (int n = 1; n <= (int)strlen(query); n++)
 	{
-		add_line_to_tab(tab, "Closing MyTerm...");
-		redraw();
-		sleep(1);
-		XCloseDisplay(dpy);
-		exit(0);
+		if (!reserve_text(&f->term, &f->cap, n))
+			return;
+		memcpy(f->term, query, n);
+		f->len = n;
+		double longest, fresh, fresh_longest;
+		int slices = bench_find_slices(tab, &dt, &longest);
+		int hits = f->nhits;
+		// The same query from scratch, for comparison
+		f->scanned_len = 0;
+		bench_find_slices(tab, &fresh, &fresh_longest);
+		printf("search: \"%.*s\" %d lines in %.2f ms, %d slices, longest %.2f ms (from scratch %.2f ms)%s\n", n, query,
+			   hits, dt * 1000, slices, longest * 1000, fresh * 1000, f->nhits == hits ? "" : " MISMATCH");
 	}
 
-	// Check for background process (ending with &)
-	int run_in_background = 0;
-	char clean_cmdline[BUFSIZE];
-	strncpy(clean_cmdline, cmdline, sizeof(clean_cmdline) - 1);
-	clean_cmdline[sizeof(clean_cmdline) - 1] = '\0';
+	// The final query from scratch in one go, and the same scan with strstr
+	f->scanned_len = 0;
+	t0 = now_seconds();
+	find_refresh(tab, 1e9);
+	dt = now_seconds() - t0;
+	printf("search: full scan for \"%s\" %d lines in %.2f ms\n", query, f->nhits, dt * 1000);
+	int found = 0;
+	t0 = now_seconds();
+	for (int i = 0; i < sb->count; i++)
+		found += strstr(scrollback_line(sb, i)->text, query) != NULL;
+	dt = now_seconds() - t0;
+	printf("search: strstr over the same lines %d lines in %.2f ms\n", found, dt * 1000);
+	tab_free(tab);
+}
 
-	// Remove trailing spaces and check for &
-	char *end = clean_cmdline + strlen(clean_cmdline) - 1;
-	while (end > clean_cmdline && (*end == ' ' || *end == '\t'))
+// Starts /bin/true the way commands used to be started: fork(), then the
+// child sets itself up and execs
+static pid_t bench_fork_true(const char *dir)
+{
+	pid_t pid = fork();
+	if (pid == 0)
 	{
-		end--;
+		setpgid(0, 0);
+		if (chdir(dir) == -1)
+			chdir("/");
+		int devnull = open("/dev/null", O_WRONLY);
+		dup2(devnull, STDOUT_FILENO);
+		dup2(devnull, STDERR_FILENO);
+		execl("/bin/true", "true", (char *)NULL);
+		_exit(127);
 	}
-	if (end > clean_cmdline && *end == '&')
+	if (pid > 0)
+		setpgid(pid, pid);
+	return pid;
+}
+
+// Starts a command the way execute_command() does and returns the time
+// until its first byte of output, or -1
+static double bench_first_output(Tab *tab, const char *cmd, int direct)
+{
+	int out[2];
+	if (launch_pipe(out) == -1)
+		return -1;
+	LaunchSpec ls = {.in_path = "/dev/null", .in_fd = -1, .out_fd = out[1], .err_to_out = 1};
+	pid_t pid;
+	arena_reset(&tab->scratch);
+	double t0 = now_seconds();
+	int err = direct ? launch_command(tab, cmd, &ls, &pid) : launch_shell(tab, cmd, &ls, &pid);
+	close(out[1]);
+	char buf[BUFSIZE];
+	double first = -1;
+	if (!err && read(out[0], buf, sizeof(buf)) > 0)
+		first = now_seconds() - t0;
+	while (!err && read(out[0], buf, sizeof(buf)) > 0)
+		;
+	close(out[0]);
+	if (!err)
+		waitpid(pid, NULL, 0);
+	return first;
+}
+
+// Runs a command to completion, spawned or in the tab's persistent shell,
+// and returns how long it took, or -1
+static double bench_round_trip(Tab *tab, const char *cmd, int in_shell)
+{
+	double t0 = now_seconds();
+	if (in_shell)
 	{
-		run_in_background = 1;
-		*end = '\0';
-		// Remove any spaces before the &
-		end--;
-		while (end > clean_cmdline && (*end == ' ' || *end == '\t'))
-		{
-			*end = '\0';
-			end--;
-		}
+		if (shell_run(tab, cmd) != 0)
+			return -1;
+		struct pollfd pfd = {tab->shell_stdout[0], POLLIN, 0};
+		while (tab->job.state != JOB_REAPED && tab->shell_stdout[0] >= 0 && poll(&pfd, 1, 1000) > 0)
+			job_read_output(tab);
+		int done = tab->job.state == JOB_REAPED;
+		framer_release(&tab->job.framer);
+		tab->job.state = JOB_IDLE;
+		scrollback_clear(&tab->lines);
+		return done ? now_seconds() - t0 : -1;
 	}
+	return bench_first_output(tab, cmd, 1) >= 0 ? now_seconds() - t0 : -1;
+}
 
-	// Pipes
-	if (strchr(clean_cmdline, '|'))
+// Time to start a command, and to start it and reap it, with fork() and
+// with launch(), as MyTerm's resident memory grows. A touched heap block
+// stands in for scrollback: what fork() pays for is the pages, not what
+// is in them. Then the time to a command's first output through bash -c
+// and exec'd directly, and commands run back to back, each spawned or all
+// in one persistent shell.
+static void bench_spawn()
+{
+	static const int sizes_mb[] = {1, 100, 1024};
+	const int runs = 200;
+	Tab *tab = tab_new(1);
+	if (!tab)
+		return;
+	char *argv[] = {"true", NULL};
+	LaunchSpec ls = {.in_fd = -1, .out_path = "/dev/null", .out_fd = -1, .err_to_out = 1};
+
+	for (int s = 0; s < 3; s++)
 	{
-		char pipeline[BUFSIZE];
-		strncpy(pipeline, clean_cmdline, sizeof(pipeline) - 1);
-		pipeline[sizeof(pipeline) - 1] = 0;
-		char *commands[64];
-		int ncmd = 0;
-		char *tok = strtok(pipeline, "|");
-		while (tok && ncmd < 64)
+		size_t size = (size_t)sizes_mb[s] << 20;
+		char *resident = malloc(size);
+		if (!resident)
 		{
-			while (*tok == ' ' || *tok == '\t')
-				tok++;
-			char *end = tok + strlen(tok) - 1;
-			while (end >= tok && (*end == ' ' || *end == '\t' || *end == '\n'))
-			{
-				*end = '\0';
-				end--;
-			}
-			commands[ncmd++] = tok;
-			tok = strtok(NULL, "|");
+			printf("spawn: %4d MB resident: out of memory, skipped\n", sizes_mb[s]);
+			continue;
 		}
-		if (ncmd == 0)
-			return;
+		memset(resident, 'x', size);
 
-		int pipes[64][2];
-		for (int i = 0; i < ncmd - 1; ++i)
-		{
-			if (pipe(pipes[i]) == -1)
-			{
-				perror("pipe");
-				return;
-			}
-		}
-		int gui_pipe[2];
-		if (pipe(gui_pipe) == -1)
+		for (int use_fork = 1; use_fork >= 0; use_fork--)
 		{
-			perror("pipe gui");
-			for (int i = 0; i < ncmd - 1; ++i)
+			double start_total = 0, start_worst = 0, run_total = 0;
+			for (int i = 0; i < runs; i++)
 			{
-				close(pipes[i][0]);
-				close(pipes[i][1]);
+				pid_t pid = -1;
+				double t0 = now_seconds();
+				if (use_fork)
+					pid = bench_fork_true(tab->current_directory);
+				else if (launch(tab->current_directory, "/bin/true", argv, &ls, &pid) != 0)
+					pid = -1;
+				double t1 = now_seconds();
+				if (pid < 0)
+				{
+					perror("spawn");
+					break;
+				}
+				waitpid(pid, NULL, 0);
+				double t2 = now_seconds();
+				start_total += t1 - t0;
+				run_total += t2 - t0;
+				if (t1 - t0 > start_worst)
+					start_worst = t1 - t0;
 			}
-			return;
+			printf("spawn: %4d MB resident, %-11s start %.3f ms (max %.3f), start to exit %.3f ms\n", sizes_mb[s],
+				   use_fork ? "fork+exec:" : "posix_spawn:", start_total * 1000 / runs, start_worst * 1000,
+				   run_total * 1000 / runs);
 		}
+		free(resident);
+	}
 
-		pid_t pids[64];
-		for (int i = 0; i < ncmd; ++i)
+	// Builtins such as echo always go to bash, so the direct column uses
+	// programs
+	static const char *programs[] = {"/bin/pwd", "ls /", "/bin/echo hello", "date +%s", "cat /etc/hostname"};
+	for (int c = 0; c < 5; c++)
+	{
+		double total[2] = {0, 0};
+		int got[2] = {0, 0};
+		for (int i = 0; i < runs; i++)
 		{
-			pid_t pid = fork();
-			if (pid == 0)
-			{
-				// Child process - set the current directory for this tab
-				if (chdir(tab->current_directory) == -1)
-				{
-					// If we can't change to the tab's directory, fall back to home
-					chdir(getenv("HOME") ? getenv("HOME") : "/");
-				}
-
-				if (i > 0)
-				{
-					dup2(pipes[i - 1][0], STDIN_FILENO);
-				}
-				else
-				{
-					int devnull = open("/dev/null", O_RDONLY);
-					if (devnull >= 0)
-					{
-						dup2(devnull, STDIN_FILENO);
-						close(devnull);
-					}
-				}
-				if (i < ncmd - 1)
-				{
-					dup2(pipes[i][1], STDOUT_FILENO);
-				}
-				else
-				{
-					dup2(gui_pipe[1], STDOUT_FILENO);
-					dup2(gui_pipe[1], STDERR_FILENO);
-				}
-				for (int j = 0; j < ncmd - 1; ++j)
-				{
-					close(pipes[j][0]);
-					close(pipes[j][1]);
-				}
-				close(gui_pipe[0]);
-				close(gui_pipe[1]);
-				execl("/bin/bash", "bash", "-c", commands[i], (char *)NULL);
-				perror("execl");
-				_exit(127);
-			}
-			else if (pid > 0)
+			for (int direct = 0; direct < 2; direct++)
 			{
-				pids[i] = pid;
-				if (!run_in_background)
-				{
-					tab->child_pid = pid;
-				}
-				else
+				double t = bench_first_output(tab, programs[c], direct);
+				if (t >= 0)
 				{
-					// Add to background processes
-					if (tab->bg_pid_count < 10)
-					{
-						tab->background_pids[tab->bg_pid_count++] = pid;
-						char msg[256];
-						snprintf(msg, sizeof(msg), "[%d] running in background", pid);
-						add_line_to_tab(tab, msg);
-					}
+					total[direct] += t;
+					got[direct]++;
 				}
 			}
-			else
-			{
-				perror("fork");
-				return;
-			}
 		}
-		for (int i = 0; i < ncmd - 1; ++i)
-		{
-			close(pipes[i][0]);
-			close(pipes[i][1]);
-		}
-		close(gui_pipe[1]);
+		printf("spawn: first output of %-18s bash -c %.3f ms, direct %.3f ms\n", programs[c],
+			   got[0] ? total[0] * 1000 / got[0] : 0, got[1] ? total[1] * 1000 / got[1] : 0);
+	}
 
-		if (!run_in_background)
+	static const char *commands[] = {"pwd", "ls /", "echo hello", "date +%s", "cat /etc/hostname"};
+	for (int c = 0; c < 5; c++)
+	{
+		double total[2] = {0, 0};
+		int got[2] = {0, 0};
+		for (int i = 0; i < runs; i++)
 		{
-			// Read output from the pipe and display it
-			char buf[BUFSIZE];
-			ssize_t r;
-			while ((r = read(gui_pipe[0], buf, sizeof(buf) - 1)) > 0)
+			for (int in_shell = 0; in_shell < 2; in_shell++)
 			{
-				buf[r] = '\0';
-				char *line_start = buf;
-				char *line_end;
-				while ((line_end = strchr(line_start, '\n')) != NULL)
+				double t = bench_round_trip(tab, commands[c], in_shell);
+				if (t >= 0)
 				{
-					int line_len = line_end - line_start;
-					if (line_len > 0)
-					{
-						char line[BUFSIZE];
-						strncpy(line, line_start, line_len);
-						line[line_len] = '\0';
-						add_line_to_tab(tab, line);
-					}
-					line_start = line_end + 1;
-				}
-				// Handle any remaining data without newline
-				if (line_start < buf + r)
-				{
-					int remaining_len = (buf + r) - line_start;
-					if (remaining_len > 0)
-					{
-						char line[BUFSIZE];
-						strncpy(line, line_start, remaining_len);
-						line[remaining_len] = '\0';
-						add_line_to_tab(tab, line);
-					}
+					total[in_shell] += t;
+					got[in_shell]++;
 				}
-				redraw();
-			}
-			close(gui_pipe[0]);
-			for (int i = 0; i < ncmd; ++i)
-			{
-				waitpid(pids[i], NULL, 0);
 			}
-			tab->child_pid = -1;
-		}
-		else
-		{
-			close(gui_pipe[0]);
-			// Don't wait for background processes
 		}
-		return;
+		printf("spawn: %d x %-18s spawned %.3f ms each, persistent shell %.3f ms each\n", runs, commands[c],
+			   got[0] ? total[0] * 1000 / got[0] : 0, got[1] ? total[1] * 1000 / got[1] : 0);
 	}
+	shell_stop(tab);
+	tab_free(tab);
+}
 
-	// Handle redirection and regular commands with proper output capture
-	char *input_file = NULL;
-	char *output_file = NULL;
-	char cmd_copy[BUFSIZE];
-	strncpy(cmd_copy, clean_cmdline, sizeof(cmd_copy) - 1);
-	cmd_copy[sizeof(cmd_copy) - 1] = 0;
-
-	char *input_redir = strchr(cmd_copy, '<');
-	char *output_redir = strchr(cmd_copy, '>');
-	if (input_redir)
-	{
-		*input_redir = '\0';
-		input_file = input_redir + 1;
-		while (*input_file == ' ')
-			input_file++;
-		char *end = input_file + strlen(input_file) - 1;
-		while (end >= input_file && (*end == ' ' || *end == '\n' || *end == '\r'))
-		{
-			*end = '\0';
-			end--;
-		}
-	}
-	if (output_redir)
-	{
-		*output_redir = '\0';
-		output_file = output_redir + 1;
-		while (*output_file == ' ')
-			output_file++;
-		char *end = output_file + strlen(output_file) - 1;
-		while (end >= output_file && (*end == ' ' || *end == '\n' || *end == '\r'))
-		{
-			*end = '\0';
-			end--;
-		}
+// CJK and emoji heavy output drawn a screenful at a time into an
+// off-screen pixmap, first with a cold glyph cache and then warm.
+// Opens a mapped window for the drawing benchmarks
+static int bench_open_window(const char *name)
+{
+	dpy = XOpenDisplay(NULL);
+	if (!dpy)
+	{
+		fprintf(stderr, "bench: %s needs an X display\n", name);
+		return 0;
 	}
+	int screen = DefaultScreen(dpy);
+	win = XCreateSimpleWindow(dpy, RootWindow(dpy, screen), 0, 0, WIDTH, HEIGHT, 1,
+							  BlackPixel(dpy, screen), BlackPixel(dpy, screen));
+	XSelectInput(dpy, win, ExposureMask);
+	XMapWindow(dpy, win);
+	XEvent ev;
+	XWindowEvent(dpy, win, ExposureMask, &ev);
+	setup_drawing();
+	return 1;
+}
 
-	char *trimmed_cmd = cmd_copy;
-	while (*trimmed_cmd == ' ')
-		trimmed_cmd++;
-	char *end_cmd = trimmed_cmd + strlen(trimmed_cmd) - 1;
-	while (end_cmd >= trimmed_cmd && (*end_cmd == ' ' || *end_cmd == '\n' || *end_cmd == '\r'))
+static int bench_glyphs()
+{
+	if (!bench_open_window("glyphs"))
+		return 1;
+	target = renderer->create(win_width, win_height);
+	if (!target)
 	{
-		*end_cmd = '\0';
-		end_cmd--;
+		fprintf(stderr, "bench: cannot create a surface\n");
+		return 1;
 	}
 
-	if (strlen(trimmed_cmd) == 0)
+	static const char *words[] = {
+		"漢字", "ひらがな", "カタカナ", "한국어", "中文输出", "測試", "😀", "🚀", "🎉", "👍🏽",
+		"✓", "──", "λ", "Ünïcödé", "ok", "build", "src/main.c", "→"};
+	int nwords = sizeof(words) / sizeof(words[0]);
+	int nlines = 20000;
+	size_t cap = (size_t)nlines * 128, total = 0;
+	char *text = malloc(cap);
+	Line *lines = malloc(nlines * sizeof(Line));
+	if (!text || !lines)
 	{
-		if (input_file || output_file)
+		fprintf(stderr, "bench: out of memory\n");
+		return 1;
+	}
+	unsigned seed = 12345;
+	for (int i = 0; i < nlines; i++)
+	{
+		lines[i] = (Line){.text = text + total};
+		for (int w = 0; w < 8; w++)
 		{
-			add_line_to_tab(tab, "Error: Redirection specified but no command given");
+			seed = seed * 1103515245 + 12345;
+			const char *word = words[(seed >> 16) % nwords];
+			size_t n = strlen(word);
+			memcpy(text + total, word, n);
+			text[total + n] = ' ';
+			total += n + 1;
 		}
-		return;
+		lines[i].len = text + total - lines[i].text;
 	}
 
-	int output_pipe[2];
-	if (pipe(output_pipe) == -1)
+	int rows = visible_rows();
+	const char *pass_names[] = {"cold", "warm"};
+	for (int pass = 0; pass < 2; pass++)
 	{
-		perror("pipe");
-		return;
+		double t0 = now_seconds();
+		for (int i = 0; i < nlines; i += rows)
+		{
+			RowSpan run[MAX_ROWS];
+			int n = nlines - i < rows ? nlines - i : rows;
+			for (int k = 0; k < n; k++)
+				run[k] = (RowSpan){.text = lines[i + k].text, .len = lines[i + k].len, .seq = -1};
+			paint_rows(0, n, run);
+		}
+		XSync(dpy, False);
+		double dt = now_seconds() - t0;
+		printf("glyphs (%s, %s cache): %.1f MB/s, %.0f lines/s\n",
+			   renderer->name, pass_names[pass], (total / 1048576.0) / dt, nlines / dt);
 	}
+	printf("glyph cache: %ld code points, %d fallback fonts\n", metrics.glyphs, metrics.nfallbacks);
 
-	pid_t pid = fork();
-	if (pid == 0)
+	free(lines);
+	free(text);
+	XCloseDisplay(dpy);
+	return 0;
+}
+
+// Replays the same output through each backend: first painting a frame
+// after every pipe-sized read, then repeated full-window repaints.
+static int bench_render(const char *replay_file)
+{
+	size_t total = 0;
+	char *data = NULL;
+	if (replay_file)
+	{
+		FILE *f = fopen(replay_file, "rb");
+		if (!f)
+		{
+			perror(replay_file);
+			return 1;
+		}
+		fseek(f, 0, SEEK_END);
+		long size = ftell(f);
+		fseek(f, 0, SEEK_SET);
+		data = size > 0 ? malloc(size) : NULL;
+		if (data)
+			total = fread(data, 1, size, f);
+		fclose(f);
+	}
+	else
 	{
-		// set the current directory for this tab
-		if (chdir(tab->current_directory) == -1)
+		// Compiler-log style lines with some CJK and wide ones that wrap
+		total = 16 * 1024 * 1024;
+		data = malloc(total);
+		unsigned seed = 12345;
+		for (size_t pos = 0; data && pos < total;)
 		{
-			// If we can't change to the tab's directory, fall back to home
-			chdir(getenv("HOME") ? getenv("HOME") : "/");
+			seed = seed * 1103515245 + 12345;
+			char line[400];
+			int n = snprintf(line, sizeof(line), "[%5u/%u] CC src/module_%u/%s.c -o build/obj_%u.o",
+							 seed % 9999, 9999, (seed >> 8) % 97, (seed & 16) ? "漢字_解析" : "parser", seed >> 20);
+			if ((seed >> 12) % 8 == 0)
+				for (int i = 0; i < 4; i++)
+					n += snprintf(line + n, sizeof(line) - n, " -Wall -Wextra -O2");
+			line[n++] = '\n';
+			if ((size_t)n > total - pos)
+				n = total - pos;
+			memcpy(data + pos, line, n);
+			pos += n;
 		}
+	}
+	if (!data || total == 0)
+	{
+		fprintf(stderr, "bench: nothing to replay\n");
+		return 1;
+	}
+	if (!bench_open_window("render"))
+		return 1;
+	renderer->shutdown();
 
-		close(output_pipe[0]);
+	Tab *tab = tab_new(1);
+	if (!tab || !tab_append(tab))
+		return 1;
 
-		if (input_file)
+	const RenderBackend *backends[] = {&xft_backend, &shm_backend};
+	for (int b = 0; b < 2; b++)
+	{
+		if (!backends[b]->init())
 		{
-			int fd_in = open(input_file, O_RDONLY);
-			if (fd_in == -1)
-			{
-				perror("open input file");
-				_exit(1);
-			}
-			dup2(fd_in, STDIN_FILENO);
-			close(fd_in);
+			printf("render (%s): unavailable on this display\n", backends[b]->name);
+			continue;
 		}
-
-		if (output_file)
+		renderer = backends[b];
+
+		tab->scrolled = 0;
+		LineFramer framer;
+		framer_init(&framer);
+		damage_all();
+		long frames = 0;
+		double t0 = now_seconds();
+		for (size_t off = 0; off < total; off += 4096)
 		{
-			int fd_out = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-			if (fd_out == -1)
-			{
-				perror("open output file");
-				_exit(1);
-			}
-			dup2(fd_out, STDOUT_FILENO);
-			dup2(fd_out, STDERR_FILENO);
-			close(fd_out);
+			size_t n = total - off < 4096 ? total - off : 4096;
+			framer_feed(&framer, &tab->lines, data + off, n);
+			redraw();
+			frames++;
 		}
-		else
+		XSync(dpy, False);
+		double dt = now_seconds() - t0;
+		printf("render (%s): replay %.1f MB at %.0f frames/s (%.1f MB/s)\n",
+			   renderer->name, total / 1048576.0, frames / dt, (total / 1048576.0) / dt);
+
+		int repaints = 500;
+		t0 = now_seconds();
+		for (int i = 0; i < repaints; i++)
 		{
-			// Redirect stdout and stderr to the pipe
-			dup2(output_pipe[1], STDOUT_FILENO);
-			dup2(output_pipe[1], STDERR_FILENO);
+			damage_all();
+			redraw();
 		}
+		XSync(dpy, False);
+		dt = now_seconds() - t0;
+		printf("render (%s): full repaint %.3f ms\n", renderer->name, dt * 1000 / repaints);
 
-		close(output_pipe[1]);
+		scrollback_free(&tab->lines);
+		free_tab_frame(tab);
+		renderer->shutdown();
+	}
+	free(data);
+	XCloseDisplay(dpy);
+	return 0;
+}
 
-		execl("/bin/bash", "bash", "-c", trimmed_cmd, (char *)NULL);
-		perror("execl");
-		_exit(127);
+static int run_benchmark(const char *name, const char *arg)
+{
+	if (strcmp(name, "framer") == 0)
+	{
+		bench_framer();
+		return 0;
 	}
-	else if (pid > 0)
+	if (strcmp(name, "scrollback") == 0)
 	{
-		// Parent process
-		close(output_pipe[1]);
-
-		if (run_in_background)
-		{
-			// Add to background processes
-			if (tab->bg_pid_count < 10)
-			{
-				tab->background_pids[tab->bg_pid_count++] = pid;
-				char msg[256];
-				snprintf(msg, sizeof(msg), "[%d] running in background", pid);
-				add_line_to_tab(tab, msg);
-			}
-			close(output_pipe[0]);
-		}
-		else
-		{
-			tab->child_pid = pid;
-
-			// Set the output pipe to non-blocking mode
-			int flags = fcntl(output_pipe[0], F_GETFL, 0);
-			fcntl(output_pipe[0], F_SETFL, flags | O_NONBLOCK);
-
-			// Use poll to monitor the pipe with timeout
-			struct pollfd fds[1];
-			fds[0].fd = output_pipe[0];
-			fds[0].events = POLLIN;
-
-			int child_alive = 1;
-			char buf[BUFSIZE];
-
-			while (child_alive)
-			{
-				// Check for command output with a short timeout (100ms)
-				int poll_result = poll(fds, 1, 100);
-
-				if (poll_result > 0)
-				{
-					if (fds[0].revents & POLLIN)
-					{
-						ssize_t bytes_read = read(output_pipe[0], buf, sizeof(buf) - 1);
-						if (bytes_read > 0)
-						{
-							buf[bytes_read] = '\0';
-
-							// Split output into lines and display each line
-							char *line_start = buf;
-							char *line_end;
-
-							while ((line_end = strchr(line_start, '\n')) != NULL)
-							{
-								int line_len = line_end - line_start;
-								if (line_len > 0)
-								{
-									char line[BUFSIZE];
-									strncpy(line, line_start, line_len);
-									line[line_len] = '\0';
-									add_line_to_tab(tab, line);
-								}
-								line_start = line_end + 1;
-							}
-
-							// Handle any remaining data without newline
-							if (line_start < buf + bytes_read)
-							{
-								int remaining_len = (buf + bytes_read) - line_start;
-								if (remaining_len > 0)
-								{
-									char line[BUFSIZE];
-									strncpy(line, line_start, remaining_len);
-									line[remaining_len] = '\0';
-									add_line_to_tab(tab, line);
-								}
-							}
-							redraw();
-						}
-					}
-
-					if (fds[0].revents & POLLHUP)
-					{
-						// Pipe closed, child might be done
-						child_alive = 0;
-					}
-				}
-				else if (poll_result < 0 && errno != EINTR)
-				{
-					// Poll error
-					perror("poll");
-					break;
-				}
-
-				// Check if child process is still alive (non-blocking wait)
-				int status;
-				pid_t result = waitpid(pid, &status, WNOHANG);
-				if (result == pid)
-				{
-					// Child process finished
-					child_alive = 0;
-
-					// Read any remaining data from pipe
-					while (1)
-					{
-						ssize_t bytes_read = read(output_pipe[0], buf, sizeof(buf) - 1);
-						if (bytes_read > 0)
-						{
-							buf[bytes_read] = '\0';
-
-							char *line_start = buf;
-							char *line_end;
-							while ((line_end = strchr(line_start, '\n')) != NULL)
-							{
-								int line_len = line_end - line_start;
-								if (line_len > 0)
-								{
-									char line[BUFSIZE];
-									strncpy(line, line_start, line_len);
-									line[line_len] = '\0';
-									add_line_to_tab(tab, line);
-								}
-								line_start = line_end + 1;
-							}
-							if (line_start < buf + bytes_read)
-							{
-								int remaining_len = (buf + bytes_read) - line_start;
-								if (remaining_len > 0)
-								{
-									char line[BUFSIZE];
-									strncpy(line, line_start, remaining_len);
-									line[remaining_len] = '\0';
-									add_line_to_tab(tab, line);
-								}
-							}
-						}
-						else
-						{
-							break;
-						}
-					}
-
-					if (WIFEXITED(status) && WEXITSTATUS(status) != 0)
-					{
-						char errbuf[256];
-						snprintf(errbuf, sizeof(errbuf), "Command exited with status %d", WEXITSTATUS(status));
-						add_line_to_tab(tab, errbuf);
-					}
-				}
-				else if (result < 0)
-				{
-					// Error checking child status
-					perror("waitpid");
-					break;
-				}
-
-				// Process X11 events while waiting for command
-				while (XPending(dpy) > 0)
-				{
-					XEvent ev;
-					XNextEvent(dpy, &ev);
-
-					if (ev.type == Expose)
-					{
-						redraw();
-					}
-					else if (ev.type == KeyPress)
-					{
-						char keybuf[32];
-						KeySym ks;
-						int len = XLookupString(&ev.xkey, keybuf, sizeof(keybuf), &ks, NULL);
-
-						// Check for Ctrl+C or Ctrl+Z
-						if (ev.xkey.state & ControlMask)
-						{
-							if (ks == XK_c)
-							{
-								kill(pid, SIGINT);
-								add_line_to_tab(tab, "^C");
-								redraw();
-								child_alive = 0;
-								break;
-							}
-							else if (ks == XK_z)
-							{
-								kill(pid, SIGTSTP);
-								if (tab->suspended_count < 10)
-								{
-									tab->suspended_processes[tab->suspended_count].pid = pid;
-									strncpy(tab->suspended_processes[tab->suspended_count].command,
-											trimmed_cmd,
-											sizeof(tab->suspended_processes[tab->suspended_count].command) - 1);
-									tab->suspended_processes[tab->suspended_count].command[sizeof(tab->suspended_processes[tab->suspended_count].command) - 1] = '\0';
-									tab->suspended_count++;
-									char msg[256];
-									snprintf(msg, sizeof(msg), "[%d] suspended", pid);
-									add_line_to_tab(tab, msg);
-								}
-								add_line_to_tab(tab, "^Z");
-								redraw();
-								tab->child_pid = -1;
-								child_alive = 0;
-								break;
-							}
-						}
-					}
-				}
-
-				redraw();
-			}
-
-			close(output_pipe[0]);
-			tab->child_pid = -1;
-		}
+		bench_scrollback();
+		return 0;
 	}
-	else
+	if (strcmp(name, "codec") == 0)
+		return bench_codec() ? 1 : 0;
+	if (strcmp(name, "journal") == 0)
+		return bench_journal() ? 1 : 0;
+	if (strcmp(name, "search") == 0)
 	{
-		perror("fork");
-		close(output_pipe[0]);
-		close(output_pipe[1]);
+		bench_search();
+		return 0;
+	}
+	if (strcmp(name, "history") == 0)
+	{
+		bench_history();
+		return 0;
 	}
+	if (strcmp(name, "spawn") == 0)
+	{
+		bench_spawn();
+		return 0;
+	}
+	if (strcmp(name, "glyphs") == 0)
+		return bench_glyphs();
+	if (strcmp(name, "render") == 0)
+		return bench_render(arg);
+	fprintf(stderr, "Unknown benchmark '%s' (available: framer, scrollback, codec, journal, search, history, spawn, glyphs, render)\n", name);
+	return 1;
 }
 
-int main()
+int main(int argc, char *argv[])
 {
 	setlocale(LC_ALL, "");
+	scrollback_configure();
 
-	// Initialize all tabs
-	for (int i = 0; i < MAX_TABS; i++)
+	if ((argc == 3 || argc == 4) && strcmp(argv[1], "--bench") == 0)
 	{
-		Tab *tab = &tabs[i];
-		tab->in_pos = 0;
-		tab->input_buf[0] = '\0';
-		tab->line_count = 0;
-		tab->shell_pid = 0;
-		tab->scroll_offset = 0;
-		tab->search_term[0] = '\0';
-		tab->search_pos = 0;
-		tab->in_search_mode = 0;
-		tab->child_pid = -1;
-		tab->auto_complete_count = 0;
-		tab->bg_pid_count = 0;
-		tab->suspended_count = 0;
+		return run_benchmark(argv[2], argc == 4 ? argv[3] : NULL);
+	}
 
-		for (int j = 0; j < 10; j++)
-		{
-			tab->background_pids[j] = 0;
-			tab->suspended_processes[j].pid = -1;
-			tab->suspended_processes[j].command[0] = '\0';
-		}
+	// Frame rate cap for repaints during output, e.g. MYTERM_FPS=30
+	const char *fps = getenv("MYTERM_FPS");
+	if (fps && atoi(fps) > 0)
+	{
+		frame_interval = 1.0 / atoi(fps);
+	}
 
-		// Initialize current directory for each tab
-		if (getcwd(tab->current_directory, sizeof(tab->current_directory)) == NULL)
-		{
-			strcpy(tab->current_directory, "/");
-		}
+	// One long-lived bash per tab instead of one per command
+	const char *persist = getenv("MYTERM_PERSISTENT_SHELL");
+	persistent_shell = persist && atoi(persist) > 0;
 
-		snprintf(tab->tab_name, sizeof(tab->tab_name), "Tab %d", i + 1);
+	// The first tab
+	Tab *first_tab = tab_new(1);
+	if (!first_tab || !tab_append(first_tab))
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
 	}
 
 	// Load history
@@ -1890,6 +7679,20 @@ int main()
 	sa_tstp.sa_flags = SA_RESTART;
 	sigaction(SIGTSTP, &sa_tstp, NULL);
 
+	// A shell that has exited shows up as a failed write, not a signal.
+	// launch() restores the default for commands.
+	struct sigaction sa_pipe;
+	memset(&sa_pipe, 0, sizeof(sa_pipe));
+	sa_pipe.sa_handler = SIG_IGN;
+	sigemptyset(&sa_pipe.sa_mask);
+	sigaction(SIGPIPE, &sa_pipe, NULL);
+
+	if (setup_signal_pipe() == -1)
+	{
+		perror("signal pipe");
+		exit(1);
+	}
+
 	dpy = XOpenDisplay(NULL);
 	if (!dpy)
 	{
@@ -1902,80 +7705,210 @@ int main()
 							  BlackPixel(dpy, screen), BlackPixel(dpy, screen));
 
 	XStoreName(dpy, win, "MyTerm");
-	XSelectInput(dpy, win, ExposureMask | KeyPressMask);
-	XMapWindow(dpy, win);
+	XSelectInput(dpy, win, ExposureMask | KeyPressMask | ButtonPressMask | StructureNotifyMask);
 
-	font = XLoadQueryFont(dpy, "-*-fixed-medium-*-*-*-18-*-*-*-*-*-*-*");
-	if (!font)
+	// Keep room for the tab bar, the indicator, one row and the prompt
+	XSizeHints *hints = XAllocSizeHints();
+	if (hints)
 	{
-		fprintf(stderr, "Cannot load fixed font\n");
-		exit(1);
+		hints->flags = PMinSize;
+		hints->min_width = 200;
+		hints->min_height = LINE_H * 6;
+		XSetWMNormalHints(dpy, win, hints);
+		XFree(hints);
 	}
+	XMapWindow(dpy, win);
 
-	gc = XCreateGC(dpy, win, 0, NULL);
-	XSetFont(dpy, gc, font->fid);
-	XSetForeground(dpy, gc, WhitePixel(dpy, screen));
-	XSetBackground(dpy, gc, BlackPixel(dpy, screen));
+	setup_drawing();
+	// The server need not clear the window before we present to it
+	XSetWindowBackgroundPixmap(dpy, win, None);
 
-	colormap = DefaultColormap(dpy, screen);
-	XAllocNamedColor(dpy, colormap, "green", &green_color, &green_color);
-	XAllocNamedColor(dpy, colormap, "white", &white_color, &white_color);
+	// Input method for composed and non-Latin input; plain key lookup without one
+	XSetLocaleModifiers("");
+	XIM im = XOpenIM(dpy, NULL, NULL, NULL);
+	if (im)
+		input_context = XCreateIC(im, XNInputStyle, XIMPreeditNothing | XIMStatusNothing,
+								  XNClientWindow, win, XNFocusWindow, win, NULL);
+	if (input_context)
+		XSetICFocus(input_context);
 
-	add_line_to_tab(&tabs[0], "Welcome to My Terminal");
+	add_line_to_tab(tabs[0], "Welcome to My Terminal");
 
 	XEvent ev;
+	struct pollfd *fds = NULL;
+	int *fd_tab = NULL;
+	int poll_capacity = 0;
 	while (1)
 	{
+		// Room for the X connection, the signal pipe and one fd per tab
+		if (tab_count + 2 > poll_capacity)
+		{
+			int new_capacity = tab_count + 2 + 8;
+			struct pollfd *new_fds = realloc(fds, new_capacity * sizeof(struct pollfd));
+			if (new_fds)
+				fds = new_fds;
+			int *new_fd_tab = realloc(fd_tab, new_capacity * sizeof(int));
+			if (new_fd_tab)
+				fd_tab = new_fd_tab;
+			if (!new_fds || !new_fd_tab)
+			{
+				fprintf(stderr, "Out of memory\n");
+				exit(1);
+			}
+			poll_capacity = new_capacity;
+		}
+
+		// Sleep until X input, job output, a signal or the next frame
+		int timeout;
+		int nfds = job_poll_set(fds, fd_tab, &timeout);
+		int frame_wait = frame_timeout();
+		if (frame_wait >= 0 && (timeout < 0 || frame_wait < timeout))
+			timeout = frame_wait;
+		int history_wait = history_timeout();
+		if (history_wait >= 0 && (timeout < 0 || history_wait < timeout))
+			timeout = history_wait;
+		if (find_busy(tabs[current_tab]))
+			timeout = 0;
+		wait_for_events(fds, nfds, timeout);
+		history_tick();
+
+		service_jobs(fds, nfds, fd_tab);
+
 		while (XPending(dpy) > 0)
 		{
 			XNextEvent(dpy, &ev);
-			Tab *current_tab_ptr = &tabs[current_tab];
+			if (XFilterEvent(&ev, None))
+				continue;
+			Tab *current_tab_ptr = tabs[current_tab];
 
 			switch (ev.type)
 			{
 			case Expose:
-				redraw();
+				// The off-screen copy still holds the frame; just present it again
+				if (redraw_pending)
+				{
+					redraw_pending = 2;
+					paint_if_due();
+				}
+				present_area(ev.xexpose.x, ev.xexpose.y, ev.xexpose.width, ev.xexpose.height);
+				break;
+
+			case ConfigureNotify:
+				resize_window(ev.xconfigure.width, ev.xconfigure.height);
+				request_redraw();
+				break;
+
+			case GraphicsExpose:
+				// Only sent if a copy ever reads from the window itself
+				present_area(ev.xgraphicsexpose.x, ev.xgraphicsexpose.y,
+							 ev.xgraphicsexpose.width, ev.xgraphicsexpose.height);
+				break;
+
+			case NoExpose:
+				break;
+
+			case ButtonPress:
+				// Mouse wheel scrolls three rows per notch
+				if (ev.xbutton.button == Button4)
+					scroll_view(current_tab_ptr, 3);
+				else if (ev.xbutton.button == Button5)
+					scroll_view(current_tab_ptr, -3);
+				else
+					break;
+				request_redraw();
 				break;
 
 			case KeyPress:
 			{
-				char buf[32];
-				KeySym ksym;
-				XLookupString(&ev.xkey, buf, sizeof(buf), &ksym, NULL);
+				char buf[64];
+				KeySym ksym = NoSymbol;
+				Status status = XLookupBoth;
+				int len;
+				if (input_context)
+					len = Xutf8LookupString(input_context, &ev.xkey, buf, sizeof(buf) - 1, &ksym, &status);
+				else
+					len = XLookupString(&ev.xkey, buf, sizeof(buf) - 1, &ksym, NULL);
+				if (status != XLookupChars && status != XLookupBoth)
+					len = 0;
+				buf[len] = '\0';
+				// Printable text, possibly several UTF-8 characters from the input method
+				int printable = len > 0 && (unsigned char)buf[0] >= 32 && buf[0] != 127;
 
 				if (current_tab_ptr->in_search_mode)
 				{
 					if (ksym == XK_Escape)
 					{
-						current_tab_ptr->in_search_mode = 0;
-						current_tab_ptr->search_term[0] = '\0';
-						current_tab_ptr->search_pos = 0;
+						hs_end(current_tab_ptr);
 					}
 					else if (ksym == XK_Return)
 					{
-						search_in_history(current_tab_ptr->search_term, current_tab_ptr);
-						current_tab_ptr->in_search_mode = 0;
-						current_tab_ptr->search_term[0] = '\0';
-						current_tab_ptr->search_pos = 0;
+						hs_accept(current_tab_ptr);
+					}
+					else if (ksym == XK_Up || (ksym == XK_r && (ev.xkey.state & ControlMask)))
+					{
+						hs_step(current_tab_ptr, 1);
+					}
+					else if (ksym == XK_Down)
+					{
+						hs_step(current_tab_ptr, -1);
 					}
 					else if (ksym == XK_BackSpace)
 					{
 						if (current_tab_ptr->search_pos > 0)
 						{
-							current_tab_ptr->search_pos--;
+							current_tab_ptr->search_pos = utf8_prev(current_tab_ptr->search_term, current_tab_ptr->search_pos);
 							current_tab_ptr->search_term[current_tab_ptr->search_pos] = '\0';
+							hs_refresh(current_tab_ptr);
 						}
 					}
-					else if (buf[0] >= 32 && buf[0] <= 126)
+					else if (printable && !(ev.xkey.state & ControlMask))
 					{
-						if (current_tab_ptr->search_pos < BUFSIZE - 1)
+						if (reserve_text(&current_tab_ptr->search_term, &current_tab_ptr->search_cap,
+										 current_tab_ptr->search_pos + len))
 						{
-							current_tab_ptr->search_term[current_tab_ptr->search_pos] = buf[0];
-							current_tab_ptr->search_pos++;
+							memcpy(current_tab_ptr->search_term + current_tab_ptr->search_pos, buf, len);
+							current_tab_ptr->search_pos += len;
 							current_tab_ptr->search_term[current_tab_ptr->search_pos] = '\0';
+							hs_refresh(current_tab_ptr);
+						}
+					}
+					request_redraw();
+					break;
+				}
+
+				if (current_tab_ptr->in_find_mode)
+				{
+					Finder *f = &current_tab_ptr->find;
+					if (ksym == XK_Escape)
+					{
+						find_end(current_tab_ptr);
+					}
+					else if (ksym == XK_Down || (ksym == XK_Return && (ev.xkey.state & ShiftMask)))
+					{
+						find_step(current_tab_ptr, 1);
+					}
+					else if (ksym == XK_Up || ksym == XK_Return || (ksym == XK_f && (ev.xkey.state & ControlMask)))
+					{
+						find_step(current_tab_ptr, -1);
+					}
+					else if (ksym == XK_BackSpace)
+					{
+						if (f->len > 0)
+						{
+							f->len = utf8_prev(f->term, f->len);
+							find_update(current_tab_ptr);
+						}
+					}
+					else if (printable && !(ev.xkey.state & ControlMask))
+					{
+						if (reserve_text(&f->term, &f->cap, f->len + len))
+						{
+							memcpy(f->term + f->len, buf, len);
+							f->len += len;
+							find_update(current_tab_ptr);
 						}
 					}
-					redraw();
+					request_redraw();
 					break;
 				}
 
@@ -1985,13 +7918,13 @@ int main()
 					if (ksym == XK_t)
 					{
 						create_new_tab();
-						redraw();
+						request_redraw();
 						break;
 					}
 					else if (ksym == XK_w)
 					{
 						close_current_tab();
-						redraw();
+						request_redraw();
 						break;
 					}
 					else if (ksym == XK_Tab)
@@ -2004,33 +7937,64 @@ int main()
 						{
 							switch_tab(1);
 						}
-						redraw();
+						request_redraw_now();
 						break;
 					}
 					else if (ksym == XK_r)
 					{
-						current_tab_ptr->in_search_mode = 1;
-						current_tab_ptr->search_term[0] = '\0';
-						current_tab_ptr->search_pos = 0;
-						redraw();
+						hs_start(current_tab_ptr);
+						request_redraw();
+						break;
+					}
+					else if (ksym == XK_f)
+					{
+						find_start(current_tab_ptr);
+						request_redraw();
+						break;
+					}
+					else if (ksym == XK_Up || ksym == XK_Down)
+					{
+						command_jump(current_tab_ptr, ksym == XK_Up ? -1 : 1);
+						request_redraw();
+						break;
+					}
+					else if (ksym == XK_o)
+					{
+						command_toggle_fold(current_tab_ptr);
+						request_redraw();
 						break;
 					}
 					else if (ksym == XK_l)
 					{
-						XClearWindow(dpy, win);
-						redraw();
+						// Clear the output, keeping the prompt
+						scrollback_clear(&current_tab_ptr->lines);
+						commands_trim(current_tab_ptr);
+						current_tab_ptr->scrolled = 0;
+						damage_all();
+						request_redraw();
 						break;
 					}
 					else if (ksym == XK_a)
 					{
 						move_cursor_start(current_tab_ptr);
-						redraw();
+						request_redraw();
 						break;
 					}
 					else if (ksym == XK_e)
 					{
 						move_cursor_end(current_tab_ptr);
-						redraw();
+						request_redraw();
+						break;
+					}
+					else if (ksym == XK_c)
+					{
+						job_interrupt(current_tab_ptr);
+						request_redraw();
+						break;
+					}
+					else if (ksym == XK_z)
+					{
+						job_stop(current_tab_ptr);
 						break;
 					}
 				}
@@ -2038,7 +8002,8 @@ int main()
 				// Handle regular input
 				if (ksym == XK_Return)
 				{
-					if (current_tab_ptr->in_pos > 0)
+					// A tab runs one command at a time; keep the input until it is done
+					if (current_tab_ptr->in_pos > 0 && current_tab_ptr->job.state == JOB_IDLE)
 					{
 						// Checks if any unclosed quotes
 						int open_quotes = 0;
@@ -2070,7 +8035,8 @@ int main()
 						// If we have unclosed quotes, add a newline instead of executing
 						if (open_quotes || open_single_quotes)
 						{
-							if (current_tab_ptr->in_pos < BUFSIZE - 2)
+							if (reserve_text(&current_tab_ptr->input_buf, &current_tab_ptr->input_cap,
+											 current_tab_ptr->in_pos + 1))
 							{
 								current_tab_ptr->input_buf[current_tab_ptr->in_pos] = '\n';
 								current_tab_ptr->in_pos++;
@@ -2083,97 +8049,78 @@ int main()
 							current_tab_ptr->input_buf[current_tab_ptr->in_pos] = '\0';
 							add_line_to_tab(current_tab_ptr, PROMPT);
 							add_line_to_tab(current_tab_ptr, current_tab_ptr->input_buf);
+							command_begin(current_tab_ptr, current_tab_ptr->input_buf);
 							execute_command(current_tab_ptr, current_tab_ptr->input_buf);
+							// Built-ins are done already; jobs end in job_finish()
+							if (current_tab_ptr->job.state == JOB_IDLE)
+								command_end(current_tab_ptr, current_tab_ptr->builtin_status);
 							current_tab_ptr->in_pos = 0;
 							current_tab_ptr->input_buf[0] = '\0';
 						}
 					}
 				}
-				else if (ksym == XK_BackSpace)
-				{
-					if (current_tab_ptr->in_pos > 0)
-					{
-						current_tab_ptr->in_pos--;
-						current_tab_ptr->input_buf[current_tab_ptr->in_pos] = '\0';
-					}
-				}
-				else if (ksym == XK_Delete)
+				else if (ksym == XK_BackSpace || ksym == XK_Delete)
 				{
 					// Delete is handled as backspace for simplicity
 					if (current_tab_ptr->in_pos > 0)
 					{
-						current_tab_ptr->in_pos--;
+						current_tab_ptr->in_pos = utf8_prev(current_tab_ptr->input_buf, current_tab_ptr->in_pos);
 						current_tab_ptr->input_buf[current_tab_ptr->in_pos] = '\0';
 					}
 				}
 				else if (ksym == XK_Up)
 				{
-					current_tab_ptr->scroll_offset++;
-					if (current_tab_ptr->scroll_offset > current_tab_ptr->line_count)
-					{
-						current_tab_ptr->scroll_offset = current_tab_ptr->line_count;
-					}
+					scroll_view(current_tab_ptr, 1);
 				}
 				else if (ksym == XK_Down)
 				{
-					current_tab_ptr->scroll_offset--;
-					if (current_tab_ptr->scroll_offset < 0)
-					{
-						current_tab_ptr->scroll_offset = 0;
-					}
+					scroll_view(current_tab_ptr, -1);
+				}
+				else if (ksym == XK_Prior)
+				{
+					scroll_view(current_tab_ptr, visible_rows() - 1);
+				}
+				else if (ksym == XK_Next)
+				{
+					scroll_view(current_tab_ptr, -(visible_rows() - 1));
 				}
 				else if (ksym == XK_Left)
 				{
-					if (current_tab_ptr->in_pos > 0)
-					{
-						current_tab_ptr->in_pos--;
-					}
+					current_tab_ptr->in_pos = utf8_prev(current_tab_ptr->input_buf, current_tab_ptr->in_pos);
 				}
 				else if (ksym == XK_Right)
 				{
-					if (current_tab_ptr->in_pos < strlen(current_tab_ptr->input_buf))
-					{
-						current_tab_ptr->in_pos++;
-					}
+					current_tab_ptr->in_pos = utf8_next(current_tab_ptr->input_buf, current_tab_ptr->in_pos,
+														strlen(current_tab_ptr->input_buf));
 				}
 				else if (ksym == XK_Tab)
 				{
 					handle_auto_complete(current_tab_ptr);
 				}
-				else if (buf[0] >= 32 && buf[0] <= 126)
+				else if (printable)
 				{
-					if (current_tab_ptr->in_pos < BUFSIZE - 1)
+					if (reserve_text(&current_tab_ptr->input_buf, &current_tab_ptr->input_cap,
+									 current_tab_ptr->in_pos + len))
 					{
-						current_tab_ptr->input_buf[current_tab_ptr->in_pos] = buf[0];
-						current_tab_ptr->in_pos++;
+						memcpy(current_tab_ptr->input_buf + current_tab_ptr->in_pos, buf, len);
+						current_tab_ptr->in_pos += len;
 						current_tab_ptr->input_buf[current_tab_ptr->in_pos] = '\0';
 					}
 				}
-				redraw();
+				request_redraw();
 				break;
 			}
 			}
 		}
 
-		// Check for background processes in CURRENT TAB only
-		Tab *current_tab_ptr = &tabs[current_tab];
-		for (int i = 0; i < current_tab_ptr->bg_pid_count; i++)
+		// A search too long for one slice goes on between events
+		if (find_busy(tabs[current_tab]))
 		{
-			if (current_tab_ptr->background_pids[i] > 0)
-			{
-				int status;
-				pid_t result = waitpid(current_tab_ptr->background_pids[i], &status, WNOHANG);
-				if (result > 0)
-				{
-					char msg[256];
-					snprintf(msg, sizeof(msg), "[%d] done", current_tab_ptr->background_pids[i]);
-					add_line_to_tab(current_tab_ptr, msg);
-					current_tab_ptr->background_pids[i] = 0;
-					redraw();
-				}
-			}
+			find_continue(tabs[current_tab]);
+			request_redraw();
 		}
-		sleep(0.01); // 10ms
+
+		paint_if_due();
 	}
 
 	XCloseDisplay(dpy);